@@ -0,0 +1,55 @@
+// mkbuiltins: writes builtins.h, a perfect hash over the builtin names in
+// builtins.def. It tries seeds for an FNV-1a hash until every name lands
+// in its own slot, doubling the table if a size runs out of seeds. Slots
+// come from the top bits: the low bits of FNV barely depend on the seed.
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+static const char *names[] = {
+#define BUILTIN(name, fn) #name,
+#include "builtins.def"
+#undef BUILTIN
+};
+#define NAME_COUNT (int)(sizeof(names) / sizeof(names[0]))
+#define SEED_TRIES 100000
+
+// Keep in step with the copy printed into builtins.h below
+static uint32_t builtin_hash(const char *s, uint32_t seed) {
+    uint32_t h = seed;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+int main() {
+    int bits = 1;
+    while ((1 << bits) < NAME_COUNT * 2) bits++;
+    for (;; bits++) {
+        int slots = 1 << bits;
+        int table[slots];
+        uint32_t seed = 2166136261u;
+        for (int tries = 0; tries < SEED_TRIES; tries++, seed = seed * 1103515245u + 12345u) {
+            memset(table, 0xff, sizeof(table));
+            int i;
+            for (i = 0; i < NAME_COUNT; i++) {
+                int *slot = &table[builtin_hash(names[i], seed) >> (32 - bits)];
+                if (*slot >= 0) break;
+                *slot = i;
+            }
+            if (i < NAME_COUNT) continue;
+            printf("// Generated by mkbuiltins from builtins.def; do not edit.\n");
+            printf("#define BUILTIN_BITS %d\n", bits);
+            printf("#define BUILTIN_SLOTS %d\n", slots);
+            printf("#define BUILTIN_SEED 0x%08xu\n", seed);
+            printf("static const signed char builtin_slot[BUILTIN_SLOTS] = {");
+            for (i = 0; i < slots; i++) printf("%s%d", i == 0 ? "\n    " : i % 16 ? ", " : ",\n    ", table[i]);
+            printf("\n};\n");
+            printf("static inline uint32_t builtin_hash(const char *s) {\n");
+            printf("    uint32_t h = BUILTIN_SEED;\n");
+            printf("    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;\n");
+            printf("    return h;\n");
+            printf("}\n");
+            return 0;
+        }
+    }
+}
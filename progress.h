@@ -0,0 +1,54 @@
+// The progress store, shared by shellquest (which writes it) and
+// shellquest_gui (which watches it). The file is a ProgressHeader followed
+// by one ProgressRecord per quest, and is only ever replaced whole by
+// renaming a new file over it.
+#ifndef SHELLQUEST_PROGRESS_H
+#define SHELLQUEST_PROGRESS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PROGRESS_MAGIC 0x52505153 // "SQPR"
+#define PROGRESS_VERSION 1
+#define PROGRESS_NAME_MAX 32
+#define PROGRESS_FILE "progress"
+
+// Quest states
+#define QUEST_NEW 0
+#define QUEST_STARTED 1
+#define QUEST_DONE 2
+
+struct ProgressHeader {
+    uint32_t magic, version;
+    int32_t xp, level, completed;
+    uint32_t nquests;
+    int64_t saved_at;
+    uint32_t checksum; // FNV-1a of the records
+    uint32_t pad;
+};
+
+struct ProgressRecord {
+    char name[PROGRESS_NAME_MAX];
+    uint8_t state, step;
+    uint16_t pad;
+    uint32_t attempts;
+    int64_t started_at, finished_at;
+};
+
+static inline uint32_t progress_checksum(const char *p, size_t len) {
+    uint32_t h = 2166136261u;
+    while (len--) h = (h ^ (unsigned char)*p++) * 16777619u;
+    return h;
+}
+
+// SHELLQUEST_PROGRESS, else $XDG_STATE_HOME/shellquest/progress, else
+// ~/.local/state/shellquest/progress.
+static inline void progress_default_path(char *out, size_t len) {
+    char *env = getenv("SHELLQUEST_PROGRESS"), *state = getenv("XDG_STATE_HOME"), *home = getenv("HOME");
+    if (env && *env) snprintf(out, len, "%s", env);
+    else if (state && *state) snprintf(out, len, "%s/shellquest/" PROGRESS_FILE, state);
+    else snprintf(out, len, "%s/.local/state/shellquest/" PROGRESS_FILE, home ? home : "/tmp");
+}
+
+#endif
@@ -1,44 +1,438 @@
 #include <linux/module.h>
+#include <linux/version.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/uaccess.h>
 #include <linux/kernel.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/seqlock.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/cred.h>
+#include <linux/uidgid.h>
+#include <linux/timekeeping.h>
+#include <linux/fs.h>
+#include <linux/pid.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/tracepoint.h>
+#include <linux/math64.h>
+#include "shellquest_stats.h"
 
-static struct proc_dir_entry *proc_entry;
-static int shellquest_xp = 0, shellquest_level = 1, shellquest_quests = 0;
+// One record per UID, in an RCU hash keyed by kuid. Readers take no lock:
+// they find a record under rcu_read_lock and copy its stats through a
+// seqcount, retrying if a write raced them. Writers serialise on a mutex,
+// which only they take, so any number of readers never hold up a write.
+// Records live until the module is unloaded.
+//
+// Activity is counted by the kernel itself: probes on the sched_process_exec
+// and sched_process_exit tracepoints count the commands, fork-to-exec time
+// and exit statuses of processes in the session a learner's shell
+// registered with SQ_IOC_TRACK. The counters are per CPU, so busy machines
+// never bounce a shared cache line; readers add them up.
+//
+//   /proc/shellquest/stats        your own record; write "xp level quests" or ioctl
+//   /proc/shellquest/<uid>        one file per learner
+//   /proc/shellquest/leaderboard  everyone, by XP
+//   /proc/shellquest/records      the same as struct sq_record, see the header
+//   /proc/shellquest_stats        link to stats, for the kernelmod quest
+#define SQ_HASH_BITS 8
 
-static ssize_t proc_read(struct file *file, char __user *usr_buf, size_t count, loff_t *pos) {
-    char buffer[128];
-    int len = snprintf(buffer, sizeof(buffer), "ShellQuest Stats: XP=%d, Level=%d, Quests=%d\n",
-                       shellquest_xp, shellquest_level, shellquest_quests);
-    if (*pos >= len) return 0;
-    if (copy_to_user(usr_buf, buffer, len)) return -EFAULT;
-    *pos += len;
-    return len;
+struct sq_user {
+    struct hlist_node node;
+    kuid_t uid;
+    seqcount_mutex_t seq;
+    struct sq_record rec;
+    struct pid *session; // tracked session, compared but never dereferenced by the probes
+    struct sq_activity __percpu *activity;
+};
+
+static DEFINE_HASHTABLE(sq_users, SQ_HASH_BITS);
+static DEFINE_MUTEX(sq_write_lock);
+static struct proc_dir_entry *sq_dir, *sq_link;
+static struct tracepoint *sq_tp_exec, *sq_tp_exit;
+
+static struct sq_user *sq_find(kuid_t uid) {
+    struct sq_user *u;
+    hash_for_each_possible_rcu(sq_users, u, node, __kuid_val(uid)) {
+        if (uid_eq(u->uid, uid)) return u;
+    }
+    return NULL;
+}
+
+static void sq_read(struct sq_user *u, struct sq_record *out) {
+    unsigned int seq;
+    do {
+        seq = read_seqcount_begin(&u->seq);
+        *out = u->rec;
+    } while (read_seqcount_retry(&u->seq, seq));
+    out->uid = from_kuid_munged(current_user_ns(), u->uid);
+}
+
+static void sq_activity_sum(struct sq_user *u, struct sq_activity *sum) {
+    int cpu;
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        struct sq_activity *a = per_cpu_ptr(u->activity, cpu);
+        sum->execs += a->execs;
+        sum->exec_ns += a->exec_ns;
+        sum->exec_max_ns = max(sum->exec_max_ns, a->exec_max_ns);
+        sum->exits += a->exits;
+        sum->failed += a->failed;
+        sum->signalled += a->signalled;
+    }
+}
+
+// The caller's record and activity, or blank ones if they have none
+static void sq_get(struct sq_record *out, struct sq_activity *activity) {
+    struct sq_user *u;
+    *out = (struct sq_record){ from_kuid_munged(current_user_ns(), current_uid()), 0, 1, 0, 0 };
+    memset(activity, 0, sizeof(*activity));
+    rcu_read_lock();
+    u = sq_find(current_uid());
+    if (u) {
+        sq_read(u, out);
+        sq_activity_sum(u, activity);
+    }
+    rcu_read_unlock();
+}
+
+static void sq_show_record(struct seq_file *m, struct sq_record *r, struct sq_activity *a) {
+    seq_printf(m, "ShellQuest Stats: XP=%d, Level=%d, Quests=%d\n", r->xp, r->level, r->quests);
+    seq_printf(m, "Commands=%llu, Exec avg=%lluus max=%lluus, Exits=%llu, Failed=%llu, Signalled=%llu\n",
+               a->execs, a->execs ? div64_u64(a->exec_ns, a->execs) / 1000 : 0, a->exec_max_ns / 1000,
+               a->exits, a->failed, a->signalled);
+}
+
+// /proc/shellquest/<uid>
+static int sq_user_show(struct seq_file *m, void *v) {
+    struct sq_record r;
+    struct sq_activity a;
+    sq_read(m->private, &r);
+    sq_activity_sum(m->private, &a);
+    sq_show_record(m, &r, &a);
+    return 0;
+}
+
+// Add the caller's record and its file. Called with sq_write_lock held.
+static struct sq_user *sq_add(kuid_t uid) {
+    char name[16];
+    struct sq_user *u = kzalloc(sizeof(*u), GFP_KERNEL);
+    if (!u) return NULL;
+    u->uid = uid;
+    u->rec.level = 1;
+    seqcount_mutex_init(&u->seq, &sq_write_lock);
+    u->activity = alloc_percpu(struct sq_activity);
+    snprintf(name, sizeof(name), "%u", from_kuid(&init_user_ns, uid));
+    if (!u->activity || !proc_create_single_data(name, 0444, sq_dir, sq_user_show, u)) {
+        free_percpu(u->activity);
+        kfree(u);
+        return NULL;
+    }
+    hash_add_rcu(sq_users, &u->node, __kuid_val(uid));
+    return u;
+}
+
+// Replace the caller's record
+static int sq_set(int xp, int level, int quests) {
+    struct sq_user *u;
+    kuid_t uid = current_uid();
+    if (xp < 0 || level < 1 || quests < 0) return -EINVAL;
+    mutex_lock(&sq_write_lock);
+    u = sq_find(uid);
+    if (!u) u = sq_add(uid);
+    if (u) {
+        write_seqcount_begin(&u->seq);
+        u->rec.xp = xp;
+        u->rec.level = level;
+        u->rec.quests = quests;
+        u->rec.updated = ktime_get_real_seconds();
+        write_seqcount_end(&u->seq);
+    }
+    mutex_unlock(&sq_write_lock);
+    return u ? 0 : -ENOMEM;
+}
+
+// Count the caller's session from now on, replacing any earlier one
+static int sq_track(void) {
+    struct sq_user *u;
+    kuid_t uid = current_uid();
+    mutex_lock(&sq_write_lock);
+    u = sq_find(uid);
+    if (!u) u = sq_add(uid);
+    if (u) {
+        struct pid *old = u->session;
+        WRITE_ONCE(u->session, get_pid(task_session(current)));
+        put_pid(old);
+    }
+    mutex_unlock(&sq_write_lock);
+    return u ? 0 : -ENOMEM;
+}
+
+// Tracepoint probes. They run with preemption off, so this_cpu_* needs no
+// more protection; nothing else writes the counters.
+static struct sq_user *sq_tracked(struct task_struct *p) {
+    struct sq_user *u = sq_find(task_uid(p));
+    struct pid *session = u ? READ_ONCE(u->session) : NULL;
+    return session && task_session(p) == session ? u : NULL;
+}
+
+static void sq_probe_exec(void *data, struct task_struct *p, pid_t old_pid, struct linux_binprm *bprm) {
+    struct sq_user *u;
+    rcu_read_lock();
+    u = sq_tracked(p);
+    if (u) {
+        u64 ns = ktime_get_ns() - p->start_time;
+        this_cpu_inc(u->activity->execs);
+        this_cpu_add(u->activity->exec_ns, ns);
+        if (ns > this_cpu_read(u->activity->exec_max_ns)) this_cpu_write(u->activity->exec_max_ns, ns);
+    }
+    rcu_read_unlock();
+}
+
+// 6.16 added group_dead to sched_process_exit. The probe is registered
+// untyped, so its signature has to match the running kernel's exactly.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
+static void sq_probe_exit(void *data, struct task_struct *p, bool group_dead) {
+#else
+static void sq_probe_exit(void *data, struct task_struct *p) {
+#endif
+    struct sq_user *u;
+    // One count per process, not per thread
+    if (!thread_group_leader(p)) return;
+    rcu_read_lock();
+    u = sq_tracked(p);
+    if (u) {
+        this_cpu_inc(u->activity->exits);
+        if (p->exit_code & 0x7f) this_cpu_inc(u->activity->signalled);
+        else if (p->exit_code >> 8) this_cpu_inc(u->activity->failed);
+    }
+    rcu_read_unlock();
 }
 
-static ssize_t proc_write(struct file *file, const char __user *usr_buf, size_t count, loff_t *pos) {
-    char buffer[128];
-    if (count > sizeof(buffer) - 1) count = sizeof(buffer) - 1;
+// The sched tracepoints are not exported to modules; find them by name
+static void sq_lookup_tracepoint(struct tracepoint *tp, void *priv) {
+    if (strcmp(tp->name, "sched_process_exec") == 0) sq_tp_exec = tp;
+    else if (strcmp(tp->name, "sched_process_exit") == 0) sq_tp_exit = tp;
+}
+
+// /proc/shellquest/stats: reads, writes and ioctls only ever touch the caller's UID
+static int sq_stats_show(struct seq_file *m, void *v) {
+    struct sq_record r;
+    struct sq_activity a;
+    sq_get(&r, &a);
+    sq_show_record(m, &r, &a);
+    return 0;
+}
+
+static int sq_stats_open(struct inode *inode, struct file *file) {
+    return single_open(file, sq_stats_show, NULL);
+}
+
+static ssize_t sq_stats_write(struct file *file, const char __user *usr_buf, size_t count, loff_t *pos) {
+    char buffer[64];
+    int xp, level, quests, err;
+    if (count >= sizeof(buffer)) return -EINVAL;
     if (copy_from_user(buffer, usr_buf, count)) return -EFAULT;
     buffer[count] = '\0';
-    sscanf(buffer, "%d %d %d", &shellquest_xp, &shellquest_level, &shellquest_quests);
-    return count;
+    if (sscanf(buffer, "%d %d %d", &xp, &level, &quests) != 3) return -EINVAL;
+    err = sq_set(xp, level, quests);
+    return err ? err : count;
+}
+
+static long sq_stats_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct sq_record r;
+    struct sq_activity a;
+    switch (cmd) {
+    case SQ_IOC_GET:
+        sq_get(&r, &a);
+        return copy_to_user((void __user *)arg, &r, sizeof(r)) ? -EFAULT : 0;
+    case SQ_IOC_SET:
+        if (copy_from_user(&r, (void __user *)arg, sizeof(r))) return -EFAULT;
+        return sq_set(r.xp, r.level, r.quests);
+    case SQ_IOC_TRACK:
+        return sq_track();
+    case SQ_IOC_ACTIVITY:
+        sq_get(&r, &a);
+        return copy_to_user((void __user *)arg, &a, sizeof(a)) ? -EFAULT : 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static const struct proc_ops sq_stats_fops = {
+    .proc_open = sq_stats_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
+    .proc_write = sq_stats_write,
+    .proc_ioctl = sq_stats_ioctl,
+    .proc_compat_ioctl = sq_stats_ioctl, // sq_record has the same layout everywhere
+};
+
+// Everyone's records, best XP first. Taken under RCU when a file is opened
+// and sorted outside it; reads of that file then page through the copy, so
+// a long read never holds anything writers need.
+struct sq_board {
+    size_t n;
+    struct sq_record rec[];
+};
+
+static int sq_record_cmp(const void *a, const void *b) {
+    const struct sq_record *x = a, *y = b;
+    if (x->xp != y->xp) return x->xp < y->xp ? 1 : -1;
+    return x->uid < y->uid ? -1 : x->uid > y->uid;
+}
+
+static struct sq_board *sq_snapshot(void) {
+    struct sq_user *u;
+    struct sq_board *board;
+    size_t cap = 0;
+    int bkt;
+    rcu_read_lock();
+    hash_for_each_rcu(sq_users, bkt, u, node) cap++;
+    rcu_read_unlock();
+    // Room for learners who arrive between the count and the copy
+    cap += 16;
+    board = kvmalloc(struct_size(board, rec, cap), GFP_KERNEL);
+    if (!board) return NULL;
+    board->n = 0;
+    rcu_read_lock();
+    hash_for_each_rcu(sq_users, bkt, u, node) {
+        if (board->n == cap) break;
+        sq_read(u, &board->rec[board->n++]);
+    }
+    rcu_read_unlock();
+    sort(board->rec, board->n, sizeof(board->rec[0]), sq_record_cmp, NULL);
+    return board;
+}
+
+// /proc/shellquest/leaderboard: one seq_file record per learner
+static void *sq_board_start(struct seq_file *m, loff_t *pos) {
+    struct sq_board *board = m->private;
+    if (*pos == 0) return SEQ_START_TOKEN;
+    return *pos <= board->n ? &board->rec[*pos - 1] : NULL;
+}
+
+static void *sq_board_next(struct seq_file *m, void *v, loff_t *pos) {
+    ++*pos;
+    return sq_board_start(m, pos);
+}
+
+static void sq_board_stop(struct seq_file *m, void *v) {
+}
+
+static int sq_board_show(struct seq_file *m, void *v) {
+    struct sq_board *board = m->private;
+    struct sq_record *r = v;
+    if (v == SEQ_START_TOKEN) {
+        seq_printf(m, "%-5s %-10s %8s %6s %7s\n", "Rank", "UID", "XP", "Level", "Quests");
+        return 0;
+    }
+    seq_printf(m, "%-5zu %-10u %8d %6d %7d\n", (size_t)(r - board->rec) + 1, r->uid, r->xp, r->level, r->quests);
+    return 0;
+}
+
+static const struct seq_operations sq_board_ops = {
+    .start = sq_board_start,
+    .next = sq_board_next,
+    .stop = sq_board_stop,
+    .show = sq_board_show,
+};
+
+static int sq_board_open(struct inode *inode, struct file *file) {
+    struct sq_board *board = sq_snapshot();
+    int err;
+    if (!board) return -ENOMEM;
+    err = seq_open(file, &sq_board_ops);
+    if (err) {
+        kvfree(board);
+        return err;
+    }
+    ((struct seq_file *)file->private_data)->private = board;
+    return 0;
+}
+
+static int sq_board_release(struct inode *inode, struct file *file) {
+    kvfree(((struct seq_file *)file->private_data)->private);
+    return seq_release(inode, file);
+}
+
+static const struct proc_ops sq_board_fops = {
+    .proc_open = sq_board_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = sq_board_release,
+};
+
+// /proc/shellquest/records: the snapshot as raw struct sq_record
+static int sq_records_open(struct inode *inode, struct file *file) {
+    file->private_data = sq_snapshot();
+    return file->private_data ? 0 : -ENOMEM;
+}
+
+static ssize_t sq_records_read(struct file *file, char __user *usr_buf, size_t count, loff_t *pos) {
+    struct sq_board *board = file->private_data;
+    return simple_read_from_buffer(usr_buf, count, pos, board->rec, board->n * sizeof(board->rec[0]));
+}
+
+static int sq_records_release(struct inode *inode, struct file *file) {
+    kvfree(file->private_data);
+    return 0;
 }
 
-static const struct proc_ops proc_fops = {
-    .proc_read = proc_read,
-    .proc_write = proc_write,
+static const struct proc_ops sq_records_fops = {
+    .proc_open = sq_records_open,
+    .proc_read = sq_records_read,
+    .proc_lseek = default_llseek,
+    .proc_release = sq_records_release,
 };
 
 static int __init shellquest_init(void) {
-    proc_entry = proc_create("shellquest_stats", 0666, NULL, &proc_fops);
-    if (!proc_entry) return -ENOMEM;
+    sq_dir = proc_mkdir("shellquest", NULL);
+    if (!sq_dir) return -ENOMEM;
+    if (!proc_create("stats", 0666, sq_dir, &sq_stats_fops) ||
+        !proc_create("leaderboard", 0444, sq_dir, &sq_board_fops) ||
+        !proc_create("records", 0444, sq_dir, &sq_records_fops)) {
+        proc_remove(sq_dir);
+        return -ENOMEM;
+    }
+    sq_link = proc_symlink("shellquest_stats", NULL, "shellquest/stats");
+    for_each_kernel_tracepoint(sq_lookup_tracepoint, NULL);
+    if (!sq_tp_exec || !sq_tp_exit ||
+        tracepoint_probe_register(sq_tp_exec, sq_probe_exec, NULL) != 0) {
+        pr_warn("ShellQuest: sched tracepoints unavailable, activity will not be counted\n");
+        sq_tp_exec = sq_tp_exit = NULL;
+    } else if (tracepoint_probe_register(sq_tp_exit, sq_probe_exit, NULL) != 0) {
+        tracepoint_probe_unregister(sq_tp_exec, sq_probe_exec, NULL);
+        pr_warn("ShellQuest: sched tracepoints unavailable, activity will not be counted\n");
+        sq_tp_exec = sq_tp_exit = NULL;
+    }
     pr_info("ShellQuest module loaded\n");
     return 0;
 }
 
 static void __exit shellquest_exit(void) {
-    proc_remove(proc_entry);
+    struct sq_user *u;
+    struct hlist_node *tmp;
+    int bkt;
+    if (sq_tp_exec) {
+        tracepoint_probe_unregister(sq_tp_exec, sq_probe_exec, NULL);
+        tracepoint_probe_unregister(sq_tp_exit, sq_probe_exit, NULL);
+        tracepoint_synchronize_unregister();
+    }
+    proc_remove(sq_link);
+    // Waits for open readers, so nothing can reach a record after this
+    proc_remove(sq_dir);
+    hash_for_each_safe(sq_users, bkt, tmp, u, node) {
+        hash_del(&u->node);
+        put_pid(u->session);
+        free_percpu(u->activity);
+        kfree(u);
+    }
     pr_info("ShellQuest module unloaded\n");
 }
 
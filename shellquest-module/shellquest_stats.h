@@ -0,0 +1,36 @@
+#ifndef SHELLQUEST_STATS_H
+#define SHELLQUEST_STATS_H
+
+// Binary interface to the shellquest_stats module, shared with user space.
+// /proc/shellquest/records reads as an array of struct sq_record, best XP
+// first, taken as one snapshot when the file is opened. ioctls on
+// /proc/shellquest/stats get and set the caller's own record, register the
+// caller's session for activity counting, and read that activity.
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+struct sq_record {
+    __u32 uid;
+    __s32 xp;
+    __s32 level;
+    __s32 quests;
+    __s64 updated; // seconds since the epoch, 0 if never written
+};
+
+// Counted by the module from sched tracepoints; user space cannot set these
+struct sq_activity {
+    __u64 execs;       // successful execs
+    __u64 exec_ns;     // summed fork-to-exec time
+    __u64 exec_max_ns;
+    __u64 exits;       // processes that ended
+    __u64 failed;      // exited with a non-zero status
+    __u64 signalled;   // killed by a signal
+};
+
+#define SQ_IOC_MAGIC 'Q'
+#define SQ_IOC_GET _IOR(SQ_IOC_MAGIC, 1, struct sq_record)
+#define SQ_IOC_SET _IOW(SQ_IOC_MAGIC, 2, struct sq_record) // uid and updated are ignored
+#define SQ_IOC_TRACK _IO(SQ_IOC_MAGIC, 3)
+#define SQ_IOC_ACTIVITY _IOR(SQ_IOC_MAGIC, 4, struct sq_activity)
+
+#endif
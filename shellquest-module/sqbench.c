@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "shellquest_stats.h"
+
+// Reads per second of the whole leaderboard, as text parsed with sscanf
+// and as binary struct sq_record. Run as root with a user count to first
+// give that many fake UIDs a record; they stay until the module is removed.
+//
+//   sqbench [users] [reads]
+#define BENCH_BASE_UID 200000
+#define BUF_SIZE (1 << 20)
+
+char buf[BUF_SIZE];
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void populate(int users) {
+    for (int i = 0; i < users; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            struct sq_record r = { 0, rand() % 10000, 1 + rand() % 20, rand() % 15, 0 };
+            int fd = open("/proc/shellquest/stats", O_RDONLY);
+            if (setuid(BENCH_BASE_UID + i) != 0 || fd < 0 || ioctl(fd, SQ_IOC_SET, &r) != 0) _exit(1);
+            _exit(0);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || status != 0) {
+            printf("Error: could not add UID %d (need root and the module loaded)\n", BENCH_BASE_UID + i);
+            exit(1);
+        }
+    }
+}
+
+// One full read of the leaderboard; returns the number of records
+int read_text() {
+    int fd = open("/proc/shellquest/leaderboard", O_RDONLY);
+    if (fd < 0) return -1;
+    int records = 0;
+    size_t have = 0;
+    ssize_t n;
+    while ((n = read(fd, buf + have, sizeof(buf) - have - 1)) > 0) {
+        have += n;
+        buf[have] = '\0';
+        char *line = buf, *nl;
+        while ((nl = strchr(line, '\n'))) {
+            unsigned rank, uid;
+            int xp, level, quests;
+            if (sscanf(line, "%u %u %d %d %d", &rank, &uid, &xp, &level, &quests) == 5) records++;
+            line = nl + 1;
+        }
+        have = buf + have - line;
+        memmove(buf, line, have);
+    }
+    close(fd);
+    return records;
+}
+
+int read_binary() {
+    int fd = open("/proc/shellquest/records", O_RDONLY);
+    if (fd < 0) return -1;
+    int records = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        struct sq_record *r = (struct sq_record *)buf;
+        for (size_t i = 0; i < n / sizeof(*r); i++) {
+            if (r[i].level > 0) records++;
+        }
+    }
+    close(fd);
+    return records;
+}
+
+void bench(const char *name, int (*fn)(), int reads) {
+    int records = 0;
+    double start = now();
+    for (int i = 0; i < reads; i++) {
+        records = fn();
+        if (records < 0) {
+            printf("Error: %s: cannot open the module's files (is it loaded?)\n", name);
+            exit(1);
+        }
+    }
+    double secs = now() - start;
+    printf("%-7s %6d records  %10.0f reads/s  %8.2f us/read\n", name, records, reads / secs, secs * 1e6 / reads);
+}
+
+int main(int argc, char *argv[]) {
+    int users = argc > 1 ? atoi(argv[1]) : 0;
+    int reads = argc > 2 ? atoi(argv[2]) : 1000;
+    if (users > 0) populate(users);
+    bench("text", read_text, reads);
+    bench("binary", read_binary, reads);
+    return 0;
+}
@@ -1,65 +1,665 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <stdatomic.h>
+#include <spawn.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/mount.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/fsuid.h>
+#include <pwd.h>
+#include <grp.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <regex.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
 #include <readline/readline.h>
 #include <readline/history.h>
+#include "progress.h"
+#include "shellquest-module/shellquest_stats.h"
 
 // Game state
 int xp = 0;
 int level = 1;
 int completed_quests = 0;
-#define TOTAL_QUESTS 8 // 5 main + 3 ls sub-quests
 char current_dir[1024] = "/tmp/shellquest";
-FILE *progress_file;
-int ls_subquest_stage = 0;
+int shell_exit = 0, exit_status = 0;
+int last_status = 0; // of the last line run
 
-// Job management
-struct Job {
+// Quest engine: quests are loaded from quests.def into flat tables with all
+// text in one string pool, indexed by name and topic through hash tables.
+// One state machine runs whichever quest is active.
+#define QUEST_FILE "/usr/local/share/shellquest/quests.def"
+struct QuestStep {
+    int xp;
+    int text, enter, brief, detail, say, retry, bench; // offsets into quest_strings, -1 if unset
+};
+struct QuestFixture {
+    int path, contents; // contents is -1 for a directory
+};
+struct Quest {
+    int name, topic, intro, cwd, action;
+    int first_step, nsteps;
+    int first_fixture, nfixtures;
+    int unlocked_by; // quest that has to be completed first, -1 if none
+    int next_in_topic;
+    int host; // needs the real system, which a user namespace hides
+};
+struct Quest *quests;
+struct QuestStep *quest_steps;
+struct QuestFixture *quest_fixtures;
+char *quest_strings;
+int quest_count = 0, quest_step_count = 0, quest_fixture_count = 0;
+size_t quest_strings_len = 0;
+int *quest_by_name, *quest_by_topic; // open addressing, -1 = empty
+int quest_index_size = 0;
+struct QuestProgress {
+    unsigned char state, step; // step: furthest step reached
+    unsigned attempts;
+    int64_t started_at, finished_at; // Unix time, 0 if never
+};
+struct QuestProgress *quest_progress;
+int active_quest = -1, active_step = 0;
+
+// Command matchers: every step's patterns are compiled at load time into
+// one trie over words. A line is tokenized once; its short flags, wherever
+// they appear, fold into a set (-la, -al and -l -a are the same), and the
+// other words walk the trie with one hash probe each, so checking a line
+// costs the same however many patterns there are. A pattern word written
+// /re/ matches by extended regex.
+struct MatchNode {
+    int regex_edges; // first in match_regex, -1 if none
+    int accepts; // first in match_accepts, -1 if none
+};
+struct MatchEdge {
+    int from, word, to; // word is an offset into quest_strings
+};
+struct MatchRegex {
+    regex_t re;
+    int source; // pattern text, for sharing identical edges
+    int to, next;
+};
+struct MatchAccept {
+    uint64_t flags;
+    int step, next;
+};
+struct MatchNode *match_nodes;
+struct MatchEdge *match_edges; // open addressing on (from, word), from -1 = empty
+struct MatchRegex *match_regex;
+struct MatchAccept *match_accepts;
+int match_node_count = 0, match_edge_count = 0, match_regex_count = 0, match_accept_count = 0;
+int match_edge_size = 0;
+
+// Progress store: a versioned binary file kept outside the sandbox, which
+// is wiped on exit. It is replaced whole by writing a temporary file and
+// renaming it over the old one, and only when something in it changed,
+// so saving after every command is cheap. Quests are recorded by name and
+// survive catalogue changes. The format is in progress.h, which the GUI
+// shares; the GUI watches the file with inotify.
+#define PROGRESS_LEGACY "/tmp/shellquest/.quest_progress"
+char progress_path[PATH_MAX];
+char *progress_saved; // header and records as last written
+size_t progress_saved_len = 0;
+// The kernel module keeps one record per UID; totals are mirrored into it
+// through its ioctl on each save when it is loaded, and it counts the
+// commands this session runs itself.
+#define KMOD_STATS "/proc/shellquest/stats"
+
+// Session log: every command line with its timing, exit status and the
+// quest step it was typed at, plus quest starts and completions. The shell
+// only copies an event into a single-producer ring and moves on; a writer
+// thread appends them in batches to this session's file in sessions/
+// beside the progress store. shellquest --replay and --report read them.
+#define LOG_DIR "sessions"
+#define LOG_MAGIC 0x474c5153 // "SQLG"
+#define LOG_VERSION 1
+#define LOG_RING 1024 // events, a power of two
+#define LOG_CMD_MAX 256 // command lines are cut to this
+#define LOG_FLUSH_MS 1000
+#define LOG_COMMAND 1
+#define LOG_QUEST_START 2
+#define LOG_QUEST_DONE 3
+#define LOG_SESSION_END 4 // status is the number of events dropped
+struct LogHeader {
+    uint32_t magic, version;
+    uint32_t uid, pid;
+    int64_t started; // ns since the epoch, as are all times here
+    char user[32];
+};
+struct LogEvent {
+    uint16_t size; // on disk the event stops after cmd_len bytes of cmd
+    uint8_t type;
+    uint8_t pad;
+    int32_t status;
+    int64_t start, end;
+    char quest[PROGRESS_NAME_MAX];
+    int16_t step;
+    uint16_t cmd_len;
+    char cmd[LOG_CMD_MAX];
+};
+#define LOG_EVENT_HDR offsetof(struct LogEvent, cmd)
+struct LogEvent log_ring[LOG_RING];
+atomic_ulong log_head, log_tail; // next slot to fill, next to write out
+atomic_int log_stop;
+int log_fd = -1, log_wake = -1, log_running = 0, log_dropped = 0;
+pthread_t log_thread;
+
+// Perf: how long each stage of a turn at the prompt takes, in log-linear
+// histograms with a fixed number of buckets, HDR style: values below
+// PERF_SUB ns are exact, and above that every power of two is cut into
+// PERF_SUB / 2 buckets, so a bucket is never more than 1/32 of its values
+// wide. Recording is a clock read and an increment. 'perf' prints them;
+// SHELLQUEST_PERF=<file> writes them as JSON at exit ("%p" becomes the
+// pid, for the daemon's sessions). The file is opened at startup, while
+// the real filesystem is still writable.
+#define PERF_SUB_BITS 6
+#define PERF_SUB (1 << PERF_SUB_BITS)
+#define PERF_BUCKETS ((64 - PERF_SUB_BITS + 2) * (PERF_SUB / 2))
+enum { PERF_TURN, PERF_DISPATCH, PERF_BUILTIN, PERF_SPAWN, PERF_WAIT, PERF_SETUP, PERF_TEARDOWN, PERF_SAVE, PERF_HASH, PERF_COMPLETE, PERF_STAGES };
+struct PerfHist {
+    const char *name, *what;
+    uint64_t count, sum, max;
+    uint32_t bucket[PERF_BUCKETS];
+};
+struct PerfHist perf_hist[PERF_STAGES] = {
+    [PERF_TURN] = { "turn", "readline returning to the next prompt" },
+    [PERF_DISPATCH] = { "dispatch", "readline returning to the command starting: quest match, lex, parse" },
+    [PERF_BUILTIN] = { "builtin", "a builtin, in the shell" },
+    [PERF_SPAWN] = { "spawn", "fork/exec of one external command, as the shell sees it" },
+    [PERF_WAIT] = { "wait", "a foreground job, until it ends or stops" },
+    [PERF_SETUP] = { "setup", "a quest's sandbox and fixtures" },
+    [PERF_TEARDOWN] = { "teardown", "leaving a quest" },
+    [PERF_SAVE] = { "save", "save_progress" },
+    [PERF_HASH] = { "hash", "scanning $PATH into the command hash" },
+    [PERF_COMPLETE] = { "complete", "a tab completion" },
+};
+int64_t perf_turn = 0; // when readline returned, until dispatch is recorded
+FILE *perf_out = NULL;
+
+// Script: shellquest --script [-v] [-t] [file] plays a script against a
+// shell with a fresh progress store and no terminal, and reports each case
+// as passed or failed with its time; no file, or '-', reads stdin. The
+// shell's output, children's included, goes to a memfd that the checks
+// read; -v copies it out as a transcript, -t reports tab-separated. Lines:
+//
+//   case <name>     starts a case, timed until the next one
+//   input <line>    fed to the shell as if typed, at the prompt or a question
+//   expect <text>   the output since the last input contains text
+//   reject <text>   the output since the last input does not contain text
+//   done <quest>    the quest is complete
+//   xp <n>          XP is n
+//
+// shellquest --quest-script prints one that plays the whole catalogue (a
+// step's "bench" command in place of one that only waits), and
+// shellquest --bench [-n runs] [-j procs] [script] runs it (or another) in
+// parallel processes for throughput and per-case tail latency.
+#define SCRIPT_OUTPUT_MAX (1 << 20) // checked per input; the rest is only counted
+FILE *script_in = NULL;
+int script_line = 0, script_verbose = 0, script_terse = 0;
+int script_out = -1, script_capture = -1; // the real stdout; the memfd in its place
+char script_output[SCRIPT_OUTPUT_MAX + 1];
+size_t script_output_len = 0;
+char script_case[64] = "", script_reason[256] = "";
+int script_case_open = 0, script_cases = 0, script_failed = 0;
+int64_t script_case_start = 0;
+
+// Fixtures: quest files are created with direct syscalls and torn down by
+// renaming them into the trash, which a background thread empties.
+#define SANDBOX_DIR "/tmp/shellquest"
+#define TRASH_DIR "/tmp/shellquest/.trash"
+pthread_t reaper_thread;
+pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reaper_cond = PTHREAD_COND_INITIALIZER;
+int reaper_pending = 0, reaper_stop = 0, reaper_running = 0;
+unsigned long trash_seq = 0;
+
+// Sandbox: where namespaces allow, the shell moves into a private mount
+// namespace (inside a user namespace unless it is root) before any thread
+// starts. The real filesystem is read-only there, apart from the progress
+// store and session logs, and /tmp is a private tmpfs. Every quest's
+// fixtures are built once into a read-only lower tree; the sandbox is an
+// overlay of the active quest's tree under a fresh tmpfs upper layer. A
+// reset lazily unmounts both and mounts new ones, and the reaper drops the
+// last reference to the old layer, so it costs the same whatever the
+// learner created. Each sandbox also gets a cgroup v2 leaf with the limits
+// below, which the shell itself moves into so its children start inside;
+// limits the cgroup cannot enforce become rlimits, set in each child
+// before it execs (so such children start through fork, not spawn).
+// SHELLQUEST_SANDBOX=off, or no namespaces, keeps the plain directory.
+#define SANDBOX_PLAIN 0
+#define SANDBOX_OVERLAY 1
+#define SANDBOX_USERNS 2 // overlay, as an unprivileged user
+#define SANDBOX_STAGE "/tmp/.shellquest" // lower/<quest>, and layer/ for the upper tmpfs
+#define SANDBOX_UPPER_OPTS "mode=0755,size=256m"
+#define SANDBOX_CPU_MAX "100000 100000" // one CPU
+#define SANDBOX_MEMORY_MAX (512L << 20)
+#define SANDBOX_PIDS_MAX 256
+#define SANDBOX_CPU_SECONDS 300 // rlimit stand-in for cpu.max
+#define SANDBOX_LIMIT_CPU 1
+#define SANDBOX_LIMIT_MEMORY 2
+#define SANDBOX_LIMIT_PIDS 4
+#define SANDBOX_DROP_MAX 16
+int sandbox_mode = SANDBOX_PLAIN;
+char sandbox_cgroup[PATH_MAX + 32]; // this session's cgroup, "" without one
+char sandbox_cgroup_home[PATH_MAX]; // the one the shell started in
+char sandbox_leaf[sizeof(sandbox_cgroup) + 64]; // the shell's own
+int sandbox_limits = 0; // enforced by the cgroup
+int sandbox_generation = 0;
+int sandbox_drop[SANDBOX_DROP_MAX], sandbox_drops = 0; // old sandboxes for the reaper to let go of
+
+// Daemon: shellquest --serve loads the catalogue and builds the sandbox's
+// fixture tree once, then takes sessions over a Unix socket. The shell's
+// state is per process, so each session is a child forked from the loaded
+// daemon, sharing all of that copy-on-write, on a PTY of its own; a pool of
+// epoll workers moves the bytes between PTYs and clients. A root daemon
+// serves every user, each session running as its peer's UID in a user
+// namespace of its own; any other daemon serves only its own user.
+// Clients send a hello, then framed keystrokes and window sizes; the
+// server sends back the PTY's output as is. Until its hello is complete a
+// connection waits, non-blocking, in the accept loop's pending list, and is
+// dropped after SERVE_HELLO_MS, so a silent client holds up nobody else.
+#define SERVE_SOCKET "/run/shellquest.sock" // root's; users get one in XDG_RUNTIME_DIR
+#define SERVE_MAGIC 0x56525153 // "SQRV"
+#define SERVE_DATA 1
+#define SERVE_WINSIZE 2 // a struct winsize
+#define SERVE_FRAME_MAX 1024
+#define SERVE_BUF 4096
+#define SERVE_WORKERS_MAX 16
+#define SERVE_PROMPT "ShellQuest [Lv" // how the load test sees a prompt
+#define SERVE_PENDING_MAX 256 // connections without a hello yet; the oldest goes first
+#define SERVE_HELLO_MS 2000
+struct ServeHello {
+    uint32_t magic;
+    uint16_t rows, cols;
+};
+struct ServePending {
+    int fd;
+    size_t len; // of the hello so far
+    struct ServeHello hello;
+    int64_t deadline; // perf_now() ns
+};
+struct ServeFrame {
+    uint8_t type, pad;
+    uint16_t len;
+};
+struct ServeSession;
+struct ServeEnd {
+    struct ServeSession *s;
+    int fd;
+    uint32_t events; // registered with the worker's epoll
+};
+struct ServeSession {
+    struct ServeEnd client, pty;
     pid_t pid;
-    char cmd[256];
-    int status; // 0: running, 1: stopped
+    int epoll, closed;
+    char in[SERVE_BUF]; // from the client, not yet parsed
+    size_t in_len;
+    char to_pty[SERVE_BUF];
+    size_t to_pty_len, to_pty_off;
+    char out[SERVE_BUF]; // from the PTY, not yet taken by the client
+    size_t out_len, out_off;
+};
+int serve_epoll[SERVE_WORKERS_MAX];
+int serve_handoff[SERVE_WORKERS_MAX][2]; // new sessions, passed to their worker by pointer
+atomic_int serve_sessions;
+
+// Builtins: the names live in builtins.def and mkbuiltins turns them into
+// a perfect hash (builtins.h) at build time, so finding one costs a hash
+// and a strcmp. Builtins run inside the shell, with their redirections
+// applied to the shell's own descriptors for the duration of the call.
+typedef int (*BuiltinFn)(int argc, char **argv);
+#define BUILTIN(name, fn) int fn(int argc, char **argv);
+#include "builtins.def"
+#undef BUILTIN
+struct Builtin {
+    const char *name;
+    BuiltinFn run;
+} builtins[] = {
+#define BUILTIN(name, fn) { #name, fn },
+#include "builtins.def"
+#undef BUILTIN
+};
+#include "builtins.h"
+
+// Shell parser: a line is lexed once into words and operators, then
+// parsed into a pipeline whose commands carry their own redirections.
+#define TOK_WORD 0
+#define TOK_PIPE 1
+#define TOK_AMP 2
+#define TOK_REDIR 3
+#define TOK_LIST 4 // ; && || are recognised only to be refused
+struct Token {
+    int type;
+    int fd, op, dup_fd; // redirections: op is '<', '>', 'a' (>>) or '&' (n>&m)
+    char *text; // the word with quotes removed, or the operator as typed
+};
+struct Tokens {
+    struct Token *tok;
+    int count;
+    char *buf;
+};
+struct Redirect {
+    int fd, op, dup_fd;
+    char *path;
+};
+struct Command {
+    char **argv;
+    int argc;
+    struct Redirect *redirs;
+    int nredirs;
 };
-struct Job jobs[10];
-int job_count = 0;
+struct Pipeline {
+    struct Command *cmds;
+    int ncmds;
+    int background;
+    char **argv_pool;
+    struct Redirect *redir_pool;
+};
+int builtin_input = -1; // fd a builtin reads as stdin, -1 for the terminal
+
+// Launching: external commands start through posix_spawn, which glibc
+// implements with a vfork-style clone, so launch cost does not grow with
+// the shell's own memory the way fork's page-table copy does. fork stays
+// as the fallback, or on request with SHELLQUEST_SPAWN=fork.
+#define SPAWN_POSIX 0
+#define SPAWN_FORK 1
+int spawn_backend = SPAWN_POSIX;
+
+// Command hash: every executable on $PATH by name, so a launch goes
+// straight to its absolute path instead of probing each directory in turn.
+// It is built whole at startup, first directory winning as in a PATH
+// search. An inotify watch on each directory, read without blocking before
+// a lookup, marks the table stale when an entry comes, goes or changes
+// mode; so does a new $PATH. The next lookup then rebuilds it.
+//
+// Tab completion reads the same scan: command, builtin and quest names sit
+// in one sorted array, so the names with a prefix are a binary search away.
+#define COMPLETE_COMMAND 1
+#define COMPLETE_BUILTIN 2
+#define COMPLETE_QUEST 4
+#define PATH_WATCH (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+struct PathCommand {
+    int name, dir; // offsets into path_strings
+};
+struct CompleteWord {
+    const char *name;
+    int kinds; // COMPLETE_ bits
+};
+struct PathCommand *path_commands;
+int path_command_count = 0;
+char *path_strings;
+size_t path_strings_len = 0, path_strings_cap = 0;
+int *path_hash; // open addressing into path_commands, -1 = empty
+int path_hash_size = 0;
+struct CompleteWord *complete_words;
+int complete_word_count = 0;
+char *path_current; // the $PATH the table was built from
+int path_watch_fd = -1, path_stale = 1;
+int64_t path_build_ns = 0;
+
+// Job control: every pipeline with an external stage is a job with its own
+// process group. The table is indexed by job id and doubles as needed.
+// SIGCHLD is blocked and read from job_event_fd, a signalfd (a self-pipe
+// where that is missing), which the prompt polls next to the terminal:
+// children are reaped as they change state and "[n] Done" shows up at once.
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_DONE 2
+#define JOB_POLL_MS 100 // also paces the journal's group-commit timer
+struct Job {
+    int id;
+    pid_t pgid;
+    pid_t *pids; // 0 once reaped
+    int npids, alive;
+    pid_t last; // last stage, whose status is the job's; 0 if a builtin
+    int state, status;
+    int notify; // changed state in the background: report at the prompt
+    char *cmd;
+};
+struct Job **job_table; // by id, NULL if free
+int job_table_size = 0, job_max_id = 0, job_current = 0;
+int job_event_fd = -1, job_pipe[2] = {-1, -1};
+int shell_tty = -1; // the terminal's fd when interactive
+pid_t shell_pgid, fg_pgid = 0;
+struct termios shell_tmodes;
 
 // VFS simulation
-#define VFS_SIZE 1048576
-char vfs_disk[VFS_SIZE];
+// The VFS lives in one image file mapped at startup: superblock, free-space
+// bitmap and summary, inode table, then data blocks. Regions start on page
+// boundaries; a new image is a sparse file, so formatting writes almost
+// nothing. SHELLQUEST_VFS_SIZE and SHELLQUEST_VFS_INODES size new images.
+//
+// The mapping is private, so changes reach the image only through the
+// journal next to it: every page an operation touches is marked dirty, and
+// a group commit appends all of them to the journal with one fdatasync
+// before copying them home. Startup replays whatever the journal holds.
+#define VFS_IMAGE "/tmp/shellquest/.vfs.img"
+#define VFS_SERVE_IMAGE "vfs.img" // beside the progress store, for daemon sessions
+#define VFS_MAGIC 0x53465153 // "SQFS"
+#define VFS_VERSION 2
+#define VFS_JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+#define VFS_COMMIT_MAGIC 0x544d4d43 // "CMMT"
+#define VFS_JOURNAL_BATCH 32 // operations per group commit
+#define VFS_JOURNAL_INTERVAL_MS 500 // or this long after the first uncommitted one
+#define VFS_JOURNAL_MAX (4 << 20) // checkpoint once the journal grows past this
+#define VFS_SIZE 1048576 // default data area
+#define VFS_MAX_INODES 65536 // default inode table size
+#define VFS_BLOCK_SIZE 512
+#define VFS_PAGE 4096
+#define VFS_MAX_EXTENTS 8
+#define VFS_ROOT_INO 0
+#define VFS_MIN_BUCKETS (VFS_BLOCK_SIZE / 4)
+struct VfsSuper {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t image_size;
+    int32_t block_size;
+    int32_t blocks;
+    int32_t bitmap_words;
+    int32_t summary_words;
+    int32_t max_inodes;
+    int32_t free_blocks;
+    int32_t alloc_hint; // block where the next search starts
+    int32_t free_inode; // head of the free inode list, chained through Inode.next
+    int32_t inode_hwm;  // inodes at or above this have never been handed out
+    int32_t pad;
+    uint64_t bitmap_off, summary_off, inode_off, data_off;
+    uint64_t commit_seq; // last transaction committed to this image
+};
+struct JournalHeader {
+    uint32_t magic;
+    uint32_t npages; // followed by npages page numbers, then the pages
+    uint64_t seq;
+};
+struct JournalCommit {
+    uint32_t magic;
+    uint32_t npages;
+    uint64_t seq;
+    uint64_t checksum; // over the page numbers and page contents
+};
+char vfs_image_path[PATH_MAX] = VFS_IMAGE;
+char *vfs_image = NULL;
+size_t vfs_image_size = 0;
+int vfs_image_fd = -1;
+int vfs_journal_fd = -1;
+off_t vfs_journal_size = 0;
+// Pages dirtied since the last commit: a bitmap for dedup plus a list.
+uint64_t *vfs_dirty_map;
+uint64_t *vfs_dirty_list;
+int vfs_dirty_count = 0, vfs_dirty_cap = 0;
+int vfs_pending_ops = 0;
+struct timespec vfs_txn_start;
+int vfs_fault_countdown = 0; // crash test: abort() when this reaches zero
+int vfs_commit_notify_fd = -1; // crash test: committed sequence numbers go here
+struct VfsSuper *vfs_sb;
+char *vfs_disk; // data blocks
+// Free-space bitmap: bit set = block in use. The summary has one bit per
+// bitmap word, set when that word is full, so a free block is two ctz away.
+uint64_t *vfs_bitmap;
+uint64_t *vfs_bitmap_full;
+struct Extent {
+    int start;
+    int len;
+};
+enum { VFS_FREE = 0, VFS_FILE = 1, VFS_DIR = 2 };
 struct Inode {
     char name[32];
     int size;
-    int start_block;
+    int start_block; // first block of the file, -1 if none
+    int type;
+    int parent;   // inode number of the containing directory
+    int next;     // next inode in the parent's hash chain, or on the free list
+    int nentries; // directories: number of entries
+    int nbuckets; // directories: hash buckets, stored in the directory's blocks
+    int extent_count;
+    struct Extent extents[VFS_MAX_EXTENTS];
 };
-struct Directory {
-    struct Inode files[10];
-    int file_count;
+struct Inode *vfs_inodes;
+int vfs_cwd = VFS_ROOT_INO;
+// Block cache between file I/O and vfs_disk: write-through, LRU eviction,
+// and readahead once a file is being read sequentially.
+#define VFS_CACHE_BLOCKS 16
+#define VFS_READAHEAD 4
+struct CacheBlock {
+    int block; // -1 if unused
+    unsigned long last_used;
+    char data[VFS_BLOCK_SIZE];
 };
-struct Directory vfs_root = { .file_count = 0 };
+struct CacheBlock vfs_cache[VFS_CACHE_BLOCKS];
+unsigned long vfs_cache_clock = 0;
+struct {
+    unsigned long hits, misses, blocks_read, readahead, blocks_written;
+} vfs_cache_stats;
+int vfs_ra_ino = -1, vfs_ra_next = 0; // next logical block if the reader stays sequential
 
-// Process for scheduler
+// Scheduler simulator. Ready processes wait in a binary heap ordered by
+// the key their policy gives them when they become ready, ties going to
+// whoever queued first; time jumps from one event (arrival, completion,
+// end of a quantum) to the next.
+#define SCHED_MAX_CORES 64
+#define SCHED_GANTT_MAX 48 // segments kept per core for the chart
+#define SCHED_TABLE_MAX 20 // processes listed one by one
+#define SCHED_MLFQ_LEVELS 3
 struct Process {
     int pid;
-    int arrival;
-    int burst;
+    int priority; // lower runs first
+    long arrival;
+    long burst;
+    long remaining, start, finish; // start is -1 until first dispatched
+    int level; // MLFQ queue
+};
+
+// Heap entries carry their order with them, so sifting never touches procs
+struct SchedEntry {
+    long key, seq;
+    int proc;
+};
+
+struct SchedPolicy {
+    const char *name;
+    int preemptive; // a ready process with a better key takes a CPU over
+    long (*key)(struct Process *p);
+    long (*quantum)(struct Process *p, long q); // NULL: run to completion
+    void (*expired)(struct Process *p); // used up its quantum
+};
+
+struct Gantt {
+    int pid;
+    long start, end;
+};
+
+struct SchedCore {
+    int proc; // index into procs, -1 when idle
+    long since, slice_end;
+    struct Gantt seg[SCHED_GANTT_MAX];
+    int nseg, dropped;
+};
+
+struct SchedSummary {
+    double wait, turnaround, response, busy; // averages, except busy
+    long max_wait, makespan;
+};
+
+// Real runs put each workload process in a child that burns burst * tick
+// of CPU under a real kernel policy, then compare with the simulator.
+#define SCHED_TICK_MS 10
+#define SCHED_REAL_MAX 1000
+struct SchedConfig {
+    const char *name;
+    int policy; // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+    int nice; // children run at nice = priority * 2
+    int pinned; // everything on one CPU
+    const char *model; // simulator policy it is compared with
+};
+
+// What a child measured about itself, sent up a pipe as it finishes
+struct SchedSample {
+    int index;
+    double start, end; // CLOCK_MONOTONIC seconds
+    unsigned long long run_ns, wait_ns; // /proc/<pid>/schedstat
+};
+
+struct Sched {
+    const struct SchedPolicy *policy;
+    long quantum;
+    int ncores;
+    struct Process *procs;
+    int n;
+    struct SchedEntry *heap;
+    int heap_len;
+    long seq;
+    struct SchedCore *core;
 };
 
 // Function prototypes
 void print_prompt();
-int execute_command(char *cmd, int bg);
+char *shell_readline();
+int shell_lex(const char *line, struct Tokens *t);
+void tokens_free(struct Tokens *t);
+int shell_parse(struct Tokens *t, struct Pipeline *p);
+void pipeline_free(struct Pipeline *p);
+int run_pipeline(struct Pipeline *p, const char *text);
+int run_builtin(struct Builtin *b, struct Command *c, int in, int out);
+pid_t spawn_command(struct Command *c, int in, int out, pid_t pgid, int backend);
+void path_build();
+const char *path_lookup(const char *name);
+char **shell_complete(const char *text, int start, int end);
+int spawn_bench(int runs);
+int run_input(char *input);
+struct Builtin *builtin_find(const char *name);
 void teach_command(char *cmd);
-void quest_ls();
-void quest_cd();
-void quest_cat();
-void quest_mkdir();
-void quest_touch();
-void quest_grep();
-void quest_jobs();
-void quest_schedule();
-void quest_kernelmod();
+void quests_load();
+int quest_lookup(int *index, const char *key, int field);
+void quest_start(int q);
+void quest_end();
+int quest_input(char *input);
+int match_line(const char *line, int step);
 void show_explanation(const char *cmd, const char *brief, const char *detailed);
 void check_level_up();
 void show_stats();
@@ -67,71 +667,169 @@ void show_guide();
 void list_quests();
 void setup_sandbox();
 void cleanup_sandbox();
+int sandbox_reset(int q);
+int sandbox_rlimited();
+void sandbox_confine();
+int fixture_build(int q, const char *base);
+int fixture_dir(const char *path);
+int fixture_file(const char *path, const char *contents);
+void fixture_remove(const char *path);
+void fixture_start_reaper();
+void fixture_stop_reaper();
 void load_progress();
 void save_progress();
+int64_t log_now();
+void log_default_dir(char *out, size_t len);
+void log_start();
+void log_finish();
+void log_event(int type, int status, int64_t start, int64_t end, int q, int step, const char *cmd);
+int log_replay(int argc, char **argv);
+int log_report(int argc, char **argv);
 void switch_to_zsh();
+int64_t perf_now();
+void perf_record(int stage, int64_t start);
+void perf_print();
+void perf_open();
+void perf_dump();
 void handle_signal(int sig);
-void add_job(pid_t pid, char *cmd, int status);
+void jobs_init();
+struct Job *job_add(pid_t pgid, pid_t *pids, int npids, pid_t last, const char *cmd);
+struct Job *job_find(int id);
+void job_remove(struct Job *j);
+void jobs_reap();
+void jobs_notify(int at_prompt);
+int job_wait(struct Job *j);
+int shell_getc(FILE *in);
 void list_jobs();
-void fg_job(int job_id);
-void bg_job(int job_id);
+int fg_job(int job_id);
+int bg_job(int job_id);
 void vfs_init();
-void vfs_touch(char *name);
-void vfs_ls();
-void vfs_cat(char *name);
-int vfs_allocate_block(int size);
+int vfs_open(const char *path);
+void vfs_sync();
+void vfs_close();
+void vfs_dirty(const void *p, size_t len);
+int vfs_commit();
+void vfs_op_done();
+int vfs_journal_tick();
+int vfs_fsck(int verbose);
+int vfs_crashtest(int runs);
+void vfs_touch(char *path);
+void vfs_ls(char *path);
+void vfs_cat(char *path);
+void vfs_write(char *path, char *text);
+void vfs_append(char *path, char *text);
+void vfs_stats();
+int vfs_pread(int ino, char *buf, int len, int offset);
+int vfs_pwrite(int ino, const char *buf, int len, int offset);
+void vfs_cache_invalidate(int start, int len);
+void vfs_rm(char *path);
+void vfs_mkdir(char *path);
+void vfs_cd(char *path);
+void vfs_pwd();
+int vfs_resolve(const char *path);
+int vfs_lookup(int dir, const char *name);
+int vfs_allocate_block(int size, int *got);
+void vfs_free_block(int start, int len);
+int vfs_inode_alloc(struct Inode *inode, int nblocks);
+void vfs_inode_free(struct Inode *inode);
+int vfs_inode_new(int type, const char *name);
 void simulate_fcfs();
+int sched_main(int argc, char **argv);
+int shell_run();
+int serve_main(int argc, char **argv);
+int serve_attach();
+int serve_bench(int argc, char **argv);
+int script_main(int argc, char **argv);
+char *script_next();
+int script_quests();
+int script_bench(int argc, char **argv);
 
 // Main
-int main() {
-    signal(SIGINT, handle_signal);
-    setpgid(0, 0); // Enable job control
-    setup_sandbox();
+int main(int argc, char **argv) {
+    if (argc > 2 && strcmp(argv[1], "--vfs-crashtest") == 0) return vfs_crashtest(atoi(argv[2]));
+    if (argc > 1 && strcmp(argv[1], "--replay") == 0) return log_replay(argc - 2, argv + 2);
+    if (argc > 1 && strcmp(argv[1], "--report") == 0) return log_report(argc - 2, argv + 2);
+    if (argc > 1 && strcmp(argv[1], "--schedule") == 0) return sched_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "--spawn-bench") == 0) return spawn_bench(argc > 2 ? atoi(argv[2]) : 200);
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) return serve_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "--serve-bench") == 0) return serve_bench(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "--script") == 0) return script_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "--quest-script") == 0) return script_quests();
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) return script_bench(argc - 1, argv + 1);
+    // Join the daemon if one is running, else be a shell of our own
+    if (argc > 1 && strcmp(argv[1], "--attach") == 0 && serve_attach() == 0) return 0;
+    char *backend = getenv("SHELLQUEST_SPAWN");
+    if (backend && strcmp(backend, "fork") == 0) spawn_backend = SPAWN_FORK;
+    jobs_init(); // before any thread starts, so SIGCHLD stays blocked in all
+    quests_load();
     load_progress();
-    vfs_init();
+    vfs_init(); // the image stays on the real filesystem
+    perf_open();
+    setup_sandbox(); // before any thread starts, or unshare refuses
+    return shell_run();
+}
+
+// The interactive session, once the catalogue, progress, VFS and sandbox
+// are in place. A daemon's sessions start here too.
+int shell_run() {
+    signal(SIGINT, handle_signal);
+    signal(SIGPIPE, SIG_IGN); // a builtin writing into a closed pipe gets EPIPE
+    log_start();
+    // Have the kernel module, if loaded, count what this session runs
+    int kfd = open(KMOD_STATS, O_RDONLY | O_CLOEXEC);
+    if (kfd >= 0) {
+        ioctl(kfd, SQ_IOC_TRACK);
+        close(kfd);
+    }
+    rl_getc_function = shell_getc;
+    rl_attempted_completion_function = shell_complete;
+    path_build();
     show_guide();
     char *input;
-    while (1) {
+    int64_t turn = 0;
+    while (!shell_exit) {
+        jobs_notify(0);
         print_prompt();
-        input = readline("");
-        if (input == NULL || strcmp(input, "exit") == 0) break;
+        if (turn) perf_record(PERF_TURN, turn);
+        input = shell_readline();
+        if (input == NULL) break;
+        turn = perf_turn = perf_now();
         add_history(input);
-
-        char *token = strtok(input, " ");
-        if (token != NULL) {
-            if (strcmp(token, "teach") == 0) {
-                token = strtok(NULL, " ");
-                if (token) teach_command(token);
-            } else if (strcmp(token, "stats") == 0) {
-                show_stats();
-            } else if (strcmp(token, "guide") == 0 || strcmp(token, "help") == 0) {
-                show_guide();
-            } else if (strcmp(token, "quests") == 0) {
-                list_quests();
-            } else if (strcmp(token, "jobs") == 0) {
-                list_jobs();
-            } else if (strcmp(token, "fg") == 0) {
-                token = strtok(NULL, " ");
-                if (token) fg_job(atoi(token));
-            } else if (strcmp(token, "bg") == 0) {
-                token = strtok(NULL, " ");
-                if (token) bg_job(atoi(token));
-            } else if (strstr(input, "vfs_") == input) {
-                if (strcmp(input, "vfs_ls") == 0) vfs_ls();
-                else if (strstr(input, "vfs_touch ") == input) vfs_touch(input + 10);
-                else if (strstr(input, "vfs_cat ") == input) vfs_cat(input + 8);
-            } else {
-                int bg = (strstr(input, "&") != NULL);
-                execute_command(input, bg);
-            }
-        }
+        int64_t started = log_now();
+        int q = active_quest, step = active_step;
+        last_status = 0;
+        if (!quest_input(input)) run_input(input);
+        log_event(LOG_COMMAND, last_status, started, log_now(), q, step, input);
         free(input);
-        if (completed_quests >= TOTAL_QUESTS) switch_to_zsh();
+        perf_turn = 0;
+        int64_t saving = perf_now();
+        save_progress();
+        perf_record(PERF_SAVE, saving);
+        if (quest_count > 0 && completed_quests >= quest_count && !script_in) switch_to_zsh();
     }
     save_progress();
+    perf_dump();
+    log_finish();
+    vfs_close();
     cleanup_sandbox();
     printf("Exiting. XP: %d, Level: %d\n", xp, level);
-    return 0;
+    return exit_status;
+}
+
+// Dispatch one line of input. Returns 0 on success.
+int run_input(char *input) {
+    struct Tokens t;
+    struct Pipeline p;
+    int status = 1;
+    if (shell_lex(input, &t) != 0) {
+        printf("syntax error: unterminated quote\n");
+    } else if (shell_parse(&t, &p) == 0) {
+        status = p.ncmds ? run_pipeline(&p, input) : 0;
+        pipeline_free(&p);
+    }
+    tokens_free(&t);
+    last_status = status;
+    return status;
 }
 
 // Prompt
@@ -140,548 +838,5384 @@ void print_prompt() {
     printf("ShellQuest [Lv %d] %s $ ", level, current_dir);
 }
 
-// Execute
-int execute_command(char *cmd, int bg) {
-    char cmd_copy[1024];
-    strcpy(cmd_copy, cmd);
-    if (bg) cmd_copy[strlen(cmd_copy) - 1] = '\0'; // Remove &
+// The next line of input, typed or from the script; NULL at the end
+char *shell_readline() {
+    if (script_in) return script_next();
+    return readline("");
+}
 
-    char *args[64];
-    int i = 0;
-    args[i++] = strtok(cmd_copy, " ");
-    while ((args[i] = strtok(NULL, " ")) != NULL) i++;
-    args[i] = NULL;
+// Builtins
+struct Builtin *builtin_find(const char *name) {
+    int i = builtin_slot[builtin_hash(name) >> (32 - BUILTIN_BITS)];
+    return i >= 0 && strcmp(builtins[i].name, name) == 0 ? &builtins[i] : NULL;
+}
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        setpgid(0, 0); // New process group for job control
-        execvp(args[0], args);
-        perror("execvp");
-        exit(1);
-    } else if (pid > 0) {
-        if (bg) {
-            add_job(pid, cmd, 0);
-            return 0;
-        } else {
-            int status;
-            waitpid(pid, &status, 0);
-            return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
-        }
+int builtin_teach(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: teach <command>\n");
+        return 1;
     }
-    return 1;
+    teach_command(argv[1]);
+    return 0;
 }
 
-// Explanation
-void show_explanation(const char *cmd, const char *brief, const char *detailed) {
-    printf("%s\n", brief);
-    printf("Want more details? [y/n]: ");
-    char choice[10];
-    fgets(choice, sizeof(choice), stdin);
-    if (choice[0] == 'y' || choice[0] == 'Y') {
-        printf("%s\n", detailed);
-    }
+int builtin_stats(int argc, char **argv) {
+    show_stats();
+    return 0;
 }
 
-// Teach
-void teach_command(char *cmd) {
-    if (strcmp(cmd, "ls") == 0) quest_ls();
-    else if (strcmp(cmd, "cd") == 0) quest_cd();
-    else if (strcmp(cmd, "cat") == 0) quest_cat();
-    else if (strcmp(cmd, "mkdir") == 0) quest_mkdir();
-    else if (strcmp(cmd, "touch") == 0) quest_touch();
-    else if (strcmp(cmd, "grep") == 0) quest_grep();
-    else if (strcmp(cmd, "jobs") == 0) quest_jobs();
-    else if (strcmp(cmd, "schedule") == 0) quest_schedule();
-    else if (strcmp(cmd, "kernelmod") == 0) quest_kernelmod();
-    else printf("Unknown: %s\n", cmd);
+int builtin_guide(int argc, char **argv) {
+    show_guide();
+    return 0;
 }
 
-// Quests
-void quest_ls() {
-    if (ls_subquest_stage == 0) {
-        printf("Quest: Use 'ls' to list files in the village square.\n");
-        system("mkdir -p /tmp/shellquest/quest_ls && touch /tmp/shellquest/quest_ls/village.txt");
-        char *input;
-        while (1) {
-            print_prompt();
-            input = readline("");
-            if (strstr(input, "ls") && !strstr(input, "-")) {
-                if (execute_command(input, 0) == 0) {
-                    xp += 10; completed_quests++; ls_subquest_stage = 1;
-                    show_explanation("ls", "You listed files in the directory!",
-                                     "The 'ls' command lists directory contents. Use it to see files/folders in your current location.");
-                    printf("✅ +10 XP! New sub-quest unlocked: Try 'teach ls' again for 'ls -a'.\n");
-                    break;
-                } else {
-                    printf("Try again: Use 'ls' without options.\n");
-                }
-            } else {
-                execute_command(input, 0);
-            }
-            free(input);
-        }
-        system("rm -rf /tmp/shellquest/quest_ls");
-    } else if (ls_subquest_stage == 1) {
-        printf("Sub-Quest: Use 'ls -a' to find hidden treasures.\n");
-        system("mkdir -p /tmp/shellquest/quest_ls && touch /tmp/shellquest/quest_ls/.hidden.txt");
-        char *input;
-        while (1) {
-            print_prompt();
-            input = readline("");
-            if (strstr(input, "ls -a") != NULL) {
-                if (execute_command(input, 0) == 0) {
-                    xp += 15; completed_quests++; ls_subquest_stage = 2;
-                    show_explanation("ls -a", "You listed all files, including hidden ones starting with '.'!",
-                                     "The 'ls -a' option shows all files, including hidden ones (starting with '.'). Use it to view configuration files like .zshrc.");
-                    printf("✅ +15 XP! Next: 'teach ls' for 'ls -l'.\n");
-                    break;
-                } else {
-                    printf("Try again: Use 'ls -a'.\n");
-                }
-            } else {
-                execute_command(input, 0);
-            }
-            free(input);
-        }
-        system("rm -rf /tmp/shellquest/quest_ls");
-    } else if (ls_subquest_stage == 2) {
-        printf("Sub-Quest: Use 'ls -l' to inspect file details.\n");
-        system("mkdir -p /tmp/shellquest/quest_ls && touch /tmp/shellquest/quest_ls/village.txt");
-        char *input;
-        while (1) {
-            print_prompt();
-            input = readline("");
-            if (strstr(input, "ls -l") != NULL) {
-                if (execute_command(input, 0) == 0) {
-                    xp += 15; completed_quests++; ls_subquest_stage = 3;
-                    show_explanation("ls -l", "You listed files with detailed info like permissions and sizes!",
-                                     "The 'ls -l' option shows a long listing format with permissions, owner, size, and date. Use it to check file metadata.");
-                    printf("✅ +15 XP! Next: 'teach ls' for 'ls -al'.\n");
-                    break;
-                } else {
-                    printf("Try again: Use 'ls -l'.\n");
-                }
-            } else {
-                execute_command(input, 0);
-            }
-            free(input);
-        }
-        system("rm -rf /tmp/shellquest/quest_ls");
-    } else if (ls_subquest_stage == 3) {
-        printf("Sub-Quest: Use 'ls -al' to see all details.\n");
-        system("mkdir -p /tmp/shellquest/quest_ls && touch /tmp/shellquest/quest_ls/.hidden.txt");
-        char *input;
-        while (1) {
-            print_prompt();
-            input = readline("");
-            if (strstr(input, "ls -al") != NULL || strstr(input, "ls -la") != NULL) {
-                if (execute_command(input, 0) == 0) {
-                    xp += 20; completed_quests++; ls_subquest_stage = 4;
-                    show_explanation("ls -al", "You listed all files with full details!",
-                                     "The 'ls -al' combines '-a' (all files) and '-l' (long format). Use it for a complete view of a directory, including hidden file details.");
-                    printf("✅ +20 XP! All ls sub-quests complete!\n");
-                    break;
-                } else {
-                    printf("Try again: Use 'ls -al' or 'ls -la'.\n");
-                }
-            } else {
-                execute_command(input, 0);
-            }
-            free(input);
-        }
-        system("rm -rf /tmp/shellquest/quest_ls");
-    }
+int builtin_quests(int argc, char **argv) {
+    list_quests();
+    return 0;
 }
 
-void quest_cd() {
-    printf("Quest: Use 'cd dungeon' to enter the dungeon.\n");
-    system("mkdir -p /tmp/shellquest/dungeon && touch /tmp/shellquest/dungeon/flag.txt");
-    char *input;
-    while (1) {
-        print_prompt();
-        input = readline("");
-        if (strstr(input, "cd dungeon") != NULL) {
-            if (execute_command(input, 0) == 0 && chdir("/tmp/shellquest/dungeon") == 0) {
-                xp += 15; completed_quests++;
-                show_explanation("cd", "You changed to the dungeon directory!",
-                                 "The 'cd' command changes your current working directory. Use it to navigate the filesystem, e.g., 'cd /home' or 'cd ..' to go up.");
-                printf("✅ +15 XP. Entered dungeon!\n");
-                break;
-            } else {
-                printf("Try again: Use 'cd dungeon' (ensure directory exists).\n");
-            }
-        } else {
-            execute_command(input, 0);
-        }
-        free(input);
-    }
-    chdir("/tmp/shellquest");
-    system("rm -rf /tmp/shellquest/dungeon");
+int builtin_jobs(int argc, char **argv) {
+    list_jobs();
+    return 0;
 }
 
-void quest_cat() {
-    printf("Quest: Use 'cat secret.txt' to read the secret.\n");
-    // Ensure directory and file are created
-    if (system("mkdir -p /tmp/shellquest/quest_cat") != 0) {
-        printf("Error: Failed to create directory /tmp/shellquest/quest_cat\n");
-        return;
-    }
-    if (system("echo 'Flag: SQ-001' > /tmp/shellquest/quest_cat/secret.txt") != 0) {
-        printf("Error: Failed to create secret.txt\n");
-        return;
-    }
-    // Change to quest directory
-    if (chdir("/tmp/shellquest/quest_cat") != 0) {
-        printf("Error: Failed to change to /tmp/shellquest/quest_cat\n");
-        system("rm -rf /tmp/shellquest/quest_cat");
-        return;
-    }
-    char *input;
-    while (1) {
-        print_prompt();
-        input = readline("");
-        if (strstr(input, "cat secret.txt") != NULL) {
-            if (execute_command(input, 0) == 0) {
-                xp += 20; completed_quests++;
-                show_explanation("cat", "You displayed the contents of secret.txt!",
-                                 "The 'cat' command concatenates and displays file contents. Use it to read text files or combine multiple files, e.g., 'cat file1 file2'.");
-                printf("✅ +20 XP. Found flag!\n");
-                break;
-            } else {
-                printf("Try again: Use 'cat secret.txt' (ensure file exists).\n");
-            }
-        } else {
-            execute_command(input, 0);
-        }
-        free(input);
-    }
-    // Return to base directory and clean up
-    chdir("/tmp/shellquest");
-    system("rm -rf /tmp/shellquest/quest_cat");
+int builtin_fg(int argc, char **argv) {
+    return fg_job(argc > 1 ? atoi(argv[1] + (argv[1][0] == '%')) : 0);
 }
 
-void quest_mkdir() {
-    printf("Quest: Use 'mkdir fortress' to build a fortress.\n");
-    system("mkdir -p /tmp/shellquest/quest_mkdir");
-    char *input;
-    while (1) {
-        print_prompt();
-        input = readline("");
-        if (strstr(input, "mkdir fortress") != NULL) {
-            if (execute_command(input, 0) == 0) {
-                xp += 15; completed_quests++;
-                show_explanation("mkdir", "You created a new directory called fortress!",
-                                 "The 'mkdir' command creates directories. Use it to organize files, e.g., 'mkdir docs' or 'mkdir -p path/to/nested' for nested dirs.");
-                printf("✅ +15 XP. Fortress built!\n");
-                break;
-            } else {
-                printf("Try again: Use 'mkdir fortress' (remove existing fortress if needed).\n");
-            }
-        } else {
-            execute_command(input, 0);
-        }
-        free(input);
-    }
-    system("rm -rf /tmp/shellquest/quest_mkdir");
+int builtin_bg(int argc, char **argv) {
+    return bg_job(argc > 1 ? atoi(argv[1] + (argv[1][0] == '%')) : 0);
 }
 
-void quest_touch() {
-    printf("Quest: Use 'touch flag.txt' to place a flag.\n");
-    system("mkdir -p /tmp/shellquest/quest_touch");
-    char *input;
-    while (1) {
-        print_prompt();
-        input = readline("");
-        if (strstr(input, "touch flag.txt") != NULL) {
-            if (execute_command(input, 0) == 0) {
-                xp += 15; completed_quests++;
-                show_explanation("touch", "You created or updated flag.txt!",
-                                 "The 'touch' command creates empty files or updates timestamps. Use it to create new files, e.g., 'touch notes.txt', or refresh existing ones.");
-                printf("✅ +15 XP. Flag placed!\n");
-                break;
-            } else {
-                printf("Try again: Use 'touch flag.txt'.\n");
-            }
-        } else {
-            execute_command(input, 0);
+// cd with no argument goes back to the sandbox; 'cd -' to the last directory
+int builtin_cd(int argc, char **argv) {
+    char old[PATH_MAX];
+    const char *dir = argc > 1 ? argv[1] : SANDBOX_DIR;
+    if (strcmp(dir, "-") == 0) {
+        dir = getenv("OLDPWD");
+        if (!dir) {
+            printf("cd: OLDPWD not set\n");
+            return 1;
         }
-        free(input);
+        printf("%s\n", dir);
+    }
+    if (!getcwd(old, sizeof(old))) old[0] = '\0';
+    if (chdir(dir) != 0) {
+        printf("cd: %s: %s\n", dir, strerror(errno));
+        return 1;
     }
-    system("rm -rf /tmp/shellquest/quest_touch");
+    if (old[0]) setenv("OLDPWD", old, 1);
+    if (getcwd(current_dir, sizeof(current_dir))) setenv("PWD", current_dir, 1);
+    return 0;
 }
 
-void quest_grep() {
-    printf("Quest: Use 'grep code secret.txt' to find the hidden code.\n");
-    // Ensure directory and file are created
-    if (system("mkdir -p /tmp/shellquest/quest_grep") != 0) {
-        printf("Error: Failed to create directory /tmp/shellquest/quest_grep\n");
-        return;
-    }
-    if (system("echo 'Secret code: XYZ123' > /tmp/shellquest/quest_grep/secret.txt") != 0) {
-        printf("Error: Failed to create secret.txt\n");
-        return;
+int builtin_pwd(int argc, char **argv) {
+    if (!getcwd(current_dir, sizeof(current_dir))) {
+        perror("pwd");
+        return 1;
     }
-    // Change to quest directory
-    if (chdir("/tmp/shellquest/quest_grep") != 0) {
-        printf("Error: Failed to change to /tmp/shellquest/quest_grep\n");
-        system("rm -rf /tmp/shellquest/quest_grep");
-        return;
+    printf("%s\n", current_dir);
+    return 0;
+}
+
+// export NAME=value sets a variable for commands run afterwards; bare
+// export lists the environment.
+int builtin_export(int argc, char **argv) {
+    extern char **environ;
+    if (argc == 1) {
+        for (char **env = environ; *env; env++) printf("export %s\n", *env);
+        return 0;
     }
-    char *input;
-    while (1) {
-        print_prompt();
-        input = readline("");
-        if (strstr(input, "grep code secret.txt") != NULL) {
-            if (execute_command(input, 0) == 0) {
-                xp += 20; completed_quests++;
-                show_explanation("grep", "You searched for 'code' in secret.txt!",
-                                 "The 'grep' command searches for patterns in files. Use it to find text, e.g., 'grep error log.txt' or 'grep -r pattern dir' for recursive search.");
-                printf("✅ +20 XP. Code found!\n");
-                break;
-            } else {
-                printf("Try again: Use 'grep code secret.txt' (ensure file exists).\n");
-            }
-        } else {
-            execute_command(input, 0);
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        char *eq = strchr(argv[i], '=');
+        if (eq == argv[i]) {
+            printf("export: '%s': not a valid identifier\n", argv[i]);
+            status = 1;
+        } else if (eq) {
+            *eq = '\0';
+            setenv(argv[i], eq + 1, 1);
+        } else if (!getenv(argv[i])) {
+            setenv(argv[i], "", 1);
         }
-        free(input);
     }
-    // Return to base directory and clean up
-    chdir("/tmp/shellquest");
-    system("rm -rf /tmp/shellquest/quest_grep");
+    return status;
 }
 
-void quest_jobs() {
-    printf("Quest: Run 'sleep 10 &' then 'jobs' and 'fg 1'.\n");
-    char *input;
-    int job_started = 0;
-    while (1) {
-        print_prompt();
-        input = readline("");
-        if (strstr(input, "sleep 10 &") != NULL) {
-            if (execute_command(input, 1) == 0) {
-                job_started = 1;
-                printf("Background job started. Now try 'jobs'.\n");
-            }
-        } else if (strstr(input, "jobs") != NULL && job_started) {
-            list_jobs();
-        } else if (strstr(input, "fg 1") != NULL && job_started && job_count > 0) {
-            fg_job(1);
-            xp += 20; completed_quests++;
-            show_explanation("jobs/fg", "You managed background jobs!",
-                             "The 'jobs' command lists background processes, and 'fg' brings them to the foreground. Use them to manage tasks, e.g., 'sleep 30 &' then 'fg 1'.");
-            printf("✅ +20 XP!\n");
-            break;
-        } else {
-            execute_command(input, strstr(input, "&") != NULL);
-        }
-        free(input);
-    }
+int builtin_exit(int argc, char **argv) {
+    shell_exit = 1;
+    if (argc > 1) exit_status = atoi(argv[1]);
+    return 0;
 }
 
-void quest_schedule() {
-    printf("Quest: Simulate FCFS scheduling!\n");
-    simulate_fcfs();
-    xp += 30; completed_quests++;
-    show_explanation("schedule", "You ran a First-Come-First-Serve scheduler simulation!",
-                     "Scheduling determines process execution order. FCFS runs processes in arrival order; use it for simple, non-preemptive systems.");
-    printf("✅ +30 XP!\n");
-    check_level_up();
+// The vfs_ builtins each count as one operation for the journal.
+static int vfs_usage(const char *usage) {
+    printf("Usage: %s\n", usage);
+    return 1;
 }
 
-void quest_kernelmod() {
-    printf("Quest: Load kernel module, read stats with 'cat /proc/shellquest_stats', then unload.\n");
-    printf("Hint: Use 'sudo insmod /home/vijay/shellquest-module/shellquest_stats.ko' and 'sudo rmmod shellquest_stats'.\n");
-    char *input;
-    while (1) {
-        print_prompt();
-        input = readline("");
-        if (strstr(input, "cat /proc/shellquest_stats") != NULL) {
-            if (execute_command(input, 0) == 0) {
-                xp += 25; completed_quests++;
-                show_explanation("kernelmod", "You read stats from a kernel module via procfs!",
-                                 "Kernel modules extend Linux functionality. The 'insmod' command loads them, and 'rmmod' unloads them. Use '/proc' files for kernel-user communication.");
-                printf("✅ +25 XP! Unload module to finish.\n");
-            } else {
-                printf("Try again: Use 'cat /proc/shellquest_stats' (ensure module is loaded).\n");
-            }
-        } else if (strstr(input, "rmmod shellquest_stats") != NULL) {
-            if (execute_command(input, 0) == 0) {
-                printf("✅ Module unloaded! Quest complete.\n");
-                break;
-            } else {
-                printf("Try again: Use 'sudo rmmod shellquest_stats'.\n");
-            }
-        } else {
-            execute_command(input, strstr(input, "&") != NULL);
-        }
-        free(input);
+// Read fd to its end into a NUL-terminated heap buffer; NULL if memory
+// runs out
+static char *vfs_text_read(int fd) {
+    size_t cap = 4096, used = 0;
+    char *text = malloc(cap);
+    ssize_t n;
+    while (text && (n = read(fd, text + used, cap - used - 1)) > 0) {
+        used += n;
+        if (cap - used > 1) continue;
+        char *grown = realloc(text, cap * 2);
+        if (!grown) free(text);
+        text = grown;
+        cap *= 2;
     }
+    if (!text) {
+        printf("Error: out of memory for the input\n");
+        return NULL;
+    }
+    text[used] = '\0';
+    return text;
 }
 
-// Level up
-void check_level_up() {
-    if (xp >= level * 50) {
-        level++;
-        printf("🎉 Level %d!\n", level);
+// Text arguments are the remaining words, joined by single spaces. With
+// no text and input piped or redirected in, the text is that input: the
+// pipe is spliced into a memfd and mapped, not copied through a buffer.
+// Returns NULL, having said why, when the input cannot be taken in.
+static char *vfs_text(int argc, char **argv, size_t *map_len) {
+    *map_len = 0;
+    if (argc <= 2 && builtin_input >= 0) {
+        int memfd = memfd_create("shellquest-stdin", MFD_CLOEXEC);
+        if (memfd < 0) return vfs_text_read(builtin_input); // no memfd: the heap will do
+        loff_t len = 0;
+        ssize_t n;
+        int failed = 0;
+        while ((n = splice(builtin_input, NULL, memfd, &len, 1 << 20, 0)) > 0);
+        if (n < 0) {
+            // Not a pipe: copy instead
+            char buf[4096];
+            while (!failed && (n = read(builtin_input, buf, sizeof(buf))) > 0) {
+                for (ssize_t off = 0; off < n;) {
+                    ssize_t w = pwrite(memfd, buf + off, n - off, len);
+                    if (w <= 0) {
+                        failed = 1;
+                        break;
+                    }
+                    off += w;
+                    len += w;
+                }
+            }
+        }
+        // The extra byte is the terminating NUL; mapped past EOF it would fault
+        if (failed || ftruncate(memfd, len + 1) != 0) {
+            printf("Error: cannot buffer the input: %s\n", strerror(errno));
+            close(memfd);
+            return NULL;
+        }
+        char *text = mmap(NULL, len + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, memfd, 0);
+        close(memfd);
+        if (text == MAP_FAILED) {
+            printf("Error: cannot map the input: %s\n", strerror(errno));
+            return NULL;
+        }
+        *map_len = len + 1;
+        return text;
     }
-    save_progress();
+    size_t len = 1;
+    for (int i = 2; i < argc; i++) len += strlen(argv[i]) + 1;
+    char *text = malloc(len);
+    if (!text) {
+        printf("Error: out of memory for the text\n");
+        return NULL;
+    }
+    text[0] = '\0';
+    for (int i = 2; i < argc; i++) {
+        if (i > 2) strcat(text, " ");
+        strcat(text, argv[i]);
+    }
+    return text;
 }
 
-// Stats
-void show_stats() {
-    printf("XP: %d, Level: %d, Quests: %d/%d\n", xp, level, completed_quests, TOTAL_QUESTS);
+static void vfs_text_free(char *text, size_t map_len) {
+    if (map_len) munmap(text, map_len);
+    else free(text);
 }
 
-// Guide
-void show_guide() {
-    printf("\n🎉 Welcome to ShellQuest: Your Gamified Journey to Mastering Linux! 🎉\n\n");
-    printf("ShellQuest turns learning Linux commands into an adventure. Earn XP, level up, and unlock quests!\n\n");
-    printf("Quick Start Guide:\n");
-    printf("1. Type 'teach <command>' to start a quest (e.g., 'teach ls').\n");
-    printf("2. Follow prompts to practice commands in a safe sandbox.\n");
-    printf("3. Complete tasks to earn XP and unlock sub-quests (e.g., 'ls -a').\n");
-    printf("4. Check progress with 'stats' or list quests with 'quests'.\n");
-    printf("5. Finish all quests to graduate to a standard terminal!\n\n");
-    printf("Tips:\n");
-    printf("- Use 'man <command>' for help.\n");
-    printf("- Sandboxed: No system risks.\n");
-    printf("- Try OS quests like 'schedule' or 'kernelmod'.\n");
-    printf("Start with 'teach ls'!\n");
+int builtin_vfs_ls(int argc, char **argv) {
+    vfs_ls(argc > 1 ? argv[1] : NULL);
+    vfs_op_done();
+    return 0;
 }
 
-// Quests list
-void list_quests() {
-    printf("Available Quests:\n");
-    printf("- ls (Sub-quests: ls, ls -a, ls -l, ls -al)\n");
-    printf("- cd\n");
-    printf("- cat\n");
-    printf("- mkdir\n");
-    printf("- touch\n");
-    printf("- grep\n");
-    printf("- jobs\n");
-    printf("- schedule\n");
-    printf("- kernelmod\n");
-    printf("Completed: %d/%d\n", completed_quests, TOTAL_QUESTS);
+int builtin_vfs_pwd(int argc, char **argv) {
+    vfs_pwd();
+    vfs_op_done();
+    return 0;
 }
 
-// Sandbox
-void setup_sandbox() {
-    mkdir("/tmp/shellquest", 0755);
-    chdir("/tmp/shellquest");
-    progress_file = fopen("/tmp/shellquest/.quest_progress", "r+");
-    if (!progress_file) progress_file = fopen("/tmp/shellquest/.quest_progress", "w+");
+int builtin_vfs_stats(int argc, char **argv) {
+    vfs_stats();
+    vfs_op_done();
+    return 0;
 }
 
-void cleanup_sandbox() {
-    fclose(progress_file);
-    chdir("/");
-    system("rm -rf /tmp/shellquest");
+int builtin_vfs_sync(int argc, char **argv) {
+    vfs_sync();
+    vfs_op_done();
+    return 0;
 }
 
-// Progress
-void load_progress() {
-    if (progress_file) {
-        fscanf(progress_file, "%d %d %d %d", &xp, &level, &completed_quests, &ls_subquest_stage);
-        rewind(progress_file);
-    }
+int builtin_vfs_write(int argc, char **argv) {
+    if (argc < 2) return vfs_usage("vfs_write <path> [text]");
+    size_t map_len;
+    char *text = vfs_text(argc, argv, &map_len);
+    if (!text) return 1;
+    vfs_write(argv[1], text);
+    vfs_text_free(text, map_len);
+    vfs_op_done();
+    return 0;
 }
 
-void save_progress() {
-    if (progress_file) {
-        fprintf(progress_file, "%d %d %d %d", xp, level, completed_quests, ls_subquest_stage);
-        fflush(progress_file);
-    }
+int builtin_vfs_append(int argc, char **argv) {
+    if (argc < 2) return vfs_usage("vfs_append <path> [text]");
+    size_t map_len;
+    char *text = vfs_text(argc, argv, &map_len);
+    if (!text) return 1;
+    vfs_append(argv[1], text);
+    vfs_text_free(text, map_len);
+    vfs_op_done();
+    return 0;
 }
 
-// Switch
-void switch_to_zsh() {
-    system("sudo chsh -s /bin/zsh $USER");
-    printf("All quests done! Switching to Zsh. Relaunch terminal.\n");
-    exit(0);
+int builtin_vfs_touch(int argc, char **argv) {
+    if (argc < 2) return vfs_usage("vfs_touch <path>");
+    vfs_touch(argv[1]);
+    vfs_op_done();
+    return 0;
 }
 
-// Signals
-void handle_signal(int sig) {
-    if (job_count > 0) kill(jobs[0].pid, SIGINT);
+int builtin_vfs_cat(int argc, char **argv) {
+    if (argc < 2) return vfs_usage("vfs_cat <path>");
+    vfs_cat(argv[1]);
+    vfs_op_done();
+    return 0;
 }
 
-// Jobs
-void add_job(pid_t pid, char *cmd, int status) {
-    jobs[job_count].pid = pid;
-    strcpy(jobs[job_count].cmd, cmd);
-    jobs[job_count].status = status;
-    job_count++;
+int builtin_vfs_rm(int argc, char **argv) {
+    if (argc < 2) return vfs_usage("vfs_rm <path>");
+    vfs_rm(argv[1]);
+    vfs_op_done();
+    return 0;
+}
+
+int builtin_vfs_mkdir(int argc, char **argv) {
+    if (argc < 2) return vfs_usage("vfs_mkdir <path>");
+    vfs_mkdir(argv[1]);
+    vfs_op_done();
+    return 0;
+}
+
+int builtin_vfs_cd(int argc, char **argv) {
+    if (argc < 2) return vfs_usage("vfs_cd <path>");
+    vfs_cd(argv[1]);
+    vfs_op_done();
+    return 0;
+}
+
+int builtin_schedule(int argc, char **argv) {
+    return sched_main(argc, argv);
+}
+
+int builtin_vfs_fsck(int argc, char **argv) {
+    int status = vfs_fsck(1) != 0;
+    vfs_op_done();
+    return status;
+}
+
+// Parser
+static int lex_special(char c) {
+    return c == ' ' || c == '\t' || c == '|' || c == '&' || c == ';' || c == '<' || c == '>';
+}
+
+// Lex a line into t. Returns -1 on an unterminated quote. Every token's
+// text, words and operators alike, sits NUL-terminated in t->buf.
+int shell_lex(const char *line, struct Tokens *t) {
+    size_t len = strlen(line);
+    t->buf = malloc(len * 2 + 1);
+    t->tok = malloc((len + 1) * sizeof(struct Token));
+    t->count = 0;
+    char *out = t->buf;
+    const char *p = line;
+    while (1) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p) break;
+        struct Token *tk = &t->tok[t->count++];
+        *tk = (struct Token){ TOK_WORD, -1, 0, -1, out };
+        const char *start = p, *digits = p;
+        while (isdigit((unsigned char)*digits)) digits++;
+        if (*digits == '<' || *digits == '>') {
+            tk->type = TOK_REDIR;
+            tk->fd = digits > p ? atoi(p) : (*digits == '<' ? 0 : 1);
+            tk->op = *digits;
+            p = digits + 1;
+            if (tk->op == '>' && *p == '>') {
+                tk->op = 'a';
+                p++;
+            } else if (*p == '&' && isdigit((unsigned char)p[1])) {
+                tk->op = '&';
+                tk->dup_fd = strtol(p + 1, (char **)&p, 10);
+            }
+        } else if (*p == '|' || *p == '&' || *p == ';') {
+            tk->type = *p == '|' ? TOK_PIPE : *p == '&' ? TOK_AMP : TOK_LIST;
+            if (*p != ';' && p[1] == *p) {
+                tk->type = TOK_LIST;
+                p++;
+            }
+            p++;
+        } else {
+            char quote = 0;
+            while (*p && (quote || !lex_special(*p))) {
+                if (quote && *p == quote) quote = 0;
+                else if (!quote && (*p == '\'' || *p == '"')) quote = *p;
+                else if (*p == '\\' && p[1] && (!quote || (quote == '"' && strchr("\\\"$`", p[1])))) *out++ = *++p;
+                else *out++ = *p;
+                p++;
+            }
+            if (quote) return -1;
+        }
+        if (tk->type != TOK_WORD) {
+            memcpy(out, start, p - start);
+            out += p - start;
+        }
+        *out++ = '\0';
+    }
+    return 0;
+}
+
+void tokens_free(struct Tokens *t) {
+    free(t->tok);
+    free(t->buf);
+}
+
+static int parse_error(struct Pipeline *p, const char *near) {
+    if (near) printf("syntax error near '%s'\n", near);
+    else printf("syntax error: missing command\n");
+    pipeline_free(p);
+    return -1;
+}
+
+// Parse tokens into a pipeline; argv and path strings point into the
+// tokens, so t must outlive p. An empty line gives ncmds == 0.
+int shell_parse(struct Tokens *t, struct Pipeline *p) {
+    p->ncmds = 0;
+    p->background = 0;
+    p->cmds = calloc(t->count + 1, sizeof(struct Command));
+    p->argv_pool = malloc((t->count * 2 + 2) * sizeof(char *));
+    p->redir_pool = malloc((t->count + 1) * sizeof(struct Redirect));
+    if (t->count == 0) return 0;
+    char **argv = p->argv_pool;
+    struct Redirect *redir = p->redir_pool;
+    struct Command *c = &p->cmds[p->ncmds++];
+    c->argv = argv;
+    c->redirs = redir;
+    for (int i = 0; i < t->count; i++) {
+        struct Token *tk = &t->tok[i];
+        if (p->background) return parse_error(p, tk->text); // & ends the line
+        if (tk->type == TOK_WORD) {
+            *argv++ = tk->text;
+            c->argc++;
+        } else if (tk->type == TOK_REDIR) {
+            *redir = (struct Redirect){ tk->fd, tk->op, tk->dup_fd, NULL };
+            if (tk->op != '&') {
+                if (i + 1 == t->count || t->tok[i + 1].type != TOK_WORD)
+                    return parse_error(p, i + 1 < t->count ? t->tok[i + 1].text : "newline");
+                redir->path = t->tok[++i].text;
+            }
+            redir++;
+            c->nredirs++;
+        } else if (tk->type == TOK_PIPE) {
+            if (c->argc == 0) return parse_error(p, tk->text);
+            *argv++ = NULL;
+            c = &p->cmds[p->ncmds++];
+            c->argv = argv;
+            c->redirs = redir;
+        } else if (tk->type == TOK_AMP) {
+            p->background = 1;
+        } else {
+            printf("'%s' is not supported; run one pipeline per line\n", tk->text);
+            pipeline_free(p);
+            return -1;
+        }
+    }
+    *argv = NULL;
+    if (c->argc == 0) return parse_error(p, p->ncmds > 1 ? "|" : NULL);
+    return 0;
+}
+
+void pipeline_free(struct Pipeline *p) {
+    free(p->cmds);
+    free(p->argv_pool);
+    free(p->redir_pool);
+    p->cmds = NULL;
+    p->argv_pool = NULL;
+    p->redir_pool = NULL;
+}
+
+// Execute
+
+// Copy a builtin's buffered output into the pipe to the next stage. The
+// memfd's pages move into the pipe by splice, without a user-space copy.
+static void pipe_from_memfd(int memfd, int out) {
+    off_t len = lseek(memfd, 0, SEEK_END);
+    loff_t off = 0;
+    while (off < len) {
+        ssize_t n = splice(memfd, &off, out, NULL, len - off, SPLICE_F_MOVE);
+        if (n > 0) continue;
+        if (n < 0 && errno == EINVAL) {
+            // No splice here: fall back to copying
+            char buf[4096];
+            while ((n = pread(memfd, buf, sizeof(buf), off)) > 0 && write(out, buf, n) == n) off += n;
+        }
+        break;
+    }
+}
+
+// Run a parsed pipeline. Externals start first, wired with pipe2, so every
+// builtin stage has its neighbours running; builtins then run in order in
+// the shell. A builtin's output is collected in a memfd and spliced on.
+// Returns the last stage's status, 0 on success.
+int run_pipeline(struct Pipeline *p, const char *text) {
+    int n = p->ncmds, status = 0;
+    pid_t pids[n], pgid = 0;
+    struct Builtin *b[n];
+    int in[n], out[n];
+    if (perf_turn) {
+        perf_record(PERF_DISPATCH, perf_turn);
+        perf_turn = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        b[i] = builtin_find(p->cmds[i].argv[0]);
+        in[i] = out[i] = -1;
+        pids[i] = 0;
+    }
+    if (n == 1 && b[0]) return run_builtin(b[0], &p->cmds[0], -1, -1);
+    for (int i = 0; i + 1 < n; i++) {
+        // Builtin to builtin hands the memfd over directly: no pipe
+        if (b[i] && b[i + 1]) continue;
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            perror("pipe2");
+            for (int j = 0; j < i; j++) {
+                if (out[j] >= 0) close(out[j]);
+                if (in[j + 1] >= 0) close(in[j + 1]);
+            }
+            return 1;
+        }
+        out[i] = fds[1];
+        in[i + 1] = fds[0];
+    }
+    pid_t started[n];
+    int nstarted = 0;
+    for (int i = 0; i < n; i++) {
+        if (b[i]) continue;
+        int64_t spawning = perf_now();
+        pids[i] = spawn_command(&p->cmds[i], in[i], out[i], pgid, spawn_backend);
+        perf_record(PERF_SPAWN, spawning);
+        if (pids[i] > 0 && pgid == 0) pgid = pids[i];
+        if (pids[i] > 0) started[nstarted++] = pids[i];
+        if (in[i] >= 0) close(in[i]);
+        if (out[i] >= 0) close(out[i]);
+        in[i] = out[i] = -1;
+        if (pids[i] < 0 && i == n - 1) status = 1;
+    }
+    struct Job *job = NULL;
+    if (pgid) {
+        job = job_add(pgid, started, nstarted, pids[n - 1] > 0 ? pids[n - 1] : 0, text);
+        // Hand over the terminal now, before anything can read it
+        if (!p->background && shell_tty >= 0) tcsetpgrp(shell_tty, pgid);
+    }
+    for (int i = 0; i < n; i++) {
+        if (!b[i]) continue;
+        int memfd = -1;
+        if (i + 1 < n) memfd = memfd_create("shellquest-pipe", MFD_CLOEXEC);
+        int st = run_builtin(b[i], &p->cmds[i], in[i], memfd >= 0 ? memfd : out[i]);
+        if (i == n - 1) status = st;
+        if (in[i] >= 0) close(in[i]);
+        if (memfd >= 0 && out[i] >= 0) {
+            pipe_from_memfd(memfd, out[i]);
+            close(memfd);
+        } else if (memfd >= 0) {
+            lseek(memfd, 0, SEEK_SET);
+            in[i + 1] = memfd; // the next builtin reads it
+        }
+        if (out[i] >= 0) close(out[i]);
+    }
+    if (p->background) {
+        if (job) printf("[%d] %d\n", job->id, job->pgid);
+        return 0;
+    }
+    if (job) {
+        int64_t waiting = perf_now();
+        int st = job_wait(job);
+        perf_record(PERF_WAIT, waiting);
+        if (pids[n - 1] > 0) status = st;
+    }
+    return status;
+}
+
+// Point fd at a redirection target; used in forked children and around
+// builtins. Returns -1 after reporting a failure.
+static int redirect_fd(struct Redirect *r) {
+    int src = r->dup_fd;
+    if (r->op != '&') {
+        int flags = r->op == '<' ? O_RDONLY : O_WRONLY | O_CREAT | (r->op == 'a' ? O_APPEND : O_TRUNC);
+        src = open(r->path, flags | O_CLOEXEC, 0644);
+        if (src < 0) {
+            printf("%s: %s\n", r->path, strerror(errno));
+            return -1;
+        }
+    }
+    int ok = dup2(src, r->fd);
+    if (r->op != '&') close(src);
+    if (ok < 0) printf("%d: %s\n", r->fd, strerror(errno));
+    return ok < 0 ? -1 : 0;
+}
+
+// Run a builtin in the shell with in/out (when not -1) and its own
+// redirections on the shell's descriptors, then put them back.
+int run_builtin(struct Builtin *b, struct Command *c, int in, int out) {
+    int64_t started = perf_now();
+    if (in < 0 && out < 0 && c->nredirs == 0) {
+        int status = b->run(c->argc, c->argv);
+        perf_record(PERF_BUILTIN, started);
+        return status;
+    }
+    int fds[c->nredirs + 2], saved[c->nredirs + 2], nsaved = 0, status = 1;
+    fflush(stdout);
+    for (int i = -2; i < c->nredirs; i++) {
+        // Two pseudo-redirections for the pipe ends come first
+        int fd = i == -2 ? 0 : i == -1 ? 1 : c->redirs[i].fd;
+        if ((i == -2 && in < 0) || (i == -1 && out < 0)) continue;
+        int j;
+        for (j = 0; j < nsaved && fds[j] != fd; j++);
+        if (j == nsaved) {
+            fds[nsaved] = fd;
+            saved[nsaved++] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        }
+        if (i < 0) {
+            dup2(i == -2 ? in : out, fd);
+        } else if (redirect_fd(&c->redirs[i]) != 0) {
+            goto restore;
+        }
+    }
+    int input_redirected = in >= 0;
+    for (int i = 0; i < c->nredirs; i++) input_redirected |= c->redirs[i].fd == 0;
+    builtin_input = input_redirected ? 0 : -1;
+    status = b->run(c->argc, c->argv);
+    builtin_input = -1;
+restore:
+    fflush(stdout);
+    for (int j = nsaved - 1; j >= 0; j--) {
+        if (saved[j] >= 0) {
+            dup2(saved[j], fds[j]);
+            close(saved[j]);
+        } else {
+            close(fds[j]);
+        }
+    }
+    perf_record(PERF_BUILTIN, started);
+    return status;
+}
+
+// Start a command in process group pgid (0: a new group led by it), with
+// in/out as stdin/stdout when not -1 and its redirections applied after.
+// Returns the child's pid, or -1 after reporting why it could not start.
+pid_t spawn_command(struct Command *c, int in, int out, pid_t pgid, int backend) {
+    pid_t pid;
+    const char *path = c->argv[0];
+    if (!strchr(path, '/') && !(path = path_lookup(path))) {
+        printf("%s: command not found\n", c->argv[0]);
+        return -1;
+    }
+    // posix_spawn cannot set rlimits in the child, so a confined one forks
+    if (backend == SPAWN_POSIX && !sandbox_rlimited()) {
+        posix_spawnattr_t attr;
+        posix_spawn_file_actions_t actions;
+        sigset_t defaults, mask;
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGPIPE);
+        sigaddset(&defaults, SIGTSTP);
+        sigaddset(&defaults, SIGTTIN);
+        sigaddset(&defaults, SIGTTOU);
+        sigaddset(&defaults, SIGHUP);
+        sigemptyset(&mask);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+        posix_spawnattr_setpgroup(&attr, pgid);
+        posix_spawnattr_setsigdefault(&attr, &defaults);
+        posix_spawnattr_setsigmask(&attr, &mask);
+        posix_spawn_file_actions_init(&actions);
+        if (in >= 0) posix_spawn_file_actions_adddup2(&actions, in, 0);
+        if (out >= 0) posix_spawn_file_actions_adddup2(&actions, out, 1);
+        for (int i = 0; i < c->nredirs; i++) {
+            struct Redirect *r = &c->redirs[i];
+            if (r->op == '&') {
+                posix_spawn_file_actions_adddup2(&actions, r->dup_fd, r->fd);
+            } else {
+                int flags = r->op == '<' ? O_RDONLY : O_WRONLY | O_CREAT | (r->op == 'a' ? O_APPEND : O_TRUNC);
+                posix_spawn_file_actions_addopen(&actions, r->fd, r->path, flags, 0644);
+            }
+        }
+        extern char **environ;
+        int err = posix_spawn(&pid, path, &actions, &attr, c->argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+        if (err == 0) return pid;
+        if (err != ENOSYS && err != EINVAL) {
+            printf("%s: %s\n", c->argv[0], strerror(err));
+            return -1;
+        }
+        // The libc cannot spawn this way: fall back to fork for good
+        spawn_backend = SPAWN_FORK;
+    }
+    pid = fork();
+    if (pid == 0) {
+        setpgid(0, pgid); // New process group for job control
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        if (in >= 0) dup2(in, 0);
+        if (out >= 0) dup2(out, 1);
+        for (int i = 0; i < c->nredirs; i++) {
+            if (redirect_fd(&c->redirs[i]) != 0) exit(1);
+        }
+        sandbox_confine();
+        execv(path, c->argv);
+        perror(c->argv[0]);
+        exit(1);
+    }
+    if (pid < 0) {
+        perror("fork");
+    } else {
+        setpgid(pid, pgid ? pgid : pid); // either side may win the race
+    }
+    return pid;
+}
+
+// Spawn latency of each backend as the shell's resident memory grows:
+// fork copies page tables for the whole RSS, spawn should stay flat. The
+// spawn time includes the child's exec, which fork leaves to the child.
+int spawn_bench(int runs) {
+    static const int rss_mib[] = {0, 16, 64, 256};
+    static const char *backend_names[] = {"posix_spawn", "fork"};
+    char *args[] = {"true", NULL};
+    struct Command cmd = { args, 1, NULL, 0 };
+    char *ballast = NULL;
+    size_t ballast_size = 0;
+    if (runs <= 0) runs = 200;
+    double *lat = malloc(runs * sizeof(double));
+    printf("%-8s %-13s %10s %10s %10s\n", "rss", "backend", "mean us", "p50 us", "p99 us");
+    for (size_t r = 0; r < sizeof(rss_mib) / sizeof(rss_mib[0]); r++) {
+        // Grow the ballast and touch every page so it is really resident
+        size_t want = (size_t)rss_mib[r] << 20;
+        if (want > ballast_size) {
+            ballast = realloc(ballast, want);
+            if (!ballast) {
+                printf("Error: cannot allocate %d MiB\n", rss_mib[r]);
+                break;
+            }
+            memset(ballast + ballast_size, 1, want - ballast_size);
+            ballast_size = want;
+        }
+        for (int b = SPAWN_POSIX; b <= SPAWN_FORK; b++) {
+            double total = 0;
+            for (int i = 0; i < runs; i++) {
+                struct timespec t0, t1;
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                pid_t pid = spawn_command(&cmd, -1, -1, 0, b);
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                if (pid < 0) {
+                    free(lat);
+                    free(ballast);
+                    return 1;
+                }
+                waitpid(pid, NULL, 0);
+                lat[i] = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+                total += lat[i];
+            }
+            // Insertion sort: runs is small and this is off the hot path
+            for (int i = 1; i < runs; i++) {
+                double v = lat[i];
+                int j = i;
+                for (; j > 0 && lat[j - 1] > v; j--) lat[j] = lat[j - 1];
+                lat[j] = v;
+            }
+            printf("%4d MiB %-13s %10.1f %10.1f %10.1f\n", rss_mib[r], backend_names[b],
+                   total / runs, lat[runs / 2], lat[runs * 99 / 100]);
+        }
+    }
+    free(lat);
+    free(ballast);
+    return 0;
+}
+
+// Explanation
+void show_explanation(const char *cmd, const char *brief, const char *detailed) {
+    printf("%s\n", brief);
+    printf("Want more details? [y/n]: ");
+    // Through readline like the prompt, so nothing typed ahead is lost
+    char *choice = shell_readline();
+    if (choice && (choice[0] == 'y' || choice[0] == 'Y')) {
+        printf("%s\n", detailed);
+    }
+    free(choice);
+}
+
+// Teach
+void teach_command(char *cmd) {
+    // A topic runs its first open quest, in file order
+    int q = quest_lookup(quest_by_topic, cmd, offsetof(struct Quest, topic));
+    if (q >= 0) {
+        while (q >= 0 && quest_progress[q].state == QUEST_DONE) q = quests[q].next_in_topic;
+        if (q < 0) {
+            printf("All %s quests complete!\n", cmd);
+            return;
+        }
+    } else {
+        q = quest_lookup(quest_by_name, cmd, offsetof(struct Quest, name));
+    }
+    if (q < 0) {
+        printf("Unknown: %s\n", cmd);
+        return;
+    }
+    int lock = quests[q].unlocked_by;
+    if (lock >= 0 && quest_progress[lock].state != QUEST_DONE) {
+        printf("Locked: finish '%s' first.\n", quest_strings + quests[lock].name);
+        return;
+    }
+    quest_start(q);
+}
+
+// Quests
+#define QS(off) (quest_strings + (off))
+
+typedef void (*QuestAction)();
+struct {
+    const char *name;
+    QuestAction run;
+} quest_actions[] = {
+    {"schedule", simulate_fcfs},
+};
+
+static void *quest_grow(void *arr, int count, size_t size) {
+    // Capacity doubles at each power of two
+    if (count == 0 || (count & (count - 1)) == 0) arr = realloc(arr, (count ? count * 2 : 8) * size);
+    return arr;
+}
+
+static int quest_string(const char *str) {
+    size_t len = strlen(str) + 1;
+    static size_t cap = 0;
+    if (quest_strings_len + len > cap) {
+        while (quest_strings_len + len > cap) cap = cap ? cap * 2 : 4096;
+        quest_strings = realloc(quest_strings, cap);
+    }
+    memcpy(quest_strings + quest_strings_len, str, len);
+    quest_strings_len += len;
+    return quest_strings_len - len;
+}
+
+static uint32_t str_hash(const char *str) {
+    uint32_t h = 2166136261u;
+    while (*str) h = (h ^ (unsigned char)*str++) * 16777619u;
+    return h;
+}
+
+// Look a key up in one of the quest indexes; 'field' is the offsetof the
+// string the index is keyed on. Returns the quest or -1.
+int quest_lookup(int *index, const char *key, int field) {
+    if (quest_index_size == 0) return -1;
+    for (uint32_t i = str_hash(key);; i++) {
+        int q = index[i & (quest_index_size - 1)];
+        if (q < 0) return -1;
+        if (strcmp(QS(*(int *)((char *)&quests[q] + field)), key) == 0) return q;
+    }
+}
+
+static void quest_index_add(int *index, int q, int field) {
+    const char *key = QS(*(int *)((char *)&quests[q] + field));
+    for (uint32_t i = str_hash(key);; i++) {
+        int *slot = &index[i & (quest_index_size - 1)];
+        if (*slot < 0) {
+            *slot = q;
+            return;
+        }
+        if (strcmp(QS(*(int *)((char *)&quests[*slot] + field)), key) == 0) return; // first one wins
+    }
+}
+
+static struct QuestStep *quest_new_step(struct Quest *quest) {
+    quest_steps = quest_grow(quest_steps, quest_step_count, sizeof(struct QuestStep));
+    struct QuestStep *st = &quest_steps[quest_step_count++];
+    *st = (struct QuestStep){ 0, -1, -1, -1, -1, -1, -1, -1 };
+    if (quest->nsteps++ == 0) quest->first_step = st - quest_steps;
+    return st;
+}
+
+// Matchers
+
+static int match_flag_bit(char c) {
+    if (c >= 'a' && c <= 'z') return c - 'a';
+    if (c >= 'A' && c <= 'Z') return 26 + c - 'A';
+    if (c >= '0' && c <= '9') return 52 + c - '0';
+    return -1;
+}
+
+// Fold short flags into a set and squeeze them out of the word list.
+// Words after "--", lone "-", long options and anything that is not all
+// flag letters stay as words.
+static int match_fold_flags(char **words, int n, uint64_t *flags) {
+    int out = 0, flags_done = 0;
+    *flags = 0;
+    for (int i = 0; i < n; i++) {
+        char *w = words[i];
+        if (i > 0 && !flags_done && w[0] == '-' && w[1] && w[1] != '-') {
+            uint64_t set = 0;
+            char *c = w + 1;
+            for (; *c && match_flag_bit(*c) >= 0; c++) set |= 1ULL << match_flag_bit(*c);
+            if (!*c) {
+                *flags |= set;
+                continue;
+            }
+        }
+        if (strcmp(w, "--") == 0) flags_done = 1;
+        words[out++] = w;
+    }
+    return out;
+}
+
+static struct MatchEdge *match_edge_slot(int from, const char *word) {
+    uint32_t h = str_hash(word) ^ (uint32_t)from * 0x9e3779b1u;
+    for (;; h++) {
+        struct MatchEdge *e = &match_edges[h & (match_edge_size - 1)];
+        if (e->from < 0 || (e->from == from && strcmp(QS(e->word), word) == 0)) return e;
+    }
+}
+
+static int match_new_node() {
+    match_nodes = quest_grow(match_nodes, match_node_count, sizeof(struct MatchNode));
+    match_nodes[match_node_count] = (struct MatchNode){ -1, -1 };
+    return match_node_count++;
+}
+
+static int match_child(int from, const char *word) {
+    size_t len = strlen(word);
+    if (len > 2 && word[0] == '/' && word[len - 1] == '/') {
+        char *src = strndup(word + 1, len - 2);
+        int r;
+        for (r = match_nodes[from].regex_edges; r >= 0; r = match_regex[r].next) {
+            if (strcmp(QS(match_regex[r].source), src) == 0) break;
+        }
+        if (r < 0) {
+            char *anchored;
+            asprintf(&anchored, "^(%s)$", src);
+            match_regex = quest_grow(match_regex, match_regex_count, sizeof(struct MatchRegex));
+            r = match_regex_count;
+            if (regcomp(&match_regex[r].re, anchored, REG_EXTENDED | REG_NOSUB) != 0) {
+                printf("Warning: bad pattern /%s/\n", src);
+                free(anchored);
+                free(src);
+                return -1;
+            }
+            match_regex_count++;
+            match_regex[r].source = quest_string(src);
+            match_regex[r].next = match_nodes[from].regex_edges;
+            match_nodes[from].regex_edges = r;
+            match_regex[r].to = match_new_node();
+            free(anchored);
+        }
+        free(src);
+        return match_regex[r].to;
+    }
+    if ((match_edge_count + 1) * 2 > match_edge_size) {
+        // Grow and rehash the edge table
+        struct MatchEdge *old = match_edges;
+        int old_size = match_edge_size;
+        match_edge_size = match_edge_size ? match_edge_size * 2 : 64;
+        match_edges = malloc(match_edge_size * sizeof(struct MatchEdge));
+        for (int i = 0; i < match_edge_size; i++) match_edges[i].from = -1;
+        for (int i = 0; i < old_size; i++) {
+            if (old[i].from >= 0) *match_edge_slot(old[i].from, QS(old[i].word)) = old[i];
+        }
+        free(old);
+    }
+    struct MatchEdge *e = match_edge_slot(from, word);
+    if (e->from < 0) {
+        int to = match_new_node();
+        *e = (struct MatchEdge){ from, quest_string(word), to };
+        match_edge_count++;
+    }
+    return e->to;
+}
+
+// Compile one pattern into the trie; a line matching it satisfies 'step'.
+static void match_compile(const char *pattern, int step) {
+    struct Tokens t;
+    uint64_t flags;
+    if (shell_lex(pattern, &t) != 0) {
+        printf("Warning: unterminated quote in pattern '%s'\n", pattern);
+        tokens_free(&t);
+        return;
+    }
+    char *words[t.count + 1];
+    for (int i = 0; i < t.count; i++) words[i] = t.tok[i].text;
+    int n = match_fold_flags(words, t.count, &flags);
+    if (match_node_count == 0) match_new_node(); // root
+    int node = 0;
+    for (int i = 0; i < n && node >= 0; i++) node = match_child(node, words[i]);
+    tokens_free(&t);
+    if (node < 0) return;
+    match_accepts = quest_grow(match_accepts, match_accept_count, sizeof(struct MatchAccept));
+    match_accepts[match_accept_count] = (struct MatchAccept){ flags, step, match_nodes[node].accepts };
+    match_nodes[node].accepts = match_accept_count++;
+}
+
+static int match_walk(int node, char **words, int n, uint64_t flags, int step) {
+    if (n == 0) {
+        for (int a = match_nodes[node].accepts; a >= 0; a = match_accepts[a].next) {
+            if (match_accepts[a].step == step && match_accepts[a].flags == flags) return 1;
+        }
+        return 0;
+    }
+    if (match_edge_size > 0) {
+        struct MatchEdge *e = match_edge_slot(node, words[0]);
+        if (e->from >= 0 && match_walk(e->to, words + 1, n - 1, flags, step)) return 1;
+    }
+    for (int r = match_nodes[node].regex_edges; r >= 0; r = match_regex[r].next) {
+        if (regexec(&match_regex[r].re, words[0], 0, NULL, 0) == 0 &&
+            match_walk(match_regex[r].to, words + 1, n - 1, flags, step)) return 1;
+    }
+    return 0;
+}
+
+// Does the line satisfy the step?
+int match_line(const char *line, int step) {
+    struct Tokens t;
+    uint64_t flags;
+    int matched = 0;
+    if (match_node_count == 0) return 0;
+    if (shell_lex(line, &t) == 0) {
+        char *words[t.count + 1];
+        for (int i = 0; i < t.count; i++) words[i] = t.tok[i].text;
+        int n = match_fold_flags(words, t.count, &flags);
+        matched = n > 0 && match_walk(0, words, n, flags, step);
+    }
+    tokens_free(&t);
+    return matched;
+}
+
+static const char *quest_file_path() {
+    static char path[PATH_MAX];
+    char *env = getenv("SHELLQUEST_QUESTS");
+    if (env && *env) return env;
+    if (access(QUEST_FILE, R_OK) == 0) return QUEST_FILE;
+    // Fall back to the copy next to the binary, for running from a checkout
+    ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 16);
+    if (n <= 0) return QUEST_FILE;
+    path[n] = '\0';
+    char *slash = strrchr(path, '/');
+    strcpy(slash ? slash + 1 : path, "quests.def");
+    return path;
+}
+
+void quests_load() {
+    const char *path = quest_file_path();
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        printf("Warning: no quest catalogue at %s\n", path);
+        return;
+    }
+    char *line = NULL, *unlocks = NULL;
+    size_t cap = 0, unlocks_len = 0;
+    int lineno = 0;
+    struct Quest *quest = NULL;
+    struct QuestStep *st = NULL;
+    while (getline(&line, &cap, fp) > 0) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *key = line + strspn(line, " \t");
+        if (*key == '\0' || *key == '#') continue;
+        char *value = key + strcspn(key, " \t");
+        if (*value) *value++ = '\0';
+        value += strspn(value, " \t");
+        if (strcmp(key, "quest") == 0) {
+            quests = quest_grow(quests, quest_count, sizeof(struct Quest));
+            quest = &quests[quest_count++];
+            *quest = (struct Quest){ quest_string(value), -1, -1, -1, -1, 0, 0, quest_fixture_count, 0, -1, -1 };
+            quest->topic = quest->name;
+            st = NULL;
+            continue;
+        }
+        if (!quest) {
+            printf("%s:%d: '%s' outside a quest\n", path, lineno, key);
+            continue;
+        }
+        // Quest-level fields after the first step still belong to the step,
+        // so xp/brief/say of an action quest go on an implicit step.
+        int *text = NULL;
+        if (strcmp(key, "topic") == 0) quest->topic = quest_string(value);
+        else if (strcmp(key, "cwd") == 0) quest->cwd = quest_string(value);
+        else if (strcmp(key, "action") == 0) quest->action = quest_string(value);
+        else if (strcmp(key, "host") == 0) quest->host = 1;
+        else if (strcmp(key, "intro") == 0) {
+            if (quest->intro < 0) {
+                quest->intro = quest_string(value);
+            } else {
+                char *joined;
+                asprintf(&joined, "%s\n%s", QS(quest->intro), value);
+                quest->intro = quest_string(joined);
+                free(joined);
+            }
+        } else if (strcmp(key, "dir") == 0 || strcmp(key, "file") == 0) {
+            char *contents = NULL;
+            if (key[0] == 'f') {
+                contents = value + strcspn(value, " \t");
+                if (*contents) *contents++ = '\0';
+            }
+            quest_fixtures = quest_grow(quest_fixtures, quest_fixture_count, sizeof(struct QuestFixture));
+            quest_fixtures[quest_fixture_count].path = quest_string(value);
+            quest_fixtures[quest_fixture_count].contents = contents ? quest_string(contents) : -1;
+            quest_fixture_count++;
+            quest->nfixtures++;
+        } else if (strcmp(key, "unlock") == 0) {
+            // Resolved once every quest is loaded: "<unlocker> <unlocked>\n"
+            unlocks = realloc(unlocks, unlocks_len + strlen(QS(quest->name)) + strlen(value) + 3);
+            unlocks_len += sprintf(unlocks + unlocks_len, "%s %s\n", QS(quest->name), value);
+        } else if (strcmp(key, "step") == 0) {
+            st = quest_new_step(quest);
+            st->text = quest_string(value);
+            match_compile(value, st - quest_steps);
+        } else if (strcmp(key, "match") == 0 && st) {
+            match_compile(value, st - quest_steps);
+        } else {
+            if (!st) st = quest_new_step(quest);
+            if (strcmp(key, "xp") == 0) st->xp = atoi(value);
+            else if (strcmp(key, "enter") == 0) text = &st->enter;
+            else if (strcmp(key, "brief") == 0) text = &st->brief;
+            else if (strcmp(key, "detail") == 0) text = &st->detail;
+            else if (strcmp(key, "say") == 0) text = &st->say;
+            else if (strcmp(key, "retry") == 0) text = &st->retry;
+            else if (strcmp(key, "bench") == 0) text = &st->bench;
+            else printf("%s:%d: unknown field '%s'\n", path, lineno, key);
+            if (text) *text = quest_string(value);
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    quest_index_size = 16;
+    while (quest_index_size < quest_count * 2) quest_index_size *= 2;
+    quest_by_name = malloc(quest_index_size * sizeof(int));
+    quest_by_topic = malloc(quest_index_size * sizeof(int));
+    memset(quest_by_name, 0xff, quest_index_size * sizeof(int));
+    memset(quest_by_topic, 0xff, quest_index_size * sizeof(int));
+    for (int q = quest_count - 1; q >= 0; q--) {
+        // Walking backwards threads each topic's quests in file order
+        int first = quest_lookup(quest_by_topic, QS(quests[q].topic), offsetof(struct Quest, topic));
+        quests[q].next_in_topic = first;
+        if (first >= 0) {
+            int *index = quest_by_topic;
+            for (uint32_t i = str_hash(QS(quests[q].topic));; i++) {
+                if (index[i & (quest_index_size - 1)] == first) {
+                    index[i & (quest_index_size - 1)] = q;
+                    break;
+                }
+            }
+        } else {
+            quest_index_add(quest_by_topic, q, offsetof(struct Quest, topic));
+        }
+    }
+    for (int q = 0; q < quest_count; q++) quest_index_add(quest_by_name, q, offsetof(struct Quest, name));
+    for (char *u = unlocks, *nl; u && *u; u = nl + 1) {
+        nl = strchr(u, '\n');
+        *nl = '\0';
+        char *target = strchr(u, ' ');
+        *target++ = '\0';
+        int from = quest_lookup(quest_by_name, u, offsetof(struct Quest, name));
+        int to = quest_lookup(quest_by_name, target, offsetof(struct Quest, name));
+        if (to < 0) printf("%s: %s unlocks unknown quest %s\n", path, u, target);
+        else quests[to].unlocked_by = from;
+    }
+    free(unlocks);
+    quest_progress = calloc(quest_count ? quest_count : 1, sizeof(struct QuestProgress));
+}
+
+static void quest_complete() {
+    struct Quest *quest = &quests[active_quest];
+    struct QuestProgress *qp = &quest_progress[active_quest];
+    if (qp->state != QUEST_DONE) completed_quests++; // replays count once
+    qp->state = QUEST_DONE;
+    qp->finished_at = time(NULL);
+    int64_t now = log_now();
+    log_event(LOG_QUEST_DONE, 0, now, now, active_quest, active_step, NULL);
+    // A quest that ends by entering a directory leaves the learner there
+    if (quest->nsteps > 0 && quest_steps[quest->first_step + quest->nsteps - 1].enter >= 0) active_quest = -1;
+    else quest_end();
+    vfs_sync();
+    check_level_up();
+}
+
+static void quest_step_done() {
+    struct Quest *quest = &quests[active_quest];
+    struct QuestStep *st = &quest_steps[quest->first_step + active_step];
+    xp += st->xp;
+    if (st->brief >= 0) show_explanation(QS(quest->name), QS(st->brief), st->detail >= 0 ? QS(st->detail) : "");
+    if (st->say >= 0) printf("%s\n", QS(st->say));
+    if (++active_step > quest_progress[active_quest].step) quest_progress[active_quest].step = active_step;
+    if (active_step >= quest->nsteps) quest_complete();
+}
+
+void quest_start(int q) {
+    struct Quest *quest = &quests[q];
+    if (quest->host && sandbox_mode == SANDBOX_USERNS) {
+        printf("Quest '%s' needs sudo on the real system, which the sandbox keeps out of reach.\n", QS(quest->name));
+        printf("Run it with SHELLQUEST_SANDBOX=off shellquest.\n");
+        return;
+    }
+    if (active_quest >= 0) {
+        printf("Leaving quest '%s'.\n", QS(quests[active_quest].name));
+        quest_end();
+    }
+    char path[PATH_MAX];
+    if (quest->intro >= 0) printf("%s\n", QS(quest->intro));
+    int64_t setting_up = perf_now();
+    int failed = sandbox_reset(q) != 0;
+    perf_record(PERF_SETUP, setting_up);
+    if (failed) {
+        active_quest = q;
+        quest_end();
+        return;
+    }
+    if (quest->cwd >= 0) {
+        snprintf(path, sizeof(path), "%s/%s", SANDBOX_DIR, QS(quest->cwd));
+        if (chdir(path) != 0) printf("Error: Failed to change to %s\n", path);
+    }
+    active_quest = q;
+    active_step = 0;
+    int64_t now = log_now();
+    log_event(LOG_QUEST_START, 0, now, now, q, 0, NULL);
+    struct QuestProgress *qp = &quest_progress[q];
+    qp->attempts++;
+    if (qp->state == QUEST_NEW) {
+        qp->state = QUEST_STARTED;
+        qp->started_at = time(NULL);
+    }
+    if (quest->action >= 0) {
+        for (size_t i = 0; i < sizeof(quest_actions) / sizeof(quest_actions[0]); i++) {
+            if (strcmp(quest_actions[i].name, QS(quest->action)) == 0) quest_actions[i].run();
+        }
+        if (quest->nsteps == 0) quest_complete();
+        else quest_step_done();
+    }
+}
+
+// Leave the active quest: back to the sandbox root, fixtures removed.
+void quest_end() {
+    if (active_quest < 0) return;
+    struct Quest *quest = &quests[active_quest];
+    char path[PATH_MAX];
+    int64_t started = perf_now();
+    chdir(SANDBOX_DIR);
+    for (int i = quest->nfixtures - 1; i >= 0 && sandbox_mode == SANDBOX_PLAIN; i--) {
+        struct QuestFixture *f = &quest_fixtures[quest->first_fixture + i];
+        if (f->contents >= 0 || strchr(QS(f->path), '/')) continue; // goes with its directory
+        snprintf(path, sizeof(path), "%s/%s", SANDBOX_DIR, QS(f->path));
+        fixture_remove(path);
+    }
+    sandbox_reset(-1);
+    perf_record(PERF_TEARDOWN, started);
+    active_quest = -1;
+}
+
+// Feed a line to the active quest. Returns 0 if the line is not the
+// command the current step wants, and the caller should run it as usual.
+int quest_input(char *input) {
+    if (active_quest < 0) return 0;
+    struct Quest *quest = &quests[active_quest];
+    struct QuestStep *st = &quest_steps[quest->first_step + active_step];
+    if (!match_line(input, st - quest_steps)) return 0;
+    int ok = run_input(input) == 0;
+    if (ok && st->enter >= 0) {
+        // The step only counts if it ended up in the right directory
+        char path[PATH_MAX];
+        struct stat want, cwd;
+        snprintf(path, sizeof(path), "%s/%s", SANDBOX_DIR, QS(st->enter));
+        ok = stat(path, &want) == 0 && stat(".", &cwd) == 0 &&
+             want.st_dev == cwd.st_dev && want.st_ino == cwd.st_ino;
+    }
+    if (!ok) {
+        if (st->retry >= 0) printf("%s\n", QS(st->retry));
+        return 1;
+    }
+    quest_step_done();
+    return 1;
+}
+
+// Level up
+void check_level_up() {
+    if (xp >= level * 50) {
+        level++;
+        printf("🎉 Level %d!\n", level);
+    }
+    save_progress();
+}
+
+// Stats
+void show_stats() {
+    printf("XP: %d, Level: %d, Quests: %d/%d\n", xp, level, completed_quests, quest_count);
+    // What the kernel module saw this session run, if it is loaded
+    struct sq_activity a;
+    int kfd = open(KMOD_STATS, O_RDONLY | O_CLOEXEC);
+    if (kfd >= 0 && ioctl(kfd, SQ_IOC_ACTIVITY, &a) == 0) {
+        printf("Commands: %llu (avg exec %llu us), Failed: %llu, Signalled: %llu\n",
+               (unsigned long long)a.execs, (unsigned long long)(a.execs ? a.exec_ns / a.execs / 1000 : 0),
+               (unsigned long long)a.failed, (unsigned long long)a.signalled);
+    }
+    if (kfd >= 0) close(kfd);
+}
+
+// Guide
+void show_guide() {
+    printf("\n🎉 Welcome to ShellQuest: Your Gamified Journey to Mastering Linux! 🎉\n\n");
+    printf("ShellQuest turns learning Linux commands into an adventure. Earn XP, level up, and unlock quests!\n\n");
+    printf("Quick Start Guide:\n");
+    printf("1. Type 'teach <command>' to start a quest (e.g., 'teach ls').\n");
+    printf("2. Follow prompts to practice commands in a safe sandbox.\n");
+    printf("3. Complete tasks to earn XP and unlock sub-quests (e.g., 'ls -a').\n");
+    printf("4. Check progress with 'stats' or list quests with 'quests'.\n");
+    printf("5. Finish all quests to graduate to a standard terminal!\n\n");
+    printf("Tips:\n");
+    printf("- Use 'man <command>' for help.\n");
+    if (sandbox_mode != SANDBOX_PLAIN) printf("- Sandboxed: No system risks. Each quest starts from a fresh copy.\n");
+    else printf("- Sandbox: %s (only that directory is reset between quests).\n", SANDBOX_DIR);
+    printf("- Try OS quests like 'schedule' or 'kernelmod'.\n");
+    printf("Start with 'teach ls'!\n");
+}
+
+// Quests list
+void list_quests() {
+    printf("Available Quests:\n");
+    for (int q = 0; q < quest_count; q++) {
+        // Each topic is listed once, at its first quest
+        if (quest_lookup(quest_by_topic, QS(quests[q].topic), offsetof(struct Quest, topic)) != q) continue;
+        printf("- %s", QS(quests[q].topic));
+        if (quests[q].next_in_topic >= 0 || strcmp(QS(quests[q].name), QS(quests[q].topic)) != 0) {
+            printf(" (Sub-quests:");
+            for (int sub = q; sub >= 0; sub = quests[sub].next_in_topic)
+                printf(" %s%s%s", QS(quests[sub].name), quest_progress[sub].state == QUEST_DONE ? " ✓" : "", quests[sub].next_in_topic >= 0 ? "," : "");
+            printf(")");
+        } else if (quest_progress[q].state == QUEST_DONE) {
+            printf(" ✓");
+        }
+        printf("\n");
+    }
+    printf("Completed: %d/%d\n", completed_quests, quest_count);
+}
+
+// Command hash
+static int path_string(const char *str) {
+    size_t len = strlen(str) + 1;
+    if (path_strings_len + len > path_strings_cap) {
+        while (path_strings_len + len > path_strings_cap) path_strings_cap = path_strings_cap ? path_strings_cap * 2 : 16384;
+        path_strings = realloc(path_strings, path_strings_cap);
+    }
+    memcpy(path_strings + path_strings_len, str, len);
+    path_strings_len += len;
+    return path_strings_len - len;
+}
+
+static void complete_add(const char *name, int kinds) {
+    complete_words = quest_grow(complete_words, complete_word_count, sizeof(struct CompleteWord));
+    complete_words[complete_word_count++] = (struct CompleteWord){ name, kinds };
+}
+
+static int complete_cmp(const void *a, const void *b) {
+    return strcmp(((const struct CompleteWord *)a)->name, ((const struct CompleteWord *)b)->name);
+}
+
+// Scan every absolute $PATH directory into the hash and the completion
+// array, watching each one. Relative entries follow the working directory,
+// so they are skipped.
+void path_build() {
+    int64_t started = perf_now();
+    path_command_count = 0;
+    path_strings_len = 0;
+    complete_word_count = 0;
+    if (path_watch_fd >= 0) close(path_watch_fd);
+    path_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    const char *env = getenv("PATH");
+    free(path_current);
+    path_current = strdup(env ? env : "");
+    char *dirs = strdup(path_current), *save;
+    struct stat seen[64]; // merged-/usr systems list /bin and /usr/bin both
+    int nseen = 0;
+    for (char *dir = strtok_r(dirs, ":", &save); dir; dir = strtok_r(NULL, ":", &save)) {
+        DIR *d = dir[0] == '/' ? opendir(dir) : NULL;
+        if (!d) continue;
+        int dup = 0;
+        if (nseen < 64 && fstat(dirfd(d), &seen[nseen]) == 0) {
+            for (int i = 0; i < nseen; i++) {
+                if (seen[i].st_dev == seen[nseen].st_dev && seen[i].st_ino == seen[nseen].st_ino) dup = 1;
+            }
+            if (!dup) nseen++;
+        }
+        if (dup) {
+            closedir(d);
+            continue;
+        }
+        if (path_watch_fd >= 0) inotify_add_watch(path_watch_fd, dir, PATH_WATCH);
+        int dir_off = path_string(dir);
+        struct dirent *e;
+        while ((e = readdir(d))) {
+            struct stat st;
+            if (e->d_type != DT_REG && e->d_type != DT_LNK && e->d_type != DT_UNKNOWN) continue;
+            if (fstatat(dirfd(d), e->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode) || !(st.st_mode & 0111)) continue;
+            path_commands = quest_grow(path_commands, path_command_count, sizeof(struct PathCommand));
+            path_commands[path_command_count++] = (struct PathCommand){ path_string(e->d_name), dir_off };
+        }
+        closedir(d);
+    }
+    free(dirs);
+    // The first directory to have a name keeps it, as in a PATH search
+    path_hash_size = 16;
+    while (path_hash_size < path_command_count * 2) path_hash_size *= 2;
+    path_hash = realloc(path_hash, path_hash_size * sizeof(int));
+    memset(path_hash, 0xff, path_hash_size * sizeof(int));
+    for (int c = 0; c < path_command_count; c++) {
+        const char *name = path_strings + path_commands[c].name;
+        for (uint32_t i = str_hash(name);; i++) {
+            int *slot = &path_hash[i & (path_hash_size - 1)];
+            if (*slot >= 0 && strcmp(path_strings + path_commands[*slot].name, name) == 0) break;
+            if (*slot < 0) {
+                *slot = c;
+                complete_add(name, COMPLETE_COMMAND);
+                break;
+            }
+        }
+    }
+    for (size_t b = 0; b < sizeof(builtins) / sizeof(builtins[0]); b++) complete_add(builtins[b].name, COMPLETE_BUILTIN);
+    for (int q = 0; q < quest_count; q++) {
+        complete_add(QS(quests[q].name), COMPLETE_QUEST);
+        if (quests[q].topic >= 0) complete_add(QS(quests[q].topic), COMPLETE_QUEST);
+    }
+    // Sort, then fold duplicates into one word with every kind it has
+    qsort(complete_words, complete_word_count, sizeof(struct CompleteWord), complete_cmp);
+    int n = 0;
+    for (int i = 0; i < complete_word_count; i++) {
+        if (n > 0 && strcmp(complete_words[n - 1].name, complete_words[i].name) == 0) {
+            complete_words[n - 1].kinds |= complete_words[i].kinds;
+        } else {
+            complete_words[n++] = complete_words[i];
+        }
+    }
+    complete_word_count = n;
+    path_stale = 0;
+    perf_record(PERF_HASH, started);
+}
+
+// Rebuild if a watched directory changed or $PATH is not what was scanned.
+// Events are only counted, never parsed: any of them makes the table stale.
+static void path_refresh() {
+    char buf[4096];
+    while (path_watch_fd >= 0 && read(path_watch_fd, buf, sizeof(buf)) > 0) path_stale = 1;
+    const char *env = getenv("PATH");
+    if (!path_current || strcmp(path_current, env ? env : "") != 0) path_stale = 1;
+    if (path_stale) path_build();
+}
+
+// Absolute path of a command found on $PATH, or NULL. The result is
+// overwritten by the next call.
+const char *path_lookup(const char *name) {
+    static char path[PATH_MAX];
+    path_refresh();
+    for (uint32_t i = str_hash(name);; i++) {
+        int c = path_hash[i & (path_hash_size - 1)];
+        if (c < 0) return NULL;
+        if (strcmp(path_strings + path_commands[c].name, name) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", path_strings + path_commands[c].dir, name);
+            return path;
+        }
+    }
+}
+
+// hash: the table's size and last build time; -r rebuilds it, and names
+// print where each would run from.
+int builtin_path_hash(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+        path_stale = 1;
+        path_refresh();
+        return 0;
+    }
+    if (argc > 1) {
+        int status = 0;
+        for (int i = 1; i < argc; i++) {
+            const char *path = builtin_find(argv[i]) ? "builtin" : path_lookup(argv[i]);
+            if (path) {
+                printf("%s: %s\n", argv[i], path);
+            } else {
+                printf("hash: %s: not found\n", argv[i]);
+                status = 1;
+            }
+        }
+        return status;
+    }
+    path_refresh();
+    struct PerfHist *h = &perf_hist[PERF_HASH];
+    printf("%d commands on $PATH, %d completion words; %lu builds, mean %.2f ms\n",
+           path_command_count, complete_word_count, (unsigned long)h->count, h->count ? h->sum / 1e6 / h->count : 0);
+    return 0;
+}
+
+// Tab completion: the first word of a command completes to commands and
+// builtins, the word after 'teach' to quest names and topics. Anything
+// else, or a word with a '/', is left to readline's filename completion.
+static int complete_kinds, complete_next;
+
+static char *complete_match(const char *text, int state) {
+    size_t len = strlen(text);
+    if (state == 0) {
+        // First word not below text; matches follow in order
+        int lo = 0, hi = complete_word_count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (strcmp(complete_words[mid].name, text) < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        complete_next = lo;
+    }
+    while (complete_next < complete_word_count && strncmp(complete_words[complete_next].name, text, len) == 0) {
+        struct CompleteWord *w = &complete_words[complete_next++];
+        if (w->kinds & complete_kinds) return strdup(w->name);
+    }
+    return NULL;
+}
+
+// Does the word ending before 'end' start a command?
+static int complete_command_at(int end) {
+    while (end > 0 && isblank((unsigned char)rl_line_buffer[end - 1])) end--;
+    return end == 0 || strchr("|&;", rl_line_buffer[end - 1]);
+}
+
+char **shell_complete(const char *text, int start, int end) {
+    int64_t started = perf_now();
+    if (strchr(text, '/')) return NULL;
+    if (complete_command_at(start)) {
+        complete_kinds = COMPLETE_COMMAND | COMPLETE_BUILTIN;
+    } else {
+        int i = start;
+        while (i > 0 && isblank((unsigned char)rl_line_buffer[i - 1])) i--;
+        int word_end = i;
+        while (i > 0 && !isblank((unsigned char)rl_line_buffer[i - 1]) && !strchr("|&;", rl_line_buffer[i - 1])) i--;
+        if (word_end - i != 5 || strncmp(rl_line_buffer + i, "teach", 5) != 0 || !complete_command_at(i)) return NULL;
+        complete_kinds = COMPLETE_QUEST;
+    }
+    path_refresh();
+    rl_attempted_completion_over = 1;
+    char **matches = rl_completion_matches(text, complete_match);
+    perf_record(PERF_COMPLETE, started);
+    return matches;
+}
+
+// Sandbox
+static int sandbox_write(const char *path, const char *text) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t len = strlen(text);
+    int ok = write(fd, text, len) == len;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+static int sandbox_cgroup_write(const char *dir, const char *file, const char *text) {
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    return sandbox_write(path, text);
+}
+
+static void sandbox_cgroup_limits(const char *leaf) {
+    char text[32];
+    sandbox_cgroup_write(leaf, "cpu.max", SANDBOX_CPU_MAX);
+    snprintf(text, sizeof(text), "%ld", SANDBOX_MEMORY_MAX);
+    sandbox_cgroup_write(leaf, "memory.max", text);
+    sandbox_cgroup_write(leaf, "memory.swap.max", "0");
+    snprintf(text, sizeof(text), "%d", SANDBOX_PIDS_MAX);
+    sandbox_cgroup_write(leaf, "pids.max", text);
+}
+
+// Kill everything in a cgroup and remove it with what is below it. One
+// whose processes are still dying after wait ms stays for the next sweep.
+static void sandbox_cgroup_remove(const char *path, int wait) {
+    sandbox_cgroup_write(path, "cgroup.kill", "1");
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    struct dirent *de;
+    char sub[PATH_MAX + 256];
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_type != DT_DIR || de->d_name[0] == '.') continue;
+        snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+        sandbox_cgroup_remove(sub, wait);
+    }
+    closedir(dir);
+    for (int tries = 0; rmdir(path) != 0 && errno == EBUSY && tries < wait; tries++) usleep(1000);
+}
+
+// Remove every cgroup below the session's but keep
+static void sandbox_cgroup_sweep(const char *keep, int wait) {
+    DIR *dir = opendir(sandbox_cgroup);
+    if (!dir) return;
+    struct dirent *de;
+    char leaf[sizeof(sandbox_cgroup) + 256];
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_type != DT_DIR || de->d_name[0] == '.') continue;
+        snprintf(leaf, sizeof(leaf), "%s/%s", sandbox_cgroup, de->d_name);
+        if (!keep || strcmp(leaf, keep) != 0) sandbox_cgroup_remove(leaf, wait);
+    }
+    closedir(dir);
+}
+
+// Move the shell into a new leaf for quest q (-1 between quests), and
+// with it every child it starts from now on; the old leaf is emptied.
+static void sandbox_cgroup_next(int q) {
+    if (!sandbox_cgroup[0]) return;
+    char leaf[sizeof(sandbox_cgroup) + 64], pid[16];
+    // The generation only counts leaves the shell has really moved into
+    snprintf(leaf, sizeof(leaf), "%s/%d.%s", sandbox_cgroup, sandbox_generation + 1, q >= 0 ? QS(quests[q].name) : "lobby");
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    if (mkdir(leaf, 0755) != 0) return;
+    sandbox_cgroup_limits(leaf);
+    if (sandbox_cgroup_write(leaf, "cgroup.procs", pid) != 0) {
+        rmdir(leaf);
+        return;
+    }
+    sandbox_generation++;
+    snprintf(sandbox_leaf, sizeof(sandbox_leaf), "%s", leaf);
+    sandbox_cgroup_sweep(leaf, 0);
+}
+
+// Find the shell's cgroup v2 and make this session's below it. Controllers
+// only reach the leaves if every cgroup above enables them for its
+// children, which the one we started in refuses while other processes
+// share it; whatever does not get through is left to rlimits.
+static void sandbox_cgroup_init() {
+    char line[PATH_MAX], path[sizeof(sandbox_leaf) + 16];
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) != 0) continue;
+        line[strcspn(line, "\n")] = '\0';
+        if (snprintf(sandbox_cgroup_home, sizeof(sandbox_cgroup_home), "/sys/fs/cgroup%s",
+                     strcmp(line + 3, "/") == 0 ? "" : line + 3) >= (int)sizeof(sandbox_cgroup_home))
+            sandbox_cgroup_home[0] = '\0'; // too deep to name: no cgroup rather than the wrong one
+    }
+    fclose(f);
+    snprintf(path, sizeof(path), "%s/cgroup.controllers", sandbox_cgroup_home);
+    if (!sandbox_cgroup_home[0] || access(path, F_OK) != 0) return; // no unified hierarchy
+    snprintf(sandbox_cgroup, sizeof(sandbox_cgroup), "%s/shellquest.%d", sandbox_cgroup_home, (int)getpid());
+    if (mkdir(sandbox_cgroup, 0755) != 0) {
+        sandbox_cgroup[0] = '\0';
+        return;
+    }
+    sandbox_cgroup_next(-1);
+    if (!sandbox_leaf[0]) {
+        rmdir(sandbox_cgroup);
+        sandbox_cgroup[0] = '\0';
+        return;
+    }
+    static const char *controllers[] = {"+cpu", "+memory", "+pids"};
+    for (int i = 0; i < 3; i++) {
+        sandbox_cgroup_write(sandbox_cgroup_home, "cgroup.subtree_control", controllers[i]);
+        sandbox_cgroup_write(sandbox_cgroup, "cgroup.subtree_control", controllers[i]);
+    }
+    sandbox_cgroup_limits(sandbox_leaf);
+    static const char *files[] = {"cpu.max", "memory.max", "pids.max"};
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s", sandbox_leaf, files[i]);
+        if (access(path, F_OK) == 0) sandbox_limits |= 1 << i;
+    }
+}
+
+// Back to where the shell started, taking everything it left running down.
+// A daemon's session may not leave its own leaf; the daemon removes that.
+static void sandbox_cgroup_release() {
+    if (!sandbox_cgroup[0]) return;
+    char pid[16];
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    int moved = sandbox_cgroup_write(sandbox_cgroup_home, "cgroup.procs", pid) == 0;
+    sandbox_cgroup_sweep(moved ? NULL : sandbox_leaf, 100);
+    if (moved) rmdir(sandbox_cgroup);
+    sandbox_cgroup[0] = '\0';
+}
+
+// A daemon session's cgroup, below the daemon's and delegated to the
+// learner, so the session can go on making a leaf per quest after it
+// gives up root.
+static void sandbox_cgroup_session(uid_t uid, gid_t gid) {
+    if (!sandbox_cgroup[0]) return;
+    char dir[sizeof(sandbox_cgroup)], path[sizeof(dir) + 32];
+    if (snprintf(dir, sizeof(dir), "%s/session.%d", sandbox_cgroup, (int)getpid()) >= (int)sizeof(dir) ||
+        mkdir(dir, 0755) != 0) {
+        sandbox_cgroup[0] = '\0';
+        return;
+    }
+    static const char *controllers[] = {"+cpu", "+memory", "+pids"};
+    for (int i = 0; i < 3; i++) sandbox_cgroup_write(dir, "cgroup.subtree_control", controllers[i]);
+    static const char *delegated[] = {"", "/cgroup.procs", "/cgroup.subtree_control", "/cgroup.threads"};
+    for (int i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s%s", dir, delegated[i]);
+        chown(path, uid, gid);
+    }
+    memcpy(sandbox_cgroup, dir, sizeof(dir));
+    sandbox_generation = 0;
+    sandbox_cgroup_next(-1);
+}
+
+// Does a child need rlimits for what the cgroup does not enforce? Only in
+// a namespace sandbox: the plain shell runs commands unconfined.
+int sandbox_rlimited() {
+    int both = SANDBOX_LIMIT_MEMORY | SANDBOX_LIMIT_CPU;
+    return sandbox_mode != SANDBOX_PLAIN && (sandbox_limits & both) != both;
+}
+
+// Set those rlimits; called in the child between fork and exec, so the
+// command is capped from its first instruction.
+void sandbox_confine() {
+    if (!sandbox_rlimited()) return;
+    if (!(sandbox_limits & SANDBOX_LIMIT_MEMORY)) {
+        struct rlimit mem = { SANDBOX_MEMORY_MAX, SANDBOX_MEMORY_MAX };
+        setrlimit(RLIMIT_AS, &mem);
+    }
+    if (!(sandbox_limits & SANDBOX_LIMIT_CPU)) {
+        struct rlimit cpu = { SANDBOX_CPU_SECONDS, SANDBOX_CPU_SECONDS };
+        setrlimit(RLIMIT_CPU, &cpu);
+    }
+}
+
+// Hand the last reference to an old sandbox to the reaper, so tearing
+// down its layer happens off the prompt's path.
+static void sandbox_drop_later(int fd) {
+    pthread_mutex_lock(&reaper_lock);
+    if (reaper_running && sandbox_drops < SANDBOX_DROP_MAX) {
+        sandbox_drop[sandbox_drops++] = fd;
+        reaper_pending = 1;
+        pthread_cond_signal(&reaper_cond);
+        fd = -1;
+    }
+    pthread_mutex_unlock(&reaper_lock);
+    if (fd >= 0) close(fd);
+}
+
+// Replace the sandbox with a new overlay: quest q's fixtures (the empty
+// lobby for -1) under an empty tmpfs.
+static int sandbox_mount(int q) {
+    char opts[2 * PATH_MAX];
+    int old = open(SANDBOX_DIR, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    chdir("/");
+    umount2(SANDBOX_DIR, MNT_DETACH);
+    umount2(SANDBOX_STAGE "/layer", MNT_DETACH);
+    snprintf(opts, sizeof(opts),
+             "lowerdir=" SANDBOX_STAGE "/lower/%s,upperdir=" SANDBOX_STAGE "/layer/upper,workdir=" SANDBOX_STAGE
+             "/layer/work", q >= 0 ? QS(quests[q].name) : ".lobby");
+    int err = mount("shellquest", SANDBOX_STAGE "/layer", "tmpfs", 0, SANDBOX_UPPER_OPTS) != 0 ||
+              mkdir(SANDBOX_STAGE "/layer/upper", 0755) != 0 || mkdir(SANDBOX_STAGE "/layer/work", 0700) != 0 ||
+              mount("shellquest", SANDBOX_DIR, "overlay", 0, opts) != 0;
+    if (err) printf("Error: Failed to mount the sandbox: %s\n", strerror(errno));
+    chdir(SANDBOX_DIR);
+    if (old >= 0) sandbox_drop_later(old);
+    return err ? -1 : 0;
+}
+
+// Start a fresh sandbox for quest q (-1 between quests) and go to its root.
+int sandbox_reset(int q) {
+    sandbox_cgroup_next(q);
+    if (sandbox_mode != SANDBOX_PLAIN) return sandbox_mount(q);
+    chdir(SANDBOX_DIR);
+    return q >= 0 ? fixture_build(q, SANDBOX_DIR) : 0;
+}
+
+// In a new user namespace: keep our own IDs, and nobody else's
+static void sandbox_map_ids(uid_t uid, gid_t gid) {
+    char map[64];
+    sandbox_write("/proc/self/setgroups", "deny");
+    snprintf(map, sizeof(map), "%d %d 1", (int)uid, (int)uid);
+    sandbox_write("/proc/self/uid_map", map);
+    snprintf(map, sizeof(map), "%d %d 1", (int)gid, (int)gid);
+    sandbox_write("/proc/self/gid_map", map);
+}
+
+// Take the sandbox's namespaces and mount the lobby. On failure the shell
+// is left on the plain directory, as when namespaces are switched off.
+static void sandbox_enter() {
+    char *env = getenv("SHELLQUEST_SANDBOX");
+    if (env && strcmp(env, "off") == 0) return;
+    uid_t uid = geteuid();
+    gid_t gid = getegid();
+    int userns = uid != 0;
+    if (unshare(CLONE_NEWNS | (userns ? CLONE_NEWUSER : 0)) != 0) {
+        printf("Sandbox: no private mount namespace (%s); quests use the real filesystem.\n", strerror(errno));
+        return;
+    }
+    if (userns) sandbox_map_ids(uid, gid);
+    mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL);
+
+    // The progress store and session logs stay writable: clones of them
+    // are taken now and put back over the read-only tree at the end
+    char keep[2][PATH_MAX];
+    int keep_fd[2];
+    snprintf(keep[0], sizeof(keep[0]), "%s", progress_path);
+    char *slash = strrchr(keep[0], '/');
+    if (slash) *slash = '\0';
+    log_default_dir(keep[1], sizeof(keep[1]));
+    mkdir(keep[1], 0700);
+    for (int i = 0; i < 2; i++) keep_fd[i] = open_tree(AT_FDCWD, keep[i], OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+
+    char path[PATH_MAX];
+    int q = 0;
+    if (mount("shellquest", "/tmp", "tmpfs", 0, "mode=1777") != 0) goto fail;
+    mkdir(SANDBOX_STAGE, 0755);
+    mkdir(SANDBOX_STAGE "/lower", 0755);
+    if (fixture_dir(SANDBOX_STAGE "/lower/.lobby") != 0 || mkdir(SANDBOX_STAGE "/layer", 0755) != 0 ||
+        mkdir(SANDBOX_DIR, 0755) != 0)
+        goto unmount;
+    for (q = 0; q < quest_count; q++) {
+        snprintf(path, sizeof(path), SANDBOX_STAGE "/lower/%s", QS(quests[q].name));
+        if (fixture_dir(path) != 0 || fixture_build(q, path) != 0) goto unmount;
+    }
+    if (mount(SANDBOX_STAGE "/lower", SANDBOX_STAGE "/lower", NULL, MS_BIND, NULL) != 0) goto unmount;
+    sandbox_mode = userns ? SANDBOX_USERNS : SANDBOX_OVERLAY;
+    if (sandbox_mount(-1) != 0) {
+        sandbox_mode = SANDBOX_PLAIN;
+        goto unmount;
+    }
+
+    struct mount_attr ro = { .attr_set = MOUNT_ATTR_RDONLY }, rw = { .attr_clr = MOUNT_ATTR_RDONLY };
+    if (mount_setattr(AT_FDCWD, "/", AT_RECURSIVE, &ro, sizeof(ro)) == 0) {
+        mount_setattr(AT_FDCWD, "/tmp", AT_RECURSIVE, &rw, sizeof(rw));
+        mount_setattr(AT_FDCWD, SANDBOX_STAGE "/lower", 0, &ro, sizeof(ro));
+        if (sandbox_cgroup[0]) mount_setattr(AT_FDCWD, "/sys/fs/cgroup", 0, &rw, sizeof(rw));
+    } else {
+        printf("Sandbox: the real filesystem stays writable (%s).\n", strerror(errno));
+    }
+    for (int i = 0; i < 2; i++) {
+        if (keep_fd[i] < 0) continue;
+        fixture_dir(keep[i]);
+        if (move_mount(keep_fd[i], "", AT_FDCWD, keep[i], MOVE_MOUNT_F_EMPTY_PATH) != 0)
+            printf("Sandbox: %s is read-only (%s).\n", keep[i], strerror(errno));
+        close(keep_fd[i]);
+    }
+    return;
+
+unmount:
+    umount2("/tmp", MNT_DETACH);
+fail:
+    printf("Sandbox: cannot build the overlay (%s); quests use %s.\n", strerror(errno), SANDBOX_DIR);
+    for (int i = 0; i < 2; i++) {
+        if (keep_fd[i] >= 0) close(keep_fd[i]);
+    }
+}
+
+// Runs once the VFS image is open, and before any thread starts
+void setup_sandbox() {
+    mkdir(SANDBOX_DIR, 0755);
+    sandbox_cgroup_init();
+    sandbox_enter();
+    if (sandbox_mode == SANDBOX_PLAIN) chdir(SANDBOX_DIR);
+    fixture_start_reaper();
+}
+
+void cleanup_sandbox() {
+    chdir("/");
+    if (sandbox_mode != SANDBOX_PLAIN) {
+        // The namespace and every mount in it go with the process
+        fixture_stop_reaper();
+        sandbox_cgroup_release();
+        return;
+    }
+    // Keep the VFS image and journal so the next session maps them straight back in
+    DIR *dir = opendir(SANDBOX_DIR);
+    if (dir) {
+        struct dirent *de;
+        char path[PATH_MAX];
+        while ((de = readdir(dir)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 || strcmp(de->d_name, ".trash") == 0 ||
+                strncmp(de->d_name, ".vfs.img", 8) == 0)
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", SANDBOX_DIR, de->d_name);
+            fixture_remove(path);
+        }
+        closedir(dir);
+    }
+    fixture_stop_reaper();
+    rmdir(TRASH_DIR);
+    sandbox_cgroup_release();
+}
+
+// Fixtures
+// Create quest q's fixtures under base. Returns -1 after reporting the
+// one that could not be made.
+int fixture_build(int q, const char *base) {
+    struct Quest *quest = &quests[q];
+    char path[PATH_MAX];
+    for (int i = 0; i < quest->nfixtures; i++) {
+        struct QuestFixture *f = &quest_fixtures[quest->first_fixture + i];
+        snprintf(path, sizeof(path), "%s/%s", base, QS(f->path));
+        if ((f->contents < 0 ? fixture_dir(path) : fixture_file(path, *QS(f->contents) ? QS(f->contents) : "")) != 0) {
+            printf("Error: Failed to create %s\n", path);
+            return -1;
+        }
+        // File contents are one line of text
+        if (f->contents >= 0 && *QS(f->contents)) {
+            int fd = open(path, O_WRONLY | O_APPEND);
+            write(fd, "\n", 1);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+// mkdir -p
+int fixture_dir(const char *path) {
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char *p = buf + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(buf, 0755) != 0 && errno != EEXIST) return -1;
+        *p = '/';
+    }
+    if (mkdir(buf, 0755) != 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+// Create or truncate a file and write its seed contents.
+int fixture_file(const char *path, const char *contents) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    size_t len = strlen(contents);
+    int ok = write(fd, contents, len) == (ssize_t)len;
+    return close(fd) == 0 && ok ? 0 : -1;
+}
+
+static int fixture_unlink(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    remove(path);
+    return 0;
+}
+
+static void fixture_empty_trash() {
+    DIR *dir = opendir(TRASH_DIR);
+    if (!dir) return;
+    struct dirent *de;
+    char path[PATH_MAX];
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", TRASH_DIR, de->d_name);
+        nftw(path, fixture_unlink, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    closedir(dir);
+}
+
+static void *fixture_reaper(void *arg) {
+    pthread_mutex_lock(&reaper_lock);
+    for (;;) {
+        while (!reaper_pending && !reaper_stop) pthread_cond_wait(&reaper_cond, &reaper_lock);
+        int stop = reaper_stop;
+        int drops[SANDBOX_DROP_MAX], ndrops = sandbox_drops;
+        memcpy(drops, sandbox_drop, ndrops * sizeof(int));
+        reaper_pending = sandbox_drops = 0;
+        pthread_mutex_unlock(&reaper_lock);
+        // Closing the last reference to an old sandbox frees its layer here
+        for (int i = 0; i < ndrops; i++) close(drops[i]);
+        fixture_empty_trash();
+        pthread_mutex_lock(&reaper_lock);
+        if (stop) break;
+    }
+    pthread_mutex_unlock(&reaper_lock);
+    return NULL;
+}
+
+// Start the reaper; it first empties whatever a previous session left.
+void fixture_start_reaper() {
+    if (sandbox_mode == SANDBOX_PLAIN) mkdir(TRASH_DIR, 0700);
+    reaper_pending = 1;
+    reaper_stop = 0;
+    reaper_running = pthread_create(&reaper_thread, NULL, fixture_reaper, NULL) == 0;
+}
+
+// Drain the trash and wait for the reaper to finish.
+void fixture_stop_reaper() {
+    if (!reaper_running) {
+        fixture_empty_trash();
+        return;
+    }
+    pthread_mutex_lock(&reaper_lock);
+    reaper_stop = 1;
+    pthread_cond_signal(&reaper_cond);
+    pthread_mutex_unlock(&reaper_lock);
+    pthread_join(reaper_thread, NULL);
+    reaper_running = 0;
+}
+
+// rm -rf, deferred: one rename takes the tree out of the sandbox now and
+// the reaper deletes it later. Falls back to deleting in place.
+void fixture_remove(const char *path) {
+    char dest[PATH_MAX];
+    snprintf(dest, sizeof(dest), "%s/%d.%lu", TRASH_DIR, getpid(), trash_seq++);
+    if (rename(path, dest) != 0) {
+        if (errno != ENOENT) nftw(path, fixture_unlink, 16, FTW_DEPTH | FTW_PHYS);
+        return;
+    }
+    if (!reaper_running) {
+        nftw(dest, fixture_unlink, 16, FTW_DEPTH | FTW_PHYS);
+        return;
+    }
+    pthread_mutex_lock(&reaper_lock);
+    reaper_pending = 1;
+    pthread_cond_signal(&reaper_cond);
+    pthread_mutex_unlock(&reaper_lock);
+}
+
+// Progress
+// Create the directories above path, like mkdir -p on its dirname.
+static void progress_mkdirs(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(dir, 0700);
+        *slash = '/';
+    }
+}
+
+static void progress_locate() {
+    progress_default_path(progress_path, sizeof(progress_path));
+    progress_mkdirs(progress_path);
+}
+
+// The text format this store replaced: xp level completed ls-stage, then
+// the names of completed quests (none in files older than the catalogue).
+static void load_legacy_progress(FILE *fp) {
+    int ls_stage = 0;
+    char name[128];
+    fscanf(fp, "%d %d %d %d", &xp, &level, &completed_quests, &ls_stage);
+    int named = 0;
+    while (fscanf(fp, "%127s", name) == 1) {
+        int q = quest_lookup(quest_by_name, name, offsetof(struct Quest, name));
+        if (q >= 0) quest_progress[q].state = QUEST_DONE;
+        named++;
+    }
+    if (!named) {
+        int q = quest_lookup(quest_by_topic, "ls", offsetof(struct Quest, topic));
+        for (; q >= 0 && ls_stage > 0; q = quests[q].next_in_topic, ls_stage--) quest_progress[q].state = QUEST_DONE;
+    }
+}
+
+void load_progress() {
+    progress_locate();
+    int fd = open(progress_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        FILE *fp = fopen(PROGRESS_LEGACY, "r");
+        if (fp) {
+            load_legacy_progress(fp);
+            fclose(fp);
+        }
+        return;
+    }
+    struct stat st;
+    struct ProgressHeader hdr;
+    char *buf = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(hdr)) {
+        buf = malloc(st.st_size);
+        if (pread(fd, buf, st.st_size, 0) != st.st_size) {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    close(fd);
+    if (buf) memcpy(&hdr, buf, sizeof(hdr));
+    if (!buf || hdr.magic != PROGRESS_MAGIC || hdr.version != PROGRESS_VERSION ||
+        st.st_size != (off_t)(sizeof(hdr) + hdr.nquests * sizeof(struct ProgressRecord)) ||
+        hdr.checksum != progress_checksum(buf + sizeof(hdr), st.st_size - sizeof(hdr))) {
+        printf("Warning: %s is damaged or from another version; starting fresh\n", progress_path);
+        free(buf);
+        return;
+    }
+    xp = hdr.xp;
+    level = hdr.level;
+    completed_quests = hdr.completed;
+    struct ProgressRecord *rec = (struct ProgressRecord *)(buf + sizeof(hdr));
+    for (uint32_t i = 0; i < hdr.nquests; i++) {
+        rec[i].name[PROGRESS_NAME_MAX - 1] = '\0';
+        int q = quest_lookup(quest_by_name, rec[i].name, offsetof(struct Quest, name));
+        if (q < 0) continue; // dropped from the catalogue
+        quest_progress[q] = (struct QuestProgress){ rec[i].state, rec[i].step, rec[i].attempts, rec[i].started_at, rec[i].finished_at };
+    }
+    free(buf);
+}
+
+// Write the store if anything in it changed since the last save.
+void save_progress() {
+    if (!progress_path[0]) return;
+    size_t len = sizeof(struct ProgressHeader) + quest_count * sizeof(struct ProgressRecord);
+    char *buf = calloc(1, len);
+    struct ProgressHeader *hdr = (struct ProgressHeader *)buf;
+    struct ProgressRecord *rec = (struct ProgressRecord *)(buf + sizeof(*hdr));
+    *hdr = (struct ProgressHeader){ PROGRESS_MAGIC, PROGRESS_VERSION, xp, level, completed_quests, quest_count, 0, 0, 0 };
+    for (int q = 0; q < quest_count; q++) {
+        struct QuestProgress *qp = &quest_progress[q];
+        strncpy(rec[q].name, QS(quests[q].name), PROGRESS_NAME_MAX - 1);
+        rec[q].state = qp->state;
+        rec[q].step = qp->step;
+        rec[q].attempts = qp->attempts;
+        rec[q].started_at = qp->started_at;
+        rec[q].finished_at = qp->finished_at;
+    }
+    hdr->checksum = progress_checksum(buf + sizeof(*hdr), len - sizeof(*hdr));
+    if (progress_saved && progress_saved_len == len && memcmp(progress_saved, buf, len) == 0) {
+        free(buf);
+        return;
+    }
+    // saved_at stays out of the comparison above
+    char *unstamped = malloc(len);
+    memcpy(unstamped, buf, len);
+    hdr->saved_at = time(NULL);
+    // Before the rename, so a GUI woken by it sees the module up to date too
+    int kfd = open(KMOD_STATS, O_RDONLY | O_CLOEXEC);
+    if (kfd >= 0) {
+        struct sq_record r = { 0, xp, level, completed_quests, 0 };
+        ioctl(kfd, SQ_IOC_SET, &r);
+        close(kfd);
+    }
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", progress_path);
+    // Closed before the rename, so watchers see one event for the new file
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ok = fd >= 0 && write(fd, buf, len) == (ssize_t)len && fdatasync(fd) == 0;
+    if (fd >= 0 && close(fd) != 0) ok = 0;
+    if (!ok || rename(tmp, progress_path) != 0) {
+        printf("Warning: could not save progress to %s: %s\n", progress_path, strerror(errno));
+        if (fd >= 0) unlink(tmp);
+        free(unstamped);
+    } else {
+        // Make the rename itself durable
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", progress_path);
+        char *slash = strrchr(dir, '/');
+        if (slash) *slash = '\0';
+        int dfd = open(slash ? (dir[0] ? dir : "/") : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+        free(progress_saved);
+        progress_saved = unstamped;
+        progress_saved_len = len;
+    }
+    free(buf);
+}
+
+// Session log
+int64_t log_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Queue an event; never blocks. q is a quest index or -1, cmd may be NULL.
+void log_event(int type, int status, int64_t start, int64_t end, int q, int step, const char *cmd) {
+    if (!log_running) return;
+    unsigned long head = atomic_load_explicit(&log_head, memory_order_relaxed);
+    unsigned long used = head - atomic_load_explicit(&log_tail, memory_order_acquire);
+    if (used == LOG_RING) {
+        log_dropped++;
+        return;
+    }
+    struct LogEvent *e = &log_ring[head & (LOG_RING - 1)];
+    size_t len = cmd ? strnlen(cmd, LOG_CMD_MAX) : 0;
+    e->size = LOG_EVENT_HDR + len;
+    e->type = type;
+    e->status = status;
+    e->start = start;
+    e->end = end;
+    memset(e->quest, 0, sizeof(e->quest));
+    if (q >= 0) strncpy(e->quest, QS(quests[q].name), PROGRESS_NAME_MAX - 1);
+    e->step = step;
+    e->cmd_len = len;
+    if (len) memcpy(e->cmd, cmd, len);
+    atomic_store_explicit(&log_head, head + 1, memory_order_release);
+    // The writer wakes by itself every LOG_FLUSH_MS; only a burst needs a nudge
+    if (used + 1 == LOG_RING / 2) {
+        uint64_t one = 1;
+        write(log_wake, &one, sizeof(one));
+    }
+}
+
+static void *log_writer(void *arg) {
+    char *batch = malloc(LOG_RING * sizeof(struct LogEvent));
+    for (;;) {
+        struct pollfd pfd = { log_wake, POLLIN, 0 };
+        if (!atomic_load(&log_stop) && poll(&pfd, 1, LOG_FLUSH_MS) > 0) {
+            uint64_t n;
+            read(log_wake, &n, sizeof(n));
+        }
+        int stop = atomic_load(&log_stop);
+        unsigned long tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+        unsigned long head = atomic_load_explicit(&log_head, memory_order_acquire);
+        size_t len = 0;
+        for (; tail != head; tail++) {
+            struct LogEvent *e = &log_ring[tail & (LOG_RING - 1)];
+            memcpy(batch + len, e, e->size);
+            len += e->size;
+        }
+        atomic_store_explicit(&log_tail, tail, memory_order_release);
+        for (size_t off = 0; off < len;) {
+            ssize_t w = write(log_fd, batch + off, len - off);
+            if (w <= 0) break;
+            off += w;
+        }
+        if (stop) break;
+    }
+    free(batch);
+    return NULL;
+}
+
+// $SHELLQUEST_LOG_DIR, else sessions/ beside the progress store
+void log_default_dir(char *out, size_t len) {
+    char *env = getenv("SHELLQUEST_LOG_DIR");
+    if (env && *env) {
+        snprintf(out, len, "%s", env);
+        return;
+    }
+    progress_default_path(out, len);
+    char *slash = strrchr(out, '/');
+    if (slash) snprintf(slash + 1, len - (slash + 1 - out), "%s", LOG_DIR);
+}
+
+// Open this session's log and start the writer. Without one the shell
+// runs as before, just unrecorded.
+void log_start() {
+    char dir[PATH_MAX], path[PATH_MAX + 64];
+    log_default_dir(dir, sizeof(dir));
+    mkdir(dir, 0700);
+    struct LogHeader hdr = { LOG_MAGIC, LOG_VERSION, getuid(), getpid(), log_now(), "" };
+    char *user = getenv("USER");
+    snprintf(hdr.user, sizeof(hdr.user), "%s", user ? user : "");
+    char stamp[32];
+    time_t now = hdr.started / 1000000000LL;
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+    snprintf(path, sizeof(path), "%s/%s-%d.sqlog", dir, stamp, (int)hdr.pid);
+    log_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+    if (log_fd < 0 || write(log_fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        (log_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 ||
+        pthread_create(&log_thread, NULL, log_writer, NULL) != 0) {
+        printf("Warning: session log disabled (%s)\n", strerror(errno));
+        if (log_fd >= 0) close(log_fd);
+        if (log_wake >= 0) close(log_wake);
+        log_fd = log_wake = -1;
+        return;
+    }
+    log_running = 1;
+}
+
+// Flush what is queued and close the log
+void log_finish() {
+    if (!log_running) return;
+    int64_t now = log_now();
+    log_event(LOG_SESSION_END, log_dropped, now, now, -1, 0, NULL);
+    atomic_store(&log_stop, 1);
+    uint64_t one = 1;
+    write(log_wake, &one, sizeof(one));
+    pthread_join(log_thread, NULL);
+    log_running = 0;
+    fdatasync(log_fd);
+    close(log_fd);
+    close(log_wake);
+}
+
+// Read back one log, calling fn for every complete event. A torn final
+// event, from a session that crashed mid-write, is ignored.
+static int log_read(const char *path, struct LogHeader *out, void (*fn)(struct LogHeader *, struct LogEvent *, void *),
+                    void *arg) {
+    struct LogHeader hdr;
+    struct LogEvent e;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Error: cannot open %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    char *buf = malloc(st.st_size + 1);
+    ssize_t len = read(fd, buf, st.st_size);
+    close(fd);
+    if (len < (ssize_t)sizeof(hdr) || (memcpy(&hdr, buf, sizeof(hdr)), hdr.magic != LOG_MAGIC) ||
+        hdr.version != LOG_VERSION) {
+        printf("Error: %s is not a ShellQuest session log\n", path);
+        free(buf);
+        return -1;
+    }
+    for (ssize_t off = sizeof(hdr); off + (ssize_t)LOG_EVENT_HDR <= len;) {
+        memcpy(&e, buf + off, LOG_EVENT_HDR);
+        if (e.size < LOG_EVENT_HDR || e.size > sizeof(e) || off + e.size > len || e.cmd_len != e.size - LOG_EVENT_HDR) break;
+        memcpy(e.cmd, buf + off + LOG_EVENT_HDR, e.cmd_len);
+        fn(&hdr, &e, arg);
+        off += e.size;
+    }
+    free(buf);
+    *out = hdr;
+    return 0;
+}
+
+static int cmp_path(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Expand the arguments into log files: directories give every .sqlog in
+// them, and no arguments means this user's own logs.
+static int log_collect(int argc, char **argv, char ***out) {
+    char **files = NULL, dir[PATH_MAX];
+    int n = 0;
+    char *own[] = { dir };
+    if (argc == 0) {
+        log_default_dir(dir, sizeof(dir));
+        argc = 1;
+        argv = own;
+    }
+    for (int i = 0; i < argc; i++) {
+        DIR *d = opendir(argv[i]);
+        if (!d) {
+            files = quest_grow(files, n, sizeof(char *));
+            files[n++] = strdup(argv[i]);
+            continue;
+        }
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            size_t len = strlen(de->d_name);
+            if (len < 6 || strcmp(de->d_name + len - 6, ".sqlog") != 0) continue;
+            files = quest_grow(files, n, sizeof(char *));
+            files[n] = malloc(strlen(argv[i]) + len + 2);
+            sprintf(files[n++], "%s/%s", argv[i], de->d_name);
+        }
+        closedir(d);
+    }
+    // Session files are named by start time, so this is chronological
+    qsort(files, n, sizeof(char *), cmp_path);
+    *out = files;
+    return n;
+}
+
+// Events are written when they end, so a command's own quest events come
+// out before it; replay puts them back in order of starting
+struct ReplayEvent {
+    struct LogEvent e;
+    int order; // in the file, so ties keep it
+};
+
+struct Replay {
+    struct ReplayEvent *ev;
+    int n;
+};
+
+static void replay_event(struct LogHeader *hdr, struct LogEvent *e, void *arg) {
+    struct Replay *r = arg;
+    r->ev = quest_grow(r->ev, r->n, sizeof(struct ReplayEvent));
+    r->ev[r->n] = (struct ReplayEvent){ *e, r->n };
+    r->n++;
+}
+
+static int replay_order(const void *a, const void *b) {
+    const struct ReplayEvent *x = a, *y = b;
+    if (x->e.start != y->e.start) return x->e.start < y->e.start ? -1 : 1;
+    return x->order - y->order;
+}
+
+// shellquest --replay [log or dir]...
+int log_replay(int argc, char **argv) {
+    char **files;
+    int n = log_collect(argc, argv, &files), status = 0;
+    for (int i = 0; i < n; i++) {
+        struct LogHeader hdr;
+        struct Replay r = { NULL, 0 };
+        if (log_read(files[i], &hdr, replay_event, &r) != 0) {
+            status = 1;
+        } else {
+            char when[64];
+            time_t t = hdr.started / 1000000000LL;
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+            printf("Session of %s (uid %u, pid %u), started %s\n", hdr.user[0] ? hdr.user : "?", hdr.uid, hdr.pid, when);
+            qsort(r.ev, r.n, sizeof(struct ReplayEvent), replay_order);
+        }
+        for (int k = 0; k < r.n; k++) {
+            struct LogEvent *e = &r.ev[k].e;
+            double at = (e->start - hdr.started) / 1e9;
+            switch (e->type) {
+            case LOG_COMMAND:
+                printf("  %+9.3fs  %-10s %-40.*s %8.3fs  status %d\n", at, e->quest[0] ? e->quest : "-", e->cmd_len,
+                       e->cmd, (e->end - e->start) / 1e9, e->status);
+                break;
+            case LOG_QUEST_START:
+                printf("  %+9.3fs  quest %s started\n", at, e->quest);
+                break;
+            case LOG_QUEST_DONE:
+                printf("  %+9.3fs  quest %s done\n", at, e->quest);
+                break;
+            case LOG_SESSION_END:
+                printf("  %+9.3fs  session ended%s\n", at, e->status ? " (events dropped)" : "");
+                break;
+            }
+        }
+        free(r.ev);
+        free(files[i]);
+    }
+    free(files);
+    return status;
+}
+
+// Aggregates for --report
+struct ReportQuest {
+    char name[PROGRESS_NAME_MAX];
+    int started, completed;
+    long commands, failed;
+    int64_t since; // start of the attempt in progress in the current session, or 0
+    double *ttc; // seconds from start to done, one per completion
+    int nttc;
+};
+
+struct Report {
+    struct ReportQuest *quests;
+    int nquests;
+    uint32_t *uids;
+    int nuids, sessions;
+    long commands;
+    double *durations; // of every command, seconds
+};
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double *v, int n, double p) {
+    return n ? v[(int)(p * (n - 1) + 0.5)] : 0;
+}
+
+static struct ReportQuest *report_quest(struct Report *r, const char *name) {
+    for (int i = 0; i < r->nquests; i++) {
+        if (strncmp(r->quests[i].name, name, PROGRESS_NAME_MAX) == 0) return &r->quests[i];
+    }
+    r->quests = quest_grow(r->quests, r->nquests, sizeof(struct ReportQuest));
+    struct ReportQuest *q = &r->quests[r->nquests++];
+    memset(q, 0, sizeof(*q));
+    snprintf(q->name, sizeof(q->name), "%s", name);
+    return q;
+}
+
+static void report_event(struct LogHeader *hdr, struct LogEvent *e, void *arg) {
+    struct Report *r = arg;
+    struct ReportQuest *q = e->quest[0] ? report_quest(r, e->quest) : NULL;
+    switch (e->type) {
+    case LOG_COMMAND:
+        r->durations = quest_grow(r->durations, r->commands, sizeof(double));
+        r->durations[r->commands++] = (e->end - e->start) / 1e9;
+        if (q) {
+            q->commands++;
+            if (e->status != 0) q->failed++;
+        }
+        break;
+    case LOG_QUEST_START:
+        if (!q) break;
+        q->started++;
+        q->since = e->start;
+        break;
+    case LOG_QUEST_DONE:
+        if (!q) break;
+        q->completed++;
+        // Completions of attempts begun in an earlier session have no start here
+        if (q->since) {
+            q->ttc = quest_grow(q->ttc, q->nttc, sizeof(double));
+            q->ttc[q->nttc++] = (e->start - q->since) / 1e9;
+            q->since = 0;
+        }
+        break;
+    }
+}
+
+// shellquest --report [log or dir]...: per-quest time to complete across
+// every session given
+int log_report(int argc, char **argv) {
+    char **files;
+    struct Report r = {0};
+    int n = log_collect(argc, argv, &files), status = 0;
+    for (int i = 0; i < n; i++) {
+        struct LogHeader hdr;
+        for (int q = 0; q < r.nquests; q++) r.quests[q].since = 0;
+        if (log_read(files[i], &hdr, report_event, &r) == 0) {
+            int seen = 0;
+            for (int u = 0; u < r.nuids && !seen; u++) seen = r.uids[u] == hdr.uid;
+            if (!seen) {
+                r.uids = quest_grow(r.uids, r.nuids, sizeof(uint32_t));
+                r.uids[r.nuids++] = hdr.uid;
+            }
+            r.sessions++;
+        } else {
+            status = 1;
+        }
+        free(files[i]);
+    }
+    free(files);
+    qsort(r.durations, r.commands, sizeof(double), cmp_double);
+    printf("%d sessions, %d learners, %ld commands (p50 %.3fs, p99 %.3fs)\n", r.sessions, r.nuids, r.commands,
+           percentile(r.durations, r.commands, 0.5), percentile(r.durations, r.commands, 0.99));
+    if (r.nquests) {
+        printf("%-12s %8s %8s %10s %10s %10s %10s %8s\n", "Quest", "Started", "Done", "TTC mean", "TTC p50", "TTC p90",
+               "Cmds/done", "Failed");
+    }
+    for (int i = 0; i < r.nquests; i++) {
+        struct ReportQuest *q = &r.quests[i];
+        int nt = q->nttc;
+        double sum = 0;
+        for (int t = 0; t < nt; t++) sum += q->ttc[t];
+        qsort(q->ttc, nt, sizeof(double), cmp_double);
+        printf("%-12s %8d %8d %9.1fs %9.1fs %9.1fs %10.1f %8ld\n", q->name, q->started, q->completed,
+               nt ? sum / nt : 0, percentile(q->ttc, nt, 0.5), percentile(q->ttc, nt, 0.9),
+               q->completed ? q->commands / (double)q->completed : 0, q->failed);
+        free(q->ttc);
+    }
+    free(r.quests);
+    free(r.uids);
+    free(r.durations);
+    return status;
+}
+
+// Perf
+int64_t perf_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int perf_bucket(uint64_t v) {
+    if (v < PERF_SUB) return v;
+    int shift = 63 - __builtin_clzll(v) - PERF_SUB_BITS + 1; // leaves v >> shift in [PERF_SUB / 2, PERF_SUB)
+    return shift * (PERF_SUB / 2) + (int)(v >> shift);
+}
+
+// The largest value that lands in bucket i
+static uint64_t perf_bucket_top(int i) {
+    if (i < PERF_SUB) return i;
+    int shift = i / (PERF_SUB / 2) - 1;
+    uint64_t low = (uint64_t)(i - shift * (PERF_SUB / 2)) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+void perf_record(int stage, int64_t start) {
+    struct PerfHist *h = &perf_hist[stage];
+    uint64_t v = perf_now() - start;
+    h->bucket[perf_bucket(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+// The value at quantile q (0..1), within a bucket's width
+static uint64_t perf_quantile(struct PerfHist *h, double q) {
+    uint64_t want = (uint64_t)(q * h->count + 0.5), seen = 0;
+    if (want < 1) want = 1;
+    for (int i = 0; i < PERF_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= want) return perf_bucket_top(i) < h->max ? perf_bucket_top(i) : h->max;
+    }
+    return h->max;
+}
+
+void perf_print() {
+    printf("%-9s %8s %10s %10s %10s %10s\n", "stage", "count", "mean ms", "p50 ms", "p99 ms", "max ms");
+    for (int s = 0; s < PERF_STAGES; s++) {
+        struct PerfHist *h = &perf_hist[s];
+        if (!h->count) continue;
+        printf("%-9s %8llu %10.3f %10.3f %10.3f %10.3f\n", h->name, (unsigned long long)h->count,
+               h->sum / 1e6 / h->count, perf_quantile(h, 0.5) / 1e6, perf_quantile(h, 0.99) / 1e6, h->max / 1e6);
+    }
+}
+
+int builtin_perf(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        for (int s = 0; s < PERF_STAGES; s++) {
+            struct PerfHist *h = &perf_hist[s];
+            h->count = h->sum = h->max = 0;
+            memset(h->bucket, 0, sizeof(h->bucket));
+        }
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "help") == 0) {
+        for (int s = 0; s < PERF_STAGES; s++) printf("%-9s %s\n", perf_hist[s].name, perf_hist[s].what);
+        return 0;
+    }
+    if (argc > 1) {
+        printf("Usage: perf [reset|help]\n");
+        return 1;
+    }
+    perf_print();
+    return 0;
+}
+
+void perf_open() {
+    char *env = getenv("SHELLQUEST_PERF"), path[PATH_MAX];
+    if (!env || !*env) return;
+    char *pid = strstr(env, "%p");
+    if (pid) snprintf(path, sizeof(path), "%.*s%d%s", (int)(pid - env), env, (int)getpid(), pid + 2);
+    else snprintf(path, sizeof(path), "%s", env);
+    perf_out = fopen(path, "we");
+    if (!perf_out) printf("Error: cannot write %s: %s\n", path, strerror(errno));
+}
+
+// Write the histograms to the file perf_open opened: per stage the
+// summary, then the non-empty buckets as [highest value in ns, count].
+void perf_dump() {
+    FILE *f = perf_out;
+    if (!f) return;
+    perf_out = NULL;
+    fprintf(f, "{\"pid\": %d, \"unit\": \"ns\", \"stages\": {", (int)getpid());
+    for (int s = 0; s < PERF_STAGES; s++) {
+        struct PerfHist *h = &perf_hist[s];
+        fprintf(f, "%s\n  \"%s\": {\"count\": %llu, \"sum\": %llu, \"max\": %llu, \"p50\": %llu, \"p90\": %llu, "
+                   "\"p99\": %llu, \"p999\": %llu, \"buckets\": [",
+                s ? "," : "", h->name, (unsigned long long)h->count, (unsigned long long)h->sum,
+                (unsigned long long)h->max, (unsigned long long)perf_quantile(h, 0.5),
+                (unsigned long long)perf_quantile(h, 0.9), (unsigned long long)perf_quantile(h, 0.99),
+                (unsigned long long)perf_quantile(h, 0.999));
+        for (int i = 0, first = 1; i < PERF_BUCKETS; i++) {
+            if (!h->bucket[i]) continue;
+            fprintf(f, "%s[%llu, %u]", first ? "" : ", ", (unsigned long long)perf_bucket_top(i), h->bucket[i]);
+            first = 0;
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "\n}}\n");
+    fclose(f);
+}
+
+// Switch
+void switch_to_zsh() {
+    // sudo cannot work from inside a user namespace
+    if (sandbox_mode == SANDBOX_USERNS) printf("Run 'chsh -s /bin/zsh' outside ShellQuest to make it your shell.\n");
+    else system("sudo chsh -s /bin/zsh $USER");
+    printf("All quests done! Switching to Zsh. Relaunch terminal.\n");
+    // Leave through shell_run, which flushes the log and the VFS journal
+    shell_exit = 1;
+    exit_status = 0;
+}
+
+// Signals
+// On a terminal ^C reaches the foreground job through the tty; without one,
+// pass it on by hand.
+void handle_signal(int sig) {
+    if (fg_pgid > 0 && shell_tty < 0) kill(-fg_pgid, sig);
+}
+
+static void job_sigchld(int sig) {
+    int saved = errno;
+    write(job_pipe[1], "", 1);
+    errno = saved;
+}
+
+// Jobs
+void jobs_init() {
+    sigset_t mask;
+    shell_pgid = getpid();
+    setpgid(0, shell_pgid); // Enable job control
+    if (isatty(STDIN_FILENO)) {
+        shell_tty = STDIN_FILENO;
+        // Stopping or being told off for touching the terminal is for jobs
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        tcsetpgrp(shell_tty, shell_pgid);
+        tcgetattr(shell_tty, &shell_tmodes);
+    }
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    job_event_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (job_event_fd < 0 && pipe2(job_pipe, O_NONBLOCK | O_CLOEXEC) == 0) {
+        struct sigaction sa = {0};
+        sa.sa_handler = job_sigchld;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGCHLD, &sa, NULL);
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        job_event_fd = job_pipe[0];
+    }
+}
+
+struct Job *job_add(pid_t pgid, pid_t *pids, int npids, pid_t last, const char *cmd) {
+    int id = job_max_id + 1;
+    if (id >= job_table_size) {
+        int size = job_table_size ? job_table_size * 2 : 16;
+        job_table = realloc(job_table, size * sizeof(struct Job *));
+        memset(job_table + job_table_size, 0, (size - job_table_size) * sizeof(struct Job *));
+        job_table_size = size;
+    }
+    struct Job *j = malloc(sizeof(struct Job));
+    *j = (struct Job){ id, pgid, malloc(npids * sizeof(pid_t)), npids, npids, last, JOB_RUNNING, 0, 0, strdup(cmd) };
+    memcpy(j->pids, pids, npids * sizeof(pid_t));
+    // Listed without the trailing &
+    size_t len = strlen(j->cmd);
+    while (len > 0 && (j->cmd[len - 1] == ' ' || j->cmd[len - 1] == '&')) j->cmd[--len] = '\0';
+    job_table[id] = j;
+    job_max_id = id;
+    job_current = id;
+    return j;
+}
+
+struct Job *job_find(int id) {
+    if (id == 0) id = job_current;
+    return id > 0 && id <= job_max_id ? job_table[id] : NULL;
+}
+
+void job_remove(struct Job *j) {
+    job_table[j->id] = NULL;
+    while (job_max_id > 0 && !job_table[job_max_id]) job_max_id--;
+    if (job_current == j->id) {
+        // The newest remaining job becomes current
+        job_current = job_max_id;
+    }
+    free(j->pids);
+    free(j->cmd);
+    free(j);
+}
+
+// Collect every child state change waiting for us. Never blocks.
+void jobs_reap() {
+    char drain[sizeof(struct signalfd_siginfo) * 8];
+    while (job_event_fd >= 0 && read(job_event_fd, drain, sizeof(drain)) > 0);
+    int st;
+    pid_t pid;
+    while ((pid = waitpid(-1, &st, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+        struct Job *j = NULL;
+        int k = 0;
+        for (int id = 1; id <= job_max_id && !j; id++) {
+            if (!job_table[id]) continue;
+            for (k = 0; k < job_table[id]->npids && job_table[id]->pids[k] != pid; k++);
+            if (k < job_table[id]->npids) j = job_table[id];
+        }
+        if (!j) continue;
+        int background = j->pgid != fg_pgid;
+        if (WIFSTOPPED(st)) {
+            j->state = JOB_STOPPED;
+            j->notify = background;
+            job_current = j->id;
+        } else if (WIFCONTINUED(st)) {
+            j->state = JOB_RUNNING;
+        } else {
+            j->pids[k] = 0;
+            if (pid == j->last) j->status = st;
+            if (--j->alive == 0) {
+                j->state = JOB_DONE;
+                j->notify = background;
+            }
+        }
+    }
+}
+
+// Report background jobs that finished or stopped; finished ones leave
+// the table. At the prompt, readline's line is redrawn underneath.
+void jobs_notify(int at_prompt) {
+    int printed = 0;
+    for (int id = 1; id <= job_max_id; id++) {
+        struct Job *j = job_table[id];
+        if (!j || !j->notify) continue;
+        if (at_prompt && !printed) printf("\n");
+        printed = 1;
+        j->notify = 0;
+        char mark = id == job_current ? '+' : ' ';
+        if (j->state == JOB_STOPPED) {
+            printf("[%d]%c Stopped  %s\n", id, mark, j->cmd);
+        } else if (j->state == JOB_DONE) {
+            if (WIFEXITED(j->status) && WEXITSTATUS(j->status) != 0)
+                printf("[%d]%c Exit %d  %s\n", id, mark, WEXITSTATUS(j->status), j->cmd);
+            else if (WIFSIGNALED(j->status))
+                printf("[%d]%c %s  %s\n", id, mark, strsignal(WTERMSIG(j->status)), j->cmd);
+            else
+                printf("[%d]%c Done  %s\n", id, mark, j->cmd);
+            job_remove(j);
+        }
+    }
+    if (printed && at_prompt) {
+        print_prompt();
+        fflush(stdout);
+        rl_on_new_line();
+        rl_redisplay();
+    }
+}
+
+// Run a job in the foreground until it finishes or stops. Returns 0 if
+// its last stage succeeded.
+int job_wait(struct Job *j) {
+    fg_pgid = j->pgid;
+    if (shell_tty >= 0) tcsetpgrp(shell_tty, j->pgid);
+    // A stage may have stopped on the terminal before it was handed over
+    kill(-j->pgid, SIGCONT);
+    j->state = JOB_RUNNING;
+    struct pollfd pfd = { job_event_fd, POLLIN, 0 };
+    while (1) {
+        jobs_reap();
+        if (j->state != JOB_RUNNING) break;
+        if (poll(&pfd, 1, JOB_POLL_MS) == 0) vfs_journal_tick();
+    }
+    fg_pgid = 0;
+    if (shell_tty >= 0) {
+        tcsetpgrp(shell_tty, shell_pgid);
+        tcsetattr(shell_tty, TCSADRAIN, &shell_tmodes);
+    }
+    if (j->state == JOB_STOPPED) {
+        printf("\n[%d]+ Stopped  %s\n", j->id, j->cmd);
+        return 1;
+    }
+    int st = j->status, failed = j->last && !(WIFEXITED(st) && WEXITSTATUS(st) == 0);
+    if (WIFSIGNALED(st) && WTERMSIG(st) == SIGINT) printf("\n");
+    job_remove(j);
+    return failed;
+}
+
+// readline reads through this: it waits on the terminal and the job event
+// fd together, so jobs are reported while the prompt is up, and runs the
+// journal's group-commit timer in the gaps.
+int shell_getc(FILE *in) {
+    struct pollfd fds[2] = { { fileno(in), POLLIN, 0 }, { job_event_fd, POLLIN, 0 } };
+    while (1) {
+        int n = poll(fds, job_event_fd >= 0 ? 2 : 1, JOB_POLL_MS);
+        if (n < 0 && errno != EINTR) return EOF;
+        if (n <= 0) {
+            vfs_journal_tick();
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            jobs_reap();
+            jobs_notify(1);
+        }
+        if (fds[0].revents) {
+            unsigned char c;
+            ssize_t r = read(fileno(in), &c, 1);
+            if (r == 1) return c;
+            if (r < 0 && errno == EINTR) continue;
+            return EOF;
+        }
+    }
 }
 
 void list_jobs() {
-    for (int i = 0; i < job_count; i++) {
-        printf("[%d] %s (status: %s)\n", i+1, jobs[i].cmd, jobs[i].status ? "stopped" : "running");
+    jobs_reap();
+    for (int id = 1; id <= job_max_id; id++) {
+        struct Job *j = job_table[id];
+        if (!j) continue;
+        static const char *states[] = {"Running", "Stopped", "Done"};
+        printf("[%d]%c %-8s %s\n", id, id == job_current ? '+' : ' ', states[j->state], j->cmd);
+        if (j->state == JOB_DONE) job_remove(j);
+    }
+}
+
+int fg_job(int job_id) {
+    struct Job *j = job_find(job_id);
+    if (!j) {
+        printf("fg: no such job\n");
+        return 1;
+    }
+    printf("%s\n", j->cmd);
+    return job_wait(j);
+}
+
+int bg_job(int job_id) {
+    struct Job *j = job_find(job_id);
+    if (!j) {
+        printf("bg: no such job\n");
+        return 1;
+    }
+    j->state = JOB_RUNNING;
+    kill(-j->pgid, SIGCONT);
+    printf("[%d]+ %s &\n", j->id, j->cmd);
+    return 0;
+}
+
+// VFS
+static void vfs_bitmap_set(int start, int len, int used) {
+    while (len > 0) {
+        int w = start / 64, bit = start % 64;
+        int n = 64 - bit < len ? 64 - bit : len;
+        uint64_t mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << bit;
+        vfs_dirty(&vfs_bitmap[w], sizeof(uint64_t));
+        vfs_dirty(&vfs_bitmap_full[w / 64], sizeof(uint64_t));
+        if (used) vfs_bitmap[w] |= mask;
+        else vfs_bitmap[w] &= ~mask;
+        if (vfs_bitmap[w] == ~0ULL) vfs_bitmap_full[w / 64] |= 1ULL << (w % 64);
+        else vfs_bitmap_full[w / 64] &= ~(1ULL << (w % 64));
+        start += n;
+        len -= n;
+    }
+}
+
+static uint64_t vfs_align(uint64_t n) {
+    return (n + VFS_PAGE - 1) & ~(uint64_t)(VFS_PAGE - 1);
+}
+
+static uint64_t vfs_env_size(const char *name, uint64_t def) {
+    char *v = getenv(name), *end;
+    if (!v || !*v) return def;
+    uint64_t n = strtoull(v, &end, 10);
+    if (*end == 'K' || *end == 'k') n <<= 10;
+    else if (*end == 'M' || *end == 'm') n <<= 20;
+    else if (*end == 'G' || *end == 'g') n <<= 30;
+    return n ? n : def;
+}
+
+// Size a fresh layout. Only the superblock, the bitmap tail and the root
+// directory are written; everything else is zero pages.
+static size_t vfs_layout(struct VfsSuper *sb, uint64_t data_size, int max_inodes) {
+    if (data_size < 64 * VFS_BLOCK_SIZE) data_size = VFS_SIZE;
+    if (max_inodes < 1) max_inodes = VFS_MAX_INODES;
+    memset(sb, 0, sizeof(*sb));
+    sb->magic = VFS_MAGIC;
+    sb->version = VFS_VERSION;
+    sb->block_size = VFS_BLOCK_SIZE;
+    sb->blocks = data_size / VFS_BLOCK_SIZE;
+    sb->bitmap_words = (sb->blocks + 63) / 64;
+    sb->summary_words = (sb->bitmap_words + 63) / 64;
+    sb->max_inodes = max_inodes;
+    sb->free_blocks = sb->blocks;
+    sb->free_inode = -1;
+    sb->bitmap_off = VFS_PAGE;
+    sb->summary_off = vfs_align(sb->bitmap_off + (uint64_t)sb->bitmap_words * 8);
+    sb->inode_off = vfs_align(sb->summary_off + (uint64_t)sb->summary_words * 8);
+    sb->data_off = vfs_align(sb->inode_off + (uint64_t)max_inodes * sizeof(struct Inode));
+    sb->image_size = vfs_align(sb->data_off + (uint64_t)sb->blocks * VFS_BLOCK_SIZE);
+    return sb->image_size;
+}
+
+static void vfs_attach(char *image) {
+    vfs_image = image;
+    vfs_sb = (struct VfsSuper *)image;
+    vfs_bitmap = (uint64_t *)(image + vfs_sb->bitmap_off);
+    vfs_bitmap_full = (uint64_t *)(image + vfs_sb->summary_off);
+    vfs_inodes = (struct Inode *)(image + vfs_sb->inode_off);
+    vfs_disk = image + vfs_sb->data_off;
+    vfs_cwd = VFS_ROOT_INO;
+    for (int i = 0; i < VFS_CACHE_BLOCKS; i++) vfs_cache[i].block = -1;
+}
+
+static void vfs_format(char *image, struct VfsSuper *layout) {
+    *(struct VfsSuper *)image = *layout;
+    vfs_attach(image);
+    vfs_dirty(vfs_sb, sizeof(*vfs_sb));
+    // Bits past the last block (and summary bits past the last word) are
+    // permanently "used" so the search never has to range-check.
+    if (vfs_sb->blocks % 64) vfs_bitmap_set(vfs_sb->blocks, 64 - vfs_sb->blocks % 64, 1);
+    for (int w = vfs_sb->bitmap_words; w < vfs_sb->summary_words * 64; w++)
+        vfs_bitmap_full[w / 64] |= 1ULL << (w % 64);
+    int root = vfs_inode_new(VFS_DIR, "/");
+    vfs_inodes[root].parent = root;
+}
+
+static int vfs_valid(struct VfsSuper *sb, size_t size) {
+    return size >= sizeof(*sb) && sb->magic == VFS_MAGIC && sb->version == VFS_VERSION &&
+           sb->block_size == VFS_BLOCK_SIZE && sb->image_size == size;
+}
+
+// Dirty-page tracking
+void vfs_dirty(const void *p, size_t len) {
+    if (vfs_journal_fd < 0 || len == 0) return;
+    if ((const char *)p < vfs_image || (const char *)p + len > vfs_image + vfs_image_size) return;
+    uint64_t first = ((const char *)p - vfs_image) / VFS_PAGE;
+    uint64_t last = ((const char *)p + len - 1 - vfs_image) / VFS_PAGE;
+    for (uint64_t pg = first; pg <= last; pg++) {
+        if (vfs_dirty_map[pg / 64] & (1ULL << (pg % 64))) continue;
+        vfs_dirty_map[pg / 64] |= 1ULL << (pg % 64);
+        if (vfs_dirty_count == vfs_dirty_cap) {
+            vfs_dirty_cap = vfs_dirty_cap ? vfs_dirty_cap * 2 : 64;
+            vfs_dirty_list = realloc(vfs_dirty_list, vfs_dirty_cap * sizeof(uint64_t));
+        }
+        vfs_dirty_list[vfs_dirty_count++] = pg;
+    }
+}
+
+static void vfs_fault_point() {
+    if (vfs_fault_countdown > 0 && --vfs_fault_countdown == 0) abort();
+}
+
+static uint64_t vfs_checksum(uint64_t h, const void *p, size_t len) {
+    const unsigned char *c = p;
+    for (size_t i = 0; i < len; i++) h = (h ^ c[i]) * 1099511628211ULL;
+    return h;
+}
+
+static int vfs_write_all(int fd, const void *p, size_t len) {
+    for (const char *c = p; len > 0;) {
+        ssize_t n = write(fd, c, len);
+        if (n < 0) return -1;
+        c += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int vfs_pwrite_all(int fd, const void *p, size_t len, off_t off) {
+    for (const char *c = p; len > 0;) {
+        ssize_t n = pwrite(fd, c, len, off);
+        if (n <= 0) return -1;
+        c += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+// Make the image durable and empty the journal. Returns -1, keeping the
+// journal for replay, if the image could not be made durable.
+static int vfs_checkpoint() {
+    vfs_fault_point();
+    if (fdatasync(vfs_image_fd) != 0) return -1;
+    vfs_fault_point();
+    ftruncate(vfs_journal_fd, 0);
+    lseek(vfs_journal_fd, 0, SEEK_SET);
+    fsync(vfs_journal_fd);
+    vfs_journal_size = 0;
+    return 0;
+}
+
+// Group commit: write every dirty page to the journal behind a header, seal
+// it with a checksummed commit record and a single fdatasync, then copy the
+// pages to their home in the image. Returns -1 if the journal write failed,
+// in which case the transaction stays pending, or if a page could not be
+// written home: that page stays dirty, so it is journaled again, and the
+// journal is not checkpointed away.
+int vfs_commit() {
+    vfs_pending_ops = 0;
+    if (vfs_journal_fd < 0 || vfs_dirty_count == 0) return 0;
+    vfs_sb->commit_seq++;
+    vfs_dirty(vfs_sb, sizeof(*vfs_sb));
+
+    struct JournalHeader hdr = { VFS_JOURNAL_MAGIC, vfs_dirty_count, vfs_sb->commit_seq };
+    struct JournalCommit commit = { VFS_COMMIT_MAGIC, vfs_dirty_count, vfs_sb->commit_seq, 0 };
+    commit.checksum = vfs_checksum(14695981039346656037ULL, vfs_dirty_list, vfs_dirty_count * sizeof(uint64_t));
+    for (int i = 0; i < vfs_dirty_count; i++)
+        commit.checksum = vfs_checksum(commit.checksum, vfs_image + vfs_dirty_list[i] * VFS_PAGE, VFS_PAGE);
+
+    vfs_fault_point();
+    if (vfs_write_all(vfs_journal_fd, &hdr, sizeof(hdr)) != 0 ||
+        vfs_write_all(vfs_journal_fd, vfs_dirty_list, vfs_dirty_count * sizeof(uint64_t)) != 0)
+        goto fail;
+    for (int i = 0; i < vfs_dirty_count; i += 64) {
+        struct iovec iov[64];
+        int n = vfs_dirty_count - i < 64 ? vfs_dirty_count - i : 64;
+        for (int k = 0; k < n; k++) iov[k] = (struct iovec){ vfs_image + vfs_dirty_list[i + k] * VFS_PAGE, VFS_PAGE };
+        size_t want = (size_t)n * VFS_PAGE;
+        if (writev(vfs_journal_fd, iov, n) != (ssize_t)want) goto fail;
+        vfs_fault_point();
+    }
+    if (vfs_write_all(vfs_journal_fd, &commit, sizeof(commit)) != 0 || fdatasync(vfs_journal_fd) != 0) goto fail;
+    vfs_journal_size += sizeof(hdr) + vfs_dirty_count * (sizeof(uint64_t) + VFS_PAGE) + sizeof(commit);
+    if (vfs_commit_notify_fd >= 0) write(vfs_commit_notify_fd, &commit.seq, sizeof(commit.seq));
+    vfs_fault_point();
+
+    int kept = 0;
+    for (int i = 0; i < vfs_dirty_count; i++) {
+        uint64_t pg = vfs_dirty_list[i];
+        if (vfs_pwrite_all(vfs_image_fd, vfs_image + pg * VFS_PAGE, VFS_PAGE, pg * VFS_PAGE) != 0) {
+            vfs_dirty_list[kept++] = pg;
+            continue;
+        }
+        vfs_dirty_map[pg / 64] &= ~(1ULL << (pg % 64));
+        vfs_fault_point();
+    }
+    vfs_dirty_count = kept;
+    if (kept) return -1;
+    if (vfs_journal_size > VFS_JOURNAL_MAX) vfs_checkpoint();
+    return 0;
+fail:
+    // Drop the partial record; the next commit retries with the same pages.
+    ftruncate(vfs_journal_fd, vfs_journal_size);
+    lseek(vfs_journal_fd, vfs_journal_size, SEEK_SET);
+    return -1;
+}
+
+static long vfs_ms_since(struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+// Called after each VFS command: commit every VFS_JOURNAL_BATCH operations.
+void vfs_op_done() {
+    if (vfs_dirty_count == 0) return;
+    if (vfs_pending_ops++ == 0) clock_gettime(CLOCK_MONOTONIC, &vfs_txn_start);
+    if (vfs_pending_ops >= VFS_JOURNAL_BATCH) vfs_commit();
+}
+
+// Readline event hook, polled while waiting for input: commit a batch that
+// has been open for VFS_JOURNAL_INTERVAL_MS.
+int vfs_journal_tick() {
+    if (vfs_pending_ops > 0 && vfs_ms_since(&vfs_txn_start) >= VFS_JOURNAL_INTERVAL_MS) vfs_commit();
+    return 0;
+}
+
+// Apply every complete transaction in the journal to the image, stopping at
+// the first torn or corrupt one, then make the image durable and empty the
+// journal. Returns the number of transactions replayed.
+static int vfs_replay(int image_fd, int journal_fd) {
+    int replayed = 0;
+    struct JournalHeader hdr;
+    char *page = malloc(VFS_PAGE);
+    lseek(journal_fd, 0, SEEK_SET);
+    while (read(journal_fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == VFS_JOURNAL_MAGIC) {
+        size_t index_len = hdr.npages * sizeof(uint64_t);
+        uint64_t *pages = malloc(index_len ? index_len : 1);
+        off_t data = lseek(journal_fd, 0, SEEK_CUR) + index_len;
+        if (read(journal_fd, pages, index_len) != (ssize_t)index_len) {
+            free(pages);
+            break;
+        }
+        uint64_t sum = vfs_checksum(14695981039346656037ULL, pages, index_len);
+        int ok = 1;
+        for (uint32_t i = 0; i < hdr.npages && ok; i++) {
+            ok = read(journal_fd, page, VFS_PAGE) == VFS_PAGE;
+            sum = vfs_checksum(sum, page, VFS_PAGE);
+        }
+        struct JournalCommit commit;
+        ok = ok && read(journal_fd, &commit, sizeof(commit)) == sizeof(commit) && commit.magic == VFS_COMMIT_MAGIC &&
+             commit.seq == hdr.seq && commit.npages == hdr.npages && commit.checksum == sum;
+        for (uint32_t i = 0; i < hdr.npages && ok; i++) {
+            pread(journal_fd, page, VFS_PAGE, data + (off_t)i * VFS_PAGE);
+            pwrite(image_fd, page, VFS_PAGE, pages[i] * VFS_PAGE);
+        }
+        free(pages);
+        if (!ok) break;
+        replayed++;
+    }
+    free(page);
+    if (replayed) fdatasync(image_fd);
+    ftruncate(journal_fd, 0);
+    lseek(journal_fd, 0, SEEK_SET);
+    fsync(journal_fd);
+    return replayed;
+}
+
+// Map the image at 'path': an existing image is used as is, whatever its
+// size, so startup costs one open, a journal replay bounded by
+// VFS_JOURNAL_MAX, and one mmap. A missing or unreadable image is replaced
+// by a fresh one. Returns -1 if no file could be mapped, in which case the
+// VFS runs from anonymous memory.
+int vfs_open(const char *path) {
+    struct VfsSuper layout;
+    size_t size = vfs_layout(&layout, vfs_env_size("SHELLQUEST_VFS_SIZE", VFS_SIZE),
+                             vfs_env_size("SHELLQUEST_VFS_INODES", VFS_MAX_INODES));
+    char journal_path[1100];
+    snprintf(journal_path, sizeof(journal_path), "%s.journal", path);
+    struct stat st;
+    char *image = MAP_FAILED;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    // One session at a time: another one holding the image runs without it
+    if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    int jfd = fd >= 0 ? open(journal_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644) : -1;
+    if (jfd < 0 && fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    int fresh = 1;
+    if (fd >= 0) {
+        int replayed = vfs_replay(fd, jfd);
+        if (replayed) printf("VFS: recovered %d transaction%s from the journal.\n", replayed, replayed == 1 ? "" : "s");
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct VfsSuper)) {
+            image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (image != MAP_FAILED && vfs_valid((struct VfsSuper *)image, st.st_size)) {
+                size = st.st_size;
+                fresh = 0;
+            } else {
+                if (image != MAP_FAILED) munmap(image, st.st_size);
+                image = MAP_FAILED;
+                printf("VFS image is damaged or from another version; starting a new one.\n");
+            }
+        }
+        if (fresh && ftruncate(fd, 0) == 0 && ftruncate(fd, size) == 0)
+            image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    if (image == MAP_FAILED) {
+        if (fd >= 0) close(fd);
+        if (jfd >= 0) close(jfd);
+        fd = jfd = -1;
+        image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (image == MAP_FAILED) {
+            perror("vfs mmap");
+            exit(1);
+        }
+    }
+    vfs_image_fd = fd;
+    vfs_journal_fd = jfd;
+    vfs_journal_size = 0;
+    vfs_image_size = size;
+    vfs_dirty_map = calloc((size / VFS_PAGE + 63) / 64, sizeof(uint64_t));
+    vfs_dirty_count = 0;
+    vfs_pending_ops = 0;
+    if (fresh) {
+        vfs_format(image, &layout);
+        vfs_sync();
+    } else {
+        vfs_attach(image);
+    }
+    return fd >= 0 ? 0 : -1;
+}
+
+void vfs_init() {
+    mkdir(SANDBOX_DIR, 0755);
+    if (vfs_open(vfs_image_path) != 0) printf("VFS image unavailable; this session's VFS will not be saved.\n");
+}
+
+// Checkpoint: commit what is pending, make the image durable, and drop the
+// private copies of pages that are now identical to the file.
+void vfs_sync() {
+    if (vfs_journal_fd < 0) return;
+    if (vfs_commit() != 0 || vfs_checkpoint() != 0) return;
+    madvise(vfs_image, vfs_image_size, MADV_DONTNEED);
+}
+
+void vfs_close() {
+    vfs_sync();
+    munmap(vfs_image, vfs_image_size);
+    if (vfs_image_fd >= 0) close(vfs_image_fd);
+    if (vfs_journal_fd >= 0) close(vfs_journal_fd);
+    vfs_image_fd = vfs_journal_fd = -1;
+    free(vfs_dirty_map);
+    vfs_dirty_map = NULL;
+}
+
+// First free block at or after 'from', wrapping around. O(blocks / 4096).
+static int vfs_find_free(int from) {
+    int first = from / 64;
+    for (int i = 0; i <= vfs_sb->summary_words; i++) {
+        int s = (first / 64 + i) % vfs_sb->summary_words;
+        uint64_t open = ~vfs_bitmap_full[s];
+        if (i == 0) open &= ~0ULL << (first % 64); // skip words before the hint
+        if (open == 0) continue;
+        int w = s * 64 + __builtin_ctzll(open);
+        return w * 64 + __builtin_ctzll(~vfs_bitmap[w]);
+    }
+    return -1;
+}
+
+// Allocate one contiguous run of up to 'size' blocks. Returns its first block
+// and stores its length in *got, or -1 if the disk is full.
+int vfs_allocate_block(int size, int *got) {
+    if (size <= 0 || vfs_sb->free_blocks == 0) return -1;
+    int start = vfs_find_free(vfs_sb->alloc_hint);
+    if (start < 0) return -1;
+    int len = 0;
+    while (len < size && start + len < vfs_sb->blocks) {
+        int b = start + len;
+        uint64_t rest = vfs_bitmap[b / 64] >> (b % 64);
+        int run = rest ? __builtin_ctzll(rest) : 64 - b % 64;
+        if (run == 0) break;
+        len += run;
+        if (rest) break;
+    }
+    if (len > size) len = size;
+    vfs_dirty(vfs_sb, sizeof(*vfs_sb));
+    vfs_bitmap_set(start, len, 1);
+    vfs_sb->free_blocks -= len;
+    vfs_sb->alloc_hint = (start + len) % vfs_sb->blocks;
+    *got = len;
+    return start;
+}
+
+void vfs_free_block(int start, int len) {
+    vfs_cache_invalidate(start, len);
+    vfs_dirty(vfs_sb, sizeof(*vfs_sb));
+    vfs_bitmap_set(start, len, 0);
+    vfs_sb->free_blocks += len;
+}
+
+// Grow an inode by 'nblocks', extending its last extent when the new run is
+// adjacent. On failure nothing is left allocated.
+int vfs_inode_alloc(struct Inode *inode, int nblocks) {
+    int old_count = inode->extent_count;
+    struct Extent old_last = old_count ? inode->extents[old_count - 1] : (struct Extent){0, 0};
+    if (nblocks > vfs_sb->free_blocks) return -1;
+    vfs_dirty(inode, sizeof(*inode));
+    while (nblocks > 0) {
+        int got;
+        int start = vfs_allocate_block(nblocks, &got);
+        if (start < 0) goto fail;
+        struct Extent *last = inode->extent_count ? &inode->extents[inode->extent_count - 1] : NULL;
+        if (last && last->start + last->len == start) {
+            last->len += got;
+        } else if (inode->extent_count < VFS_MAX_EXTENTS) {
+            inode->extents[inode->extent_count++] = (struct Extent){start, got};
+        } else {
+            vfs_free_block(start, got);
+            goto fail;
+        }
+        nblocks -= got;
+    }
+    inode->start_block = inode->extents[0].start;
+    return 0;
+fail:
+    for (int i = inode->extent_count - 1; i >= old_count; i--)
+        vfs_free_block(inode->extents[i].start, inode->extents[i].len);
+    inode->extent_count = old_count;
+    if (old_count) {
+        struct Extent *last = &inode->extents[old_count - 1];
+        if (last->len > old_last.len) vfs_free_block(last->start + old_last.len, last->len - old_last.len);
+        *last = old_last;
+    }
+    return -1;
+}
+
+void vfs_inode_free(struct Inode *inode) {
+    vfs_dirty(inode, sizeof(*inode));
+    for (int i = 0; i < inode->extent_count; i++)
+        vfs_free_block(inode->extents[i].start, inode->extents[i].len);
+    inode->extent_count = 0;
+    inode->start_block = -1;
+}
+
+// Physical block holding logical block 'lblock' of an inode, or -1.
+static int vfs_bmap(struct Inode *inode, int lblock) {
+    for (int i = 0; i < inode->extent_count; i++) {
+        if (lblock < inode->extents[i].len) return inode->extents[i].start + lblock;
+        lblock -= inode->extents[i].len;
+    }
+    return -1;
+}
+
+// Block cache
+static struct CacheBlock *vfs_cache_find(int block) {
+    for (int i = 0; i < VFS_CACHE_BLOCKS; i++) {
+        if (vfs_cache[i].block == block) return &vfs_cache[i];
+    }
+    return NULL;
+}
+
+// Load a block into the least recently used slot.
+static struct CacheBlock *vfs_cache_fill(int block) {
+    struct CacheBlock *victim = &vfs_cache[0];
+    for (int i = 1; i < VFS_CACHE_BLOCKS && victim->block >= 0; i++) {
+        if (vfs_cache[i].block < 0 || vfs_cache[i].last_used < victim->last_used) victim = &vfs_cache[i];
+    }
+    memcpy(victim->data, vfs_disk + (size_t)block * VFS_BLOCK_SIZE, VFS_BLOCK_SIZE);
+    victim->block = block;
+    victim->last_used = ++vfs_cache_clock;
+    vfs_cache_stats.blocks_read++;
+    return victim;
+}
+
+void vfs_cache_invalidate(int start, int len) {
+    for (int i = 0; i < VFS_CACHE_BLOCKS; i++) {
+        if (vfs_cache[i].block >= start && vfs_cache[i].block < start + len) vfs_cache[i].block = -1;
+    }
+}
+
+// Cached copy of logical block 'lblock' of a file. A miss on the block the
+// previous read ended at pulls in the next VFS_READAHEAD blocks as well.
+static struct CacheBlock *vfs_cache_get(int ino, int lblock) {
+    int block = vfs_bmap(&vfs_inodes[ino], lblock);
+    int sequential = ino == vfs_ra_ino && lblock == vfs_ra_next;
+    vfs_ra_ino = ino;
+    vfs_ra_next = lblock + 1;
+    struct CacheBlock *cb = vfs_cache_find(block);
+    if (cb) {
+        vfs_cache_stats.hits++;
+        cb->last_used = ++vfs_cache_clock;
+        return cb;
+    }
+    vfs_cache_stats.misses++;
+    cb = vfs_cache_fill(block);
+    if (sequential) {
+        int nblocks = (vfs_inodes[ino].size + VFS_BLOCK_SIZE - 1) / VFS_BLOCK_SIZE;
+        for (int l = lblock + 1; l <= lblock + VFS_READAHEAD && l < nblocks; l++) {
+            int b = vfs_bmap(&vfs_inodes[ino], l);
+            if (vfs_cache_find(b)) continue;
+            vfs_cache_fill(b);
+            vfs_cache_stats.readahead++;
+        }
+        cb->last_used = ++vfs_cache_clock; // the block being read stays the newest
+    }
+    return cb;
+}
+
+// File I/O
+int vfs_pread(int ino, char *buf, int len, int offset) {
+    struct Inode *inode = &vfs_inodes[ino];
+    if (offset >= inode->size) return 0;
+    if (len > inode->size - offset) len = inode->size - offset;
+    int done = 0;
+    while (done < len) {
+        int pos = offset + done;
+        int n = VFS_BLOCK_SIZE - pos % VFS_BLOCK_SIZE;
+        if (n > len - done) n = len - done;
+        memcpy(buf + done, vfs_cache_get(ino, pos / VFS_BLOCK_SIZE)->data + pos % VFS_BLOCK_SIZE, n);
+        done += n;
+    }
+    return done;
+}
+
+int vfs_pwrite(int ino, const char *buf, int len, int offset) {
+    struct Inode *inode = &vfs_inodes[ino];
+    int have = 0;
+    for (int i = 0; i < inode->extent_count; i++) have += inode->extents[i].len;
+    int need = (offset + len + VFS_BLOCK_SIZE - 1) / VFS_BLOCK_SIZE;
+    if (need > have && vfs_inode_alloc(inode, need - have) != 0) return -1;
+    for (int done = 0; done < len;) {
+        int pos = offset + done;
+        int n = VFS_BLOCK_SIZE - pos % VFS_BLOCK_SIZE;
+        if (n > len - done) n = len - done;
+        int block = vfs_bmap(inode, pos / VFS_BLOCK_SIZE);
+        vfs_dirty(vfs_disk + (size_t)block * VFS_BLOCK_SIZE + pos % VFS_BLOCK_SIZE, n);
+        memcpy(vfs_disk + (size_t)block * VFS_BLOCK_SIZE + pos % VFS_BLOCK_SIZE, buf + done, n);
+        struct CacheBlock *cb = vfs_cache_find(block);
+        if (cb) memcpy(cb->data + pos % VFS_BLOCK_SIZE, buf + done, n);
+        vfs_cache_stats.blocks_written++;
+        done += n;
+    }
+    if (offset + len > inode->size) {
+        vfs_dirty(inode, sizeof(*inode));
+        inode->size = offset + len;
+    }
+    return len;
+}
+
+// Inodes
+int vfs_inode_new(int type, const char *name) {
+    int ino;
+    if (vfs_sb->free_inode >= 0) {
+        ino = vfs_sb->free_inode;
+        vfs_sb->free_inode = vfs_inodes[ino].next;
+    } else if (vfs_sb->inode_hwm < vfs_sb->max_inodes) {
+        ino = vfs_sb->inode_hwm++;
+    } else {
+        return -1;
+    }
+    struct Inode *inode = &vfs_inodes[ino];
+    vfs_dirty(vfs_sb, sizeof(*vfs_sb));
+    vfs_dirty(inode, sizeof(*inode));
+    memset(inode, 0, sizeof(*inode));
+    strncpy(inode->name, name, sizeof(inode->name) - 1);
+    inode->type = type;
+    inode->start_block = -1;
+    inode->next = -1;
+    if (type == VFS_DIR) {
+        if (vfs_inode_alloc(inode, 1) != 0) {
+            inode->type = VFS_FREE;
+            inode->next = vfs_sb->free_inode;
+            vfs_sb->free_inode = ino;
+            return -1;
+        }
+        vfs_dirty(vfs_disk + (size_t)inode->start_block * VFS_BLOCK_SIZE, VFS_BLOCK_SIZE);
+        memset(vfs_disk + (size_t)inode->start_block * VFS_BLOCK_SIZE, 0xff, VFS_BLOCK_SIZE);
+        inode->nbuckets = VFS_MIN_BUCKETS;
+    }
+    return ino;
+}
+
+static void vfs_inode_release(int ino) {
+    vfs_inode_free(&vfs_inodes[ino]);
+    vfs_dirty(vfs_sb, sizeof(*vfs_sb));
+    vfs_inodes[ino].type = VFS_FREE;
+    vfs_inodes[ino].next = vfs_sb->free_inode;
+    vfs_sb->free_inode = ino;
+}
+
+// Directory index: each directory's blocks hold an array of inode-number
+// buckets (-1 = empty), with collisions chained through Inode.next.
+static uint32_t vfs_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
+
+static int *vfs_bucket(struct Inode *dir, uint32_t h) {
+    int slot = h & (dir->nbuckets - 1);
+    int per_block = VFS_BLOCK_SIZE / 4;
+    int block = vfs_bmap(dir, slot / per_block);
+    return (int *)(vfs_disk + (size_t)block * VFS_BLOCK_SIZE) + slot % per_block;
+}
+
+int vfs_lookup(int dir, const char *name) {
+    struct Inode *d = &vfs_inodes[dir];
+    if (strcmp(name, ".") == 0 || name[0] == '\0') return dir;
+    if (strcmp(name, "..") == 0) return d->parent;
+    for (int ino = *vfs_bucket(d, vfs_hash(name)); ino >= 0; ino = vfs_inodes[ino].next) {
+        if (strcmp(vfs_inodes[ino].name, name) == 0) return ino;
+    }
+    return -1;
+}
+
+// Double the bucket array once chains average two entries. If the disk is
+// too fragmented for the bigger table the old one is kept.
+static void vfs_dir_grow(struct Inode *dir) {
+    struct Inode old = *dir;
+    int nbuckets = dir->nbuckets * 2;
+    dir->extent_count = 0;
+    if (vfs_inode_alloc(dir, nbuckets * 4 / VFS_BLOCK_SIZE) != 0) {
+        *dir = old;
+        return;
+    }
+    for (int i = 0; i < dir->extent_count; i++) {
+        vfs_dirty(vfs_disk + (size_t)dir->extents[i].start * VFS_BLOCK_SIZE, (size_t)dir->extents[i].len * VFS_BLOCK_SIZE);
+        memset(vfs_disk + (size_t)dir->extents[i].start * VFS_BLOCK_SIZE, 0xff, (size_t)dir->extents[i].len * VFS_BLOCK_SIZE);
+    }
+    dir->nbuckets = nbuckets;
+    for (int slot = 0; slot < old.nbuckets; slot++) {
+        int ino = *vfs_bucket(&old, slot);
+        while (ino >= 0) {
+            int next = vfs_inodes[ino].next;
+            int *b = vfs_bucket(dir, vfs_hash(vfs_inodes[ino].name));
+            vfs_dirty(&vfs_inodes[ino], sizeof(struct Inode));
+            vfs_inodes[ino].next = *b;
+            *b = ino;
+            ino = next;
+        }
+    }
+    vfs_inode_free(&old);
+}
+
+static void vfs_dir_add(int dir, int ino) {
+    struct Inode *d = &vfs_inodes[dir];
+    if (d->nentries >= d->nbuckets * 2) vfs_dir_grow(d);
+    int *b = vfs_bucket(d, vfs_hash(vfs_inodes[ino].name));
+    vfs_dirty(b, sizeof(*b));
+    vfs_dirty(d, sizeof(*d));
+    vfs_dirty(&vfs_inodes[ino], sizeof(struct Inode));
+    vfs_inodes[ino].next = *b;
+    vfs_inodes[ino].parent = dir;
+    *b = ino;
+    d->nentries++;
+}
+
+static void vfs_dir_remove(int dir, int ino) {
+    struct Inode *d = &vfs_inodes[dir];
+    int *link = vfs_bucket(d, vfs_hash(vfs_inodes[ino].name));
+    while (*link != ino) link = &vfs_inodes[*link].next;
+    vfs_dirty(link, sizeof(*link));
+    vfs_dirty(d, sizeof(*d));
+    *link = vfs_inodes[ino].next;
+    d->nentries--;
+}
+
+// Paths
+int vfs_resolve(const char *path) {
+    char buf[1024];
+    int ino = path[0] == '/' ? VFS_ROOT_INO : vfs_cwd;
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char *save, *part = strtok_r(buf, "/", &save); part; part = strtok_r(NULL, "/", &save)) {
+        if (vfs_inodes[ino].type != VFS_DIR) return -1;
+        if ((ino = vfs_lookup(ino, part)) < 0) return -1;
+    }
+    return ino;
+}
+
+// Resolve everything but the last component. Returns the parent directory
+// and points *leaf at the final name inside 'buf'.
+static int vfs_resolve_parent(const char *path, char *buf, size_t size, char **leaf) {
+    snprintf(buf, size, "%s", path);
+    size_t len = strlen(buf);
+    while (len > 1 && buf[len - 1] == '/') buf[--len] = '\0';
+    char *slash = strrchr(buf, '/');
+    int dir;
+    if (!slash) {
+        dir = vfs_cwd;
+        *leaf = buf;
+    } else {
+        *slash = '\0';
+        dir = slash == buf ? VFS_ROOT_INO : vfs_resolve(buf);
+        *leaf = slash + 1;
+    }
+    if (dir < 0 || vfs_inodes[dir].type != VFS_DIR) return -1;
+    return dir;
+}
+
+static int vfs_create(char *path, int type) {
+    char buf[1024], *name;
+    int dir = vfs_resolve_parent(path, buf, sizeof(buf), &name);
+    if (dir < 0) {
+        printf("No such directory\n");
+        return -1;
+    }
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strlen(name) >= sizeof(((struct Inode *)0)->name)) {
+        printf("Invalid name: %s\n", name);
+        return -1;
+    }
+    if (vfs_lookup(dir, name) >= 0) {
+        printf("%s already exists\n", path);
+        return -1;
+    }
+    int ino = vfs_inode_new(type, name);
+    if (ino < 0) {
+        printf("VFS full\n");
+        return -1;
+    }
+    vfs_dir_add(dir, ino);
+    return ino;
+}
+
+void vfs_touch(char *path) {
+    if (vfs_resolve(path) >= 0) return;
+    if (vfs_create(path, VFS_FILE) >= 0) printf("Created %s in VFS\n", path);
+}
+
+void vfs_mkdir(char *path) {
+    if (vfs_create(path, VFS_DIR) >= 0) printf("Created directory %s in VFS\n", path);
+}
+
+void vfs_cd(char *path) {
+    int ino = vfs_resolve(path);
+    if (ino < 0 || vfs_inodes[ino].type != VFS_DIR) {
+        printf("Not a directory: %s\n", path);
+        return;
+    }
+    vfs_cwd = ino;
+}
+
+static void vfs_print_path(int ino) {
+    if (ino == VFS_ROOT_INO) return;
+    vfs_print_path(vfs_inodes[ino].parent);
+    printf("/%s", vfs_inodes[ino].name);
+}
+
+void vfs_pwd() {
+    if (vfs_cwd == VFS_ROOT_INO) printf("/");
+    vfs_print_path(vfs_cwd);
+    printf("\n");
+}
+
+void vfs_ls(char *path) {
+    int dir = path ? vfs_resolve(path) : vfs_cwd;
+    if (dir < 0) {
+        printf("Not found\n");
+        return;
+    }
+    struct Inode *d = &vfs_inodes[dir];
+    if (d->type != VFS_DIR) {
+        printf("%s\n", d->name);
+        return;
+    }
+    for (int slot = 0; slot < d->nbuckets; slot++) {
+        for (int ino = *vfs_bucket(d, slot); ino >= 0; ino = vfs_inodes[ino].next) {
+            printf("%s%s\n", vfs_inodes[ino].name, vfs_inodes[ino].type == VFS_DIR ? "/" : "");
+        }
+    }
+}
+
+void vfs_cat(char *path) {
+    int ino = vfs_resolve(path);
+    if (ino < 0 || vfs_inodes[ino].type != VFS_FILE) {
+        printf("Not found\n");
+        return;
+    }
+    char buf[VFS_BLOCK_SIZE];
+    int n;
+    for (int off = 0; (n = vfs_pread(ino, buf, sizeof(buf), off)) > 0; off += n) {
+        fwrite(buf, 1, n, stdout);
+    }
+    fflush(stdout);
+}
+
+static int vfs_file_for_write(char *path) {
+    int ino = vfs_resolve(path);
+    if (ino < 0) ino = vfs_create(path, VFS_FILE);
+    else if (vfs_inodes[ino].type != VFS_FILE) {
+        printf("Not a file: %s\n", path);
+        return -1;
+    }
+    return ino;
+}
+
+static void vfs_write_text(int ino, char *text, int offset) {
+    int len = strlen(text);
+    char *line = malloc(len + 1);
+    memcpy(line, text, len);
+    line[len] = '\n';
+    if (vfs_pwrite(ino, line, len + 1, offset) < 0) printf("VFS full\n");
+    free(line);
+}
+
+void vfs_write(char *path, char *text) {
+    int ino = vfs_file_for_write(path);
+    if (ino < 0) return;
+    vfs_inode_free(&vfs_inodes[ino]);
+    vfs_inodes[ino].size = 0;
+    vfs_write_text(ino, text, 0);
+}
+
+void vfs_append(char *path, char *text) {
+    int ino = vfs_file_for_write(path);
+    if (ino < 0) return;
+    vfs_write_text(ino, text, vfs_inodes[ino].size);
+}
+
+void vfs_stats() {
+    unsigned long lookups = vfs_cache_stats.hits + vfs_cache_stats.misses;
+    printf("Block cache: %lu hits, %lu misses (%.1f%% hit rate)\n", vfs_cache_stats.hits, vfs_cache_stats.misses,
+           lookups ? 100.0 * vfs_cache_stats.hits / lookups : 0.0);
+    printf("Disk: %lu blocks read (%lu by readahead), %lu blocks written\n", vfs_cache_stats.blocks_read,
+           vfs_cache_stats.readahead, vfs_cache_stats.blocks_written);
+    printf("Space: %d/%d blocks free, %d-byte blocks\n", vfs_sb->free_blocks, vfs_sb->blocks, VFS_BLOCK_SIZE);
+}
+
+void vfs_rm(char *path) {
+    int ino = vfs_resolve(path);
+    if (ino < 0 || ino == VFS_ROOT_INO) {
+        printf("Not found\n");
+        return;
+    }
+    struct Inode *inode = &vfs_inodes[ino];
+    if (inode->type == VFS_DIR && inode->nentries > 0) {
+        printf("Directory not empty: %s\n", path);
+        return;
+    }
+    for (int d = vfs_cwd; d != VFS_ROOT_INO; d = vfs_inodes[d].parent) {
+        if (d == ino) vfs_cwd = inode->parent;
+    }
+    vfs_dir_remove(inode->parent, ino);
+    vfs_inode_release(ino);
+    printf("Removed %s from VFS\n", path);
+}
+
+// Consistency check: walk the tree from the root and cross-check every
+// directory index, extent and inode against the bitmap and the superblock.
+// Returns the number of problems found.
+int vfs_fsck(int verbose) {
+    int errors = 0, reachable = 0, used_blocks = 0;
+    unsigned char *owner = calloc(vfs_sb->blocks, 1);
+    unsigned char *seen = calloc(vfs_sb->max_inodes, 1);
+    int *queue = malloc(sizeof(int) * vfs_sb->max_inodes);
+    int head = 0, tail = 0;
+#define FSCK_ERR(...) do { errors++; if (verbose) { printf("fsck: "); printf(__VA_ARGS__); printf("\n"); } } while (0)
+    queue[tail++] = VFS_ROOT_INO;
+    seen[VFS_ROOT_INO] = 1;
+    while (head < tail) {
+        int ino = queue[head++];
+        struct Inode *inode = &vfs_inodes[ino];
+        reachable++;
+        int nblocks = 0;
+        for (int e = 0; e < inode->extent_count; e++) {
+            struct Extent *x = &inode->extents[e];
+            if (x->start < 0 || x->len <= 0 || x->start + x->len > vfs_sb->blocks) {
+                FSCK_ERR("inode %d: bad extent %d+%d", ino, x->start, x->len);
+                continue;
+            }
+            for (int b = x->start; b < x->start + x->len; b++) {
+                if (owner[b]++) FSCK_ERR("block %d claimed twice (inode %d)", b, ino);
+                if (!(vfs_bitmap[b / 64] & (1ULL << (b % 64)))) FSCK_ERR("block %d of inode %d marked free", b, ino);
+            }
+            nblocks += x->len;
+        }
+        used_blocks += nblocks;
+        if (inode->extent_count && inode->start_block != inode->extents[0].start)
+            FSCK_ERR("inode %d: start_block %d does not match first extent", ino, inode->start_block);
+        if (inode->type == VFS_FILE) {
+            if (inode->size < 0 || inode->size > nblocks * VFS_BLOCK_SIZE) FSCK_ERR("inode %d: size %d beyond its blocks", ino, inode->size);
+            continue;
+        }
+        if (inode->type != VFS_DIR) {
+            FSCK_ERR("inode %d: reachable but type %d", ino, inode->type);
+            continue;
+        }
+        if (inode->nbuckets < VFS_MIN_BUCKETS || (inode->nbuckets & (inode->nbuckets - 1)) ||
+            inode->nbuckets * 4 > nblocks * VFS_BLOCK_SIZE) {
+            FSCK_ERR("directory %d: bad bucket count %d", ino, inode->nbuckets);
+            continue;
+        }
+        int entries = 0;
+        for (int slot = 0; slot < inode->nbuckets; slot++) {
+            for (int child = *vfs_bucket(inode, slot); child >= 0; child = vfs_inodes[child].next) {
+                if (child >= vfs_sb->inode_hwm || seen[child]) {
+                    FSCK_ERR("directory %d: bad or repeated entry %d", ino, child);
+                    break;
+                }
+                seen[child] = 1;
+                entries++;
+                if (vfs_inodes[child].parent != ino) FSCK_ERR("inode %d: parent %d, found in %d", child, vfs_inodes[child].parent, ino);
+                if ((int)(vfs_hash(vfs_inodes[child].name) & (inode->nbuckets - 1)) != slot)
+                    FSCK_ERR("inode %d: in the wrong bucket of %d", child, ino);
+                queue[tail++] = child;
+            }
+        }
+        if (entries != inode->nentries) FSCK_ERR("directory %d: %d entries, header says %d", ino, entries, inode->nentries);
+    }
+    int free_inodes = 0;
+    for (int ino = vfs_sb->free_inode; ino >= 0 && free_inodes <= vfs_sb->inode_hwm; ino = vfs_inodes[ino].next) {
+        if (seen[ino] || vfs_inodes[ino].type != VFS_FREE) FSCK_ERR("inode %d on the free list is in use", ino);
+        free_inodes++;
+    }
+    if (reachable + free_inodes != vfs_sb->inode_hwm)
+        FSCK_ERR("%d reachable + %d free inodes, high-water mark %d", reachable, free_inodes, vfs_sb->inode_hwm);
+    int marked = 0;
+    for (int w = 0; w < vfs_sb->bitmap_words; w++) {
+        uint64_t word = vfs_bitmap[w];
+        if (w == vfs_sb->bitmap_words - 1 && vfs_sb->blocks % 64) word &= (1ULL << (vfs_sb->blocks % 64)) - 1;
+        marked += __builtin_popcountll(word);
+        if (!!(vfs_bitmap_full[w / 64] & (1ULL << (w % 64))) != (vfs_bitmap[w] == ~0ULL)) FSCK_ERR("summary bit %d is stale", w);
+    }
+    if (marked != used_blocks) FSCK_ERR("%d blocks marked used, %d owned by inodes", marked, used_blocks);
+    if (vfs_sb->free_blocks != vfs_sb->blocks - marked) FSCK_ERR("superblock says %d free blocks, bitmap %d", vfs_sb->free_blocks, vfs_sb->blocks - marked);
+#undef FSCK_ERR
+    free(owner);
+    free(seen);
+    free(queue);
+    if (verbose) printf("fsck: %d inodes, %d blocks in use, %d problem%s\n", reachable, used_blocks, errors, errors == 1 ? "" : "s");
+    return errors;
+}
+
+// Crash test: each run forks a child that performs random VFS operations
+// and aborts at a random point inside the commit path. The parent then
+// reopens the image, which replays the journal, and checks that it is
+// consistent and holds every transaction the child saw committed.
+static void vfs_random_op() {
+    char path[64], text[64];
+    int d = rand() % 8, f = rand() % 32;
+    snprintf(text, sizeof(text), "line %d of run data", rand());
+    switch (rand() % 8) {
+    case 0: snprintf(path, sizeof(path), "/d%d", d); vfs_mkdir(path); break;
+    case 1: case 2: snprintf(path, sizeof(path), "/d%d/f%d", d, f); vfs_touch(path); break;
+    case 3: snprintf(path, sizeof(path), "/d%d/f%d", d, f); vfs_write(path, text); break;
+    case 4: case 5: snprintf(path, sizeof(path), "/d%d/f%d", d, f); vfs_append(path, text); break;
+    case 6: snprintf(path, sizeof(path), "/d%d/f%d", d, f); vfs_rm(path); break;
+    case 7: snprintf(path, sizeof(path), "/d%d", d); vfs_rm(path); break;
+    }
+    vfs_op_done();
+}
+
+int vfs_crashtest(int runs) {
+    const char *path = "/tmp/shellquest/.vfs-crashtest.img";
+    char journal[128];
+    snprintf(journal, sizeof(journal), "%s.journal", path);
+    mkdir("/tmp/shellquest", 0755);
+    unlink(path);
+    unlink(journal);
+    int crashed = 0, failures = 0;
+    for (int run = 0; run < runs; run++) {
+        int fds[2];
+        pipe(fds);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            freopen("/dev/null", "w", stdout);
+            srand(run * 7919 + getpid());
+            vfs_open(path);
+            vfs_commit_notify_fd = fds[1];
+            vfs_fault_countdown = 1 + rand() % 400;
+            for (int i = 0; i < 2000; i++) vfs_random_op();
+            vfs_close();
+            _exit(0);
+        }
+        close(fds[1]);
+        uint64_t seq, acked = 0;
+        while (read(fds[0], &seq, sizeof(seq)) == sizeof(seq)) acked = seq;
+        close(fds[0]);
+        int status;
+        waitpid(pid, &status, 0);
+        if (WIFSIGNALED(status)) crashed++;
+        int saved = dup(STDOUT_FILENO);
+        freopen("/dev/null", "w", stdout);
+        vfs_open(path);
+        int errors = vfs_fsck(0);
+        uint64_t have = vfs_sb->commit_seq;
+        vfs_close();
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        if (errors || have < acked) {
+            failures++;
+            printf("run %d: %d fsck problems, image at seq %llu, child committed %llu\n", run, errors,
+                   (unsigned long long)have, (unsigned long long)acked);
+        }
+    }
+    printf("VFS crash test: %d runs, %d crashed mid-commit, %d inconsistent\n", runs, crashed, failures);
+    unlink(path);
+    unlink(journal);
+    return failures ? 1 : 0;
+}
+
+// Scheduler
+static long sched_key_arrival(struct Process *p) { return 0; } // queue order alone
+static long sched_key_burst(struct Process *p) { return p->burst; }
+static long sched_key_remaining(struct Process *p) { return p->remaining; }
+static long sched_key_priority(struct Process *p) { return p->priority; }
+static long sched_key_level(struct Process *p) { return p->level; }
+static long sched_quantum_fixed(struct Process *p, long q) { return q; }
+static long sched_quantum_level(struct Process *p, long q) { return q << p->level; }
+
+static void sched_demote(struct Process *p) {
+    if (p->level < SCHED_MLFQ_LEVELS - 1) p->level++;
+}
+
+const struct SchedPolicy sched_policies[] = {
+    {"fcfs", 0, sched_key_arrival, NULL, NULL},
+    {"sjf", 0, sched_key_burst, NULL, NULL},
+    {"srtf", 1, sched_key_remaining, NULL, NULL},
+    {"rr", 0, sched_key_arrival, sched_quantum_fixed, NULL},
+    {"prio", 0, sched_key_priority, NULL, NULL},
+    {"mlfq", 1, sched_key_level, sched_quantum_level, sched_demote},
+};
+#define SCHED_NPOLICIES (int)(sizeof(sched_policies) / sizeof(sched_policies[0]))
+
+static int sched_before(const struct SchedEntry *a, const struct SchedEntry *b) {
+    return a->key != b->key ? a->key < b->key : a->seq < b->seq;
+}
+
+static void sched_ready(struct Sched *s, int i) {
+    struct SchedEntry e = { s->policy->key(&s->procs[i]), s->seq++, i };
+    int at = s->heap_len++;
+    while (at > 0 && sched_before(&e, &s->heap[(at - 1) / 2])) {
+        s->heap[at] = s->heap[(at - 1) / 2];
+        at = (at - 1) / 2;
+    }
+    s->heap[at] = e;
+}
+
+static int sched_pop(struct Sched *s) {
+    int top = s->heap[0].proc, at = 0;
+    struct SchedEntry last = s->heap[--s->heap_len];
+    for (;;) {
+        int child = 2 * at + 1;
+        if (child >= s->heap_len) break;
+        if (child + 1 < s->heap_len && sched_before(&s->heap[child + 1], &s->heap[child])) child++;
+        if (!sched_before(&s->heap[child], &last)) break;
+        s->heap[at] = s->heap[child];
+        at = child;
+    }
+    if (s->heap_len) s->heap[at] = last;
+    return top;
+}
+
+// Start process i on core c at time now
+static void sched_run(struct Sched *s, int c, int i, long now) {
+    struct SchedCore *core = &s->core[c];
+    struct Process *p = &s->procs[i];
+    if (p->start < 0) p->start = now;
+    long slice = p->remaining;
+    if (s->policy->quantum) {
+        long q = s->policy->quantum(p, s->quantum);
+        if (q < slice) slice = q;
+    }
+    core->proc = i;
+    core->since = now;
+    core->slice_end = now + slice;
+    // A process that keeps its core extends the segment it already has
+    struct Gantt *last = core->nseg ? &core->seg[core->nseg - 1] : NULL;
+    if (last && last->pid == p->pid && last->end == now) last->end = -1;
+    else if (core->nseg < SCHED_GANTT_MAX) core->seg[core->nseg++] = (struct Gantt){ p->pid, now, -1 };
+    else core->dropped++;
+}
+
+static void sched_stop(struct Sched *s, int c, long now) {
+    struct SchedCore *core = &s->core[c];
+    if (core->nseg && core->seg[core->nseg - 1].end < 0) core->seg[core->nseg - 1].end = now;
+    core->proc = -1;
+}
+
+// Fill idle cores, then let better keys displace the worst running ones
+static void sched_dispatch(struct Sched *s, long now) {
+    for (int c = 0; c < s->ncores && s->heap_len; c++) {
+        if (s->core[c].proc < 0) sched_run(s, c, sched_pop(s), now);
+    }
+    while (s->policy->preemptive && s->heap_len) {
+        int worst = -1;
+        long worst_key = 0;
+        for (int c = 0; c < s->ncores; c++) {
+            long key = s->policy->key(&s->procs[s->core[c].proc]);
+            if (worst < 0 || key > worst_key) {
+                worst = c;
+                worst_key = key;
+            }
+        }
+        if (s->heap[0].key >= worst_key) break;
+        int victim = s->core[worst].proc;
+        sched_stop(s, worst, now);
+        sched_ready(s, victim);
+        sched_run(s, worst, sched_pop(s), now);
     }
 }
 
-void fg_job(int job_id) {
-    if (job_id > 0 && job_id <= job_count) {
-        kill(jobs[job_id-1].pid, SIGCONT);
-        waitpid(jobs[job_id-1].pid, NULL, 0);
-        memmove(&jobs[job_id-1], &jobs[job_id], sizeof(struct Job) * (job_count - job_id));
-        job_count--;
+static int sched_by_arrival(const void *a, const void *b) {
+    const struct Process *x = a, *y = b;
+    if (x->arrival != y->arrival) return x->arrival < y->arrival ? -1 : 1;
+    return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+// Run the workload to completion
+void sched_simulate(struct Sched *s) {
+    int expired[SCHED_MAX_CORES];
+    s->heap = malloc((s->n + 1) * sizeof(struct SchedEntry));
+    s->heap_len = 0;
+    s->seq = 0;
+    s->core = calloc(s->ncores, sizeof(struct SchedCore));
+    for (int c = 0; c < s->ncores; c++) s->core[c].proc = -1;
+    for (int i = 0; i < s->n; i++) {
+        struct Process *p = &s->procs[i];
+        p->remaining = p->burst;
+        p->start = p->finish = -1;
+        p->level = 0;
+    }
+    int sorted = 1;
+    for (int i = 1; i < s->n && sorted; i++) sorted = sched_by_arrival(&s->procs[i - 1], &s->procs[i]) <= 0;
+    if (!sorted) qsort(s->procs, s->n, sizeof(struct Process), sched_by_arrival);
+    long now = s->n ? s->procs[0].arrival : 0;
+    int next = 0, done = 0;
+    while (done < s->n) {
+        // Completions and used-up quanta
+        int nexpired = 0;
+        for (int c = 0; c < s->ncores; c++) {
+            int i = s->core[c].proc;
+            if (i < 0 || s->core[c].slice_end != now) continue;
+            sched_stop(s, c, now);
+            if (s->procs[i].remaining == 0) {
+                s->procs[i].finish = now;
+                done++;
+            } else {
+                if (s->policy->expired) s->policy->expired(&s->procs[i]);
+                expired[nexpired++] = i;
+            }
+        }
+        // Arrivals queue ahead of processes coming off a CPU at the same time
+        while (next < s->n && s->procs[next].arrival <= now) sched_ready(s, next++);
+        for (int e = 0; e < nexpired; e++) sched_ready(s, expired[e]);
+        sched_dispatch(s, now);
+        if (done == s->n) break;
+        long t = next < s->n ? s->procs[next].arrival : LONG_MAX;
+        for (int c = 0; c < s->ncores; c++) {
+            if (s->core[c].proc >= 0 && s->core[c].slice_end < t) t = s->core[c].slice_end;
+        }
+        for (int c = 0; c < s->ncores; c++) {
+            if (s->core[c].proc < 0) continue;
+            s->procs[s->core[c].proc].remaining -= t - s->core[c].since;
+            s->core[c].since = t;
+        }
+        now = t;
     }
+    free(s->heap);
 }
 
-void bg_job(int job_id) {
-    if (job_id > 0 && job_id <= job_count) {
-        kill(jobs[job_id-1].pid, SIGCONT);
-        jobs[job_id-1].status = 0;
+void sched_gantt(struct Sched *s) {
+    for (int c = 0; c < s->ncores; c++) {
+        struct SchedCore *core = &s->core[c];
+        if (s->ncores == 1) printf("Gantt: |");
+        else printf("CPU%-2d |", c);
+        long end = core->nseg ? core->seg[0].start : 0;
+        for (int g = 0; g < core->nseg; g++) {
+            if (core->seg[g].start > end) printf("idle(%ld-%ld)|", end, core->seg[g].start);
+            printf("P%d(%ld-%ld)|", core->seg[g].pid, core->seg[g].start, core->seg[g].end);
+            end = core->seg[g].end;
+        }
+        if (core->dropped) printf(" ... %d more", core->dropped);
+        printf("\n");
     }
 }
 
-// VFS
-void vfs_init() {
-    memset(vfs_disk, 0, VFS_SIZE);
+// Averages over a finished simulation
+void sched_summarise(struct Sched *s, struct SchedSummary *sum) {
+    *sum = (struct SchedSummary){0};
+    for (int i = 0; i < s->n; i++) {
+        struct Process *p = &s->procs[i];
+        long t = p->finish - p->arrival, w = t - p->burst;
+        sum->wait += w;
+        sum->turnaround += t;
+        sum->response += p->start - p->arrival;
+        sum->busy += p->burst;
+        if (w > sum->max_wait) sum->max_wait = w;
+        if (p->finish > sum->makespan) sum->makespan = p->finish;
+    }
+    if (s->n) {
+        sum->wait /= s->n;
+        sum->turnaround /= s->n;
+        sum->response /= s->n;
+        sum->makespan -= s->procs[0].arrival;
+    }
 }
 
-int vfs_allocate_block(int size) {
-    for (int i = 0; i < VFS_SIZE - size; i++) {
-        if (vfs_disk[i] == 0) return i;
+// Per-process metrics, then averages
+void sched_report(struct Sched *s, int table) {
+    struct SchedSummary sum;
+    if (table) printf("%6s %8s %6s %5s %8s %8s %8s %8s\n", "PID", "Arrival", "Burst", "Prio", "Finish", "Wait", "Turn", "Resp");
+    for (int i = 0; table && i < s->n && i < SCHED_TABLE_MAX; i++) {
+        struct Process *p = &s->procs[i];
+        long t = p->finish - p->arrival;
+        printf("%6d %8ld %6ld %5d %8ld %8ld %8ld %8ld\n", p->pid, p->arrival, p->burst, p->priority, p->finish,
+               t - p->burst, t, p->start - p->arrival);
     }
-    return -1;
+    if (table && s->n > SCHED_TABLE_MAX) printf("%6s (%d more)\n", "...", s->n - SCHED_TABLE_MAX);
+    if (!s->n) return;
+    sched_summarise(s, &sum);
+    printf("Avg Wait: %.2f  Avg Turnaround: %.2f  Avg Response: %.2f  Max Wait: %ld\n",
+           sum.wait, sum.turnaround, sum.response, sum.max_wait);
+    printf("Makespan: %ld  Throughput: %.3f/tick  CPU utilisation: %.1f%%\n", sum.makespan,
+           sum.makespan ? s->n / (double)sum.makespan : 0,
+           sum.makespan ? 100 * sum.busy / ((double)sum.makespan * s->ncores) : 0);
+}
+
+// Workload file: one "pid arrival burst [priority]" per line, # comments
+int sched_load(const char *path, struct Process **out) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("Error: cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct Process *procs = NULL;
+    int n = 0, lineno = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        struct Process p = {0};
+        int got = sscanf(line, "%d %ld %ld %d", &p.pid, &p.arrival, &p.burst, &p.priority);
+        if (got <= 0) continue;
+        if (got < 3 || p.arrival < 0 || p.burst <= 0) {
+            printf("Error: %s:%d: expected 'pid arrival burst [priority]'\n", path, lineno);
+            free(procs);
+            fclose(f);
+            return -1;
+        }
+        procs = quest_grow(procs, n, sizeof(struct Process));
+        procs[n++] = p;
+    }
+    fclose(f);
+    *out = procs;
+    return n;
 }
 
-void vfs_touch(char *name) {
-    if (vfs_root.file_count < 10) {
-        strcpy(vfs_root.files[vfs_root.file_count].name, name);
-        vfs_root.files[vfs_root.file_count].size = 0;
-        vfs_root.files[vfs_root.file_count].start_block = vfs_allocate_block(1);
-        vfs_root.file_count++;
-        printf("Created %s in VFS\n", name);
+// Seeded workload: bursts 1-20, arrivals spaced for about 85% CPU load
+int sched_generate(int n, unsigned long seed, int ncores, struct Process **out) {
+    uint64_t x = seed * 0x9e3779b97f4a7c15ULL + 1;
+    long now = 0, gap = 24 / ncores;
+    struct Process *procs = malloc(n * sizeof(struct Process));
+    for (int i = 0; i < n; i++) {
+        // xorshift64*, so a seed means the same workload everywhere
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        uint64_t r = x * 0x2545f4914f6cdd1dULL;
+        procs[i] = (struct Process){ .pid = i + 1, .arrival = now, .burst = 1 + (r >> 8) % 20, .priority = (r >> 16) % 8 };
+        now += gap ? (long)((r >> 32) % (gap + 1)) : 0;
     }
+    *out = procs;
+    return n;
+}
+
+const struct SchedConfig sched_configs[] = {
+    {"SCHED_OTHER, 1 CPU", SCHED_OTHER, 0, 1, "rr"},
+    {"SCHED_OTHER nice, 1 CPU", SCHED_OTHER, 1, 1, "prio"},
+    {"SCHED_FIFO, 1 CPU", SCHED_FIFO, 0, 1, "fcfs"},
+    {"SCHED_RR, 1 CPU", SCHED_RR, 0, 1, "rr"},
+    {"SCHED_OTHER, all CPUs", SCHED_OTHER, 0, 0, "rr"},
+};
+
+static double sched_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-void vfs_ls() {
-    for (int i = 0; i < vfs_root.file_count; i++) {
-        printf("%s\n", vfs_root.files[i].name);
+// Child side of a real run. Only async-signal-safe calls: the shell has
+// other threads.
+static void sched_child(const struct SchedConfig *cfg, int index, struct Process *p, int cpu, long tick_ns, int fd) {
+    struct SchedSample r = { index, sched_now(), 0, 0, 0 };
+    if (cfg->pinned) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    if (cfg->policy != SCHED_OTHER) {
+        struct sched_param sp = { .sched_priority = 1 };
+        sched_setscheduler(0, cfg->policy, &sp);
     }
+    if (cfg->nice) setpriority(PRIO_PROCESS, 0, p->priority * 2);
+    struct timespec used;
+    do clock_gettime(CLOCK_THREAD_CPUTIME_ID, &used);
+    while (used.tv_sec * 1000000000L + used.tv_nsec < p->burst * tick_ns);
+    char buf[128];
+    int sfd = open("/proc/self/schedstat", O_RDONLY);
+    ssize_t len = sfd >= 0 ? read(sfd, buf, sizeof(buf) - 1) : -1;
+    if (len > 0) {
+        buf[len] = '\0';
+        sscanf(buf, "%llu %llu", &r.run_ns, &r.wait_ns);
+    }
+    r.end = sched_now();
+    write(fd, &r, sizeof(r));
+    _exit(0);
 }
 
-void vfs_cat(char *name) {
-    for (int i = 0; i < vfs_root.file_count; i++) {
-        if (strcmp(vfs_root.files[i].name, name) == 0) {
-            printf("Content of %s: [sim data]\n", name);
-            return;
+// Run the workload for real under cfg; averages in ms go to sum, with the
+// schedstat run-queue wait in busy
+static int sched_real_run(const struct SchedConfig *cfg, struct Process *w, int n, int tick_ms, int cpu,
+                          struct SchedSummary *sum) {
+    long tick_ns = tick_ms * 1000000L;
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return -1;
+    pid_t *pids = malloc(n * sizeof(pid_t));
+    double t0 = sched_now() + 0.01;
+    for (int i = 0; i < n; i++) {
+        double at = t0 + w[i].arrival * tick_ms / 1e3;
+        struct timespec ts = { (time_t)at, (long)((at - (time_t)at) * 1e9) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            close(fds[0]);
+            sched_child(cfg, i, &w[i], cpu, tick_ns, fds[1]);
         }
     }
-    printf("Not found\n");
+    close(fds[1]);
+    struct SchedSample r;
+    int got = 0;
+    *sum = (struct SchedSummary){0};
+    while (read(fds[0], &r, sizeof(r)) == sizeof(r)) {
+        double arrival = t0 + w[r.index].arrival * tick_ms / 1e3;
+        double turnaround = (r.end - arrival) * 1e3;
+        sum->turnaround += turnaround;
+        sum->wait += turnaround - w[r.index].burst * tick_ms;
+        sum->response += (r.start - arrival) * 1e3;
+        sum->busy += r.wait_ns / 1e6;
+        got++;
+    }
+    close(fds[0]);
+    for (int i = 0; i < n; i++) {
+        if (pids[i] > 0) waitpid(pids[i], NULL, 0);
+    }
+    free(pids);
+    if (got < n) return -1;
+    sum->wait /= n;
+    sum->turnaround /= n;
+    sum->response /= n;
+    sum->busy /= n;
+    return 0;
 }
 
-// Scheduler
+// The simulator's view of cfg, in ms
+static void sched_model(const struct SchedConfig *cfg, struct Process *w, int n, int tick_ms, long quantum, int ncores,
+                        struct SchedSummary *sum) {
+    int p = 0;
+    while (strcmp(sched_policies[p].name, cfg->model) != 0) p++;
+    struct Process *procs = malloc(n * sizeof(struct Process));
+    memcpy(procs, w, n * sizeof(struct Process));
+    struct Sched s = { &sched_policies[p], quantum, cfg->pinned ? 1 : ncores, procs, n };
+    sched_simulate(&s);
+    sched_summarise(&s, sum);
+    sum->wait *= tick_ms;
+    sum->turnaround *= tick_ms;
+    sum->response *= tick_ms;
+    free(s.core);
+    free(procs);
+}
+
+// schedule real: each policy the kernel offers against its model
+int sched_real(struct Process *workload, int n, int tick_ms) {
+    if (n > SCHED_REAL_MAX) {
+        printf("Error: real runs take at most %d processes\n", SCHED_REAL_MAX);
+        return 2;
+    }
+    qsort(workload, n, sizeof(struct Process), sched_by_arrival);
+    cpu_set_t allowed;
+    int cpu = 0, ncores = 1;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        ncores = CPU_COUNT(&allowed);
+        while (!CPU_ISSET(cpu, &allowed)) cpu++;
+    }
+    if (ncores > SCHED_MAX_CORES) ncores = SCHED_MAX_CORES;
+    // Above the children, so arrivals are forked on time; they start as
+    // SCHED_OTHER and pick their own policy
+    struct sched_param sp = { .sched_priority = 2 };
+    int rt = sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &sp) == 0;
+    // SCHED_RR's timeslice; sched_rr_get_interval only reports it for RR tasks
+    long rr_ms = 100;
+    FILE *f = fopen("/proc/sys/kernel/sched_rr_timeslice_ms", "r");
+    if (f) {
+        if (fscanf(f, "%ld", &rr_ms) != 1 || rr_ms <= 0) rr_ms = 100;
+        fclose(f);
+    }
+    long rr_ticks = rr_ms / tick_ms > 0 ? rr_ms / tick_ms : 1;
+
+    printf("Real runs: %d processes, 1 tick = %d ms, pinned runs on CPU %d, %d CPU%s in all\n", n, tick_ms, cpu,
+           ncores, ncores == 1 ? "" : "s");
+    printf("%-24s %-10s %17s %17s %17s %9s\n", "", "", "wait ms", "turnaround ms", "response ms", "runq ms");
+    printf("%-24s %-10s %8s %8s %8s %8s %8s %8s %9s\n", "Kernel policy", "Model", "real", "sim", "real", "sim",
+           "real", "sim", "real");
+    int failed = 0;
+    for (size_t c = 0; c < sizeof(sched_configs) / sizeof(sched_configs[0]); c++) {
+        const struct SchedConfig *cfg = &sched_configs[c];
+        long quantum = cfg->policy == SCHED_RR ? rr_ticks : 1;
+        char model[32];
+        snprintf(model, sizeof(model), strcmp(cfg->model, "rr") == 0 ? "%s q=%ld" : "%s", cfg->model, quantum);
+        if (cfg->policy != SCHED_OTHER && !rt) {
+            printf("%-24s %-10s skipped: needs CAP_SYS_NICE\n", cfg->name, model);
+            continue;
+        }
+        struct SchedSummary real, sim;
+        sched_model(cfg, workload, n, tick_ms, quantum, ncores, &sim);
+        if (sched_real_run(cfg, workload, n, tick_ms, cpu, &real) != 0) {
+            printf("%-24s %-10s failed: %s\n", cfg->name, model, strerror(errno));
+            failed = 1;
+            continue;
+        }
+        printf("%-24s %-10s %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %9.1f\n", cfg->name, model, real.wait, sim.wait,
+               real.turnaround, sim.turnaround, real.response, sim.response, real.busy);
+    }
+    if (rt) {
+        sp.sched_priority = 0;
+        sched_setscheduler(0, SCHED_OTHER, &sp);
+    }
+    printf("runq: time spent runnable but not running, from /proc/<pid>/schedstat\n");
+    return failed;
+}
+
+// schedule [policy|all|real] [-q quantum] [-c cores] [-t tick ms] [-f file | -n count [-s seed]]
+int sched_main(int argc, char **argv) {
+    static const struct Process sample[] = {
+        {.pid = 1, .arrival = 0, .burst = 5, .priority = 2},
+        {.pid = 2, .arrival = 1, .burst = 3, .priority = 1},
+        {.pid = 3, .arrival = 2, .burst = 4, .priority = 3},
+    };
+    const char *policy = "fcfs", *file = NULL;
+    long quantum = 4;
+    int ncores = 1, count = 0, tick_ms = SCHED_TICK_MS;
+    unsigned long seed = 1;
+    for (int i = 1; i < argc; i++) {
+        const char *opt = argv[i];
+        if (opt[0] != '-') {
+            policy = opt;
+            continue;
+        }
+        if (i + 1 >= argc || !strchr("qcfnst", opt[1]) || opt[2]) {
+            printf("Usage: schedule [fcfs|sjf|srtf|rr|prio|mlfq|all|real] [-q quantum] [-c cores] [-t tick ms] [-f file | -n count [-s seed]]\n");
+            return 2;
+        }
+        const char *val = argv[++i];
+        switch (opt[1]) {
+        case 'q': quantum = atol(val); break;
+        case 'c': ncores = atoi(val); break;
+        case 'f': file = val; break;
+        case 'n': count = atoi(val); break;
+        case 's': seed = strtoul(val, NULL, 10); break;
+        case 't': tick_ms = atoi(val); break;
+        }
+    }
+    if (quantum <= 0 || tick_ms <= 0 || ncores <= 0 || ncores > SCHED_MAX_CORES) {
+        printf("Error: quantum and tick must be positive and cores between 1 and %d\n", SCHED_MAX_CORES);
+        return 2;
+    }
+    int real = strcmp(policy, "real") == 0;
+    int first = 0, last = SCHED_NPOLICIES - 1;
+    if (strcmp(policy, "all") != 0 && !real) {
+        for (first = 0; first < SCHED_NPOLICIES && strcmp(sched_policies[first].name, policy) != 0; first++);
+        if (first == SCHED_NPOLICIES) {
+            printf("Error: unknown policy '%s'\n", policy);
+            return 2;
+        }
+        last = first;
+    }
+
+    struct Process *workload;
+    int n;
+    if (file) n = sched_load(file, &workload);
+    else if (count > 0) n = sched_generate(count, seed, ncores, &workload);
+    else {
+        n = sizeof(sample) / sizeof(sample[0]);
+        workload = malloc(sizeof(sample));
+        memcpy(workload, sample, sizeof(sample));
+    }
+    if (n < 0) return 1;
+    if (real) {
+        int status = sched_real(workload, n, tick_ms);
+        free(workload);
+        return status;
+    }
+
+    // Each policy gets its own copy; the simulation reorders and rewrites it
+    struct Process *procs = malloc((n ? n : 1) * sizeof(struct Process));
+    for (int p = first; p <= last; p++) {
+        struct Sched s = { &sched_policies[p], quantum, ncores, procs, n };
+        memcpy(procs, workload, n * sizeof(struct Process));
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        sched_simulate(&s);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        printf("== %s", s.policy->name);
+        if (s.policy->quantum) printf(" (quantum %ld)", quantum);
+        printf(": %d processes on %d CPU%s, simulated in %.1f ms\n", n, ncores, ncores == 1 ? "" : "s",
+               (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+        sched_gantt(&s);
+        sched_report(&s, first == last);
+        free(s.core);
+    }
+    free(procs);
+    free(workload);
+    return 0;
+}
+
+// The schedule quest: FCFS on the sample workload
 void simulate_fcfs() {
-    int n = 3;
-    struct Process procs[3] = {{1,0,5}, {2,1,3}, {3,2,4}};
-    int wait[3] = {0}, turnaround[3] = {0};
-    wait[0] = 0;
-    for (int i = 1; i < n; i++) wait[i] = procs[i-1].burst + wait[i-1];
-    for (int i = 0; i < n; i++) turnaround[i] = procs[i].burst + wait[i];
-    printf("Gantt: |P1(0-5)|P2(5-8)|P3(8-12)|\n");
-    printf("Avg Wait: %.2f\n", (wait[0]+wait[1]+wait[2])/(float)n);
+    char *args[] = {"schedule", "fcfs", NULL};
+    sched_main(2, args);
+    printf("Try 'schedule rr -q 2', 'schedule all' or 'schedule srtf -n 1000000 -c 4' next.\n");
+}
+
+// Daemon
+// $SHELLQUEST_SOCKET, else root's socket for root, else one in the user's
+// runtime directory
+static void serve_socket_path(char *out, size_t len) {
+    char *env = getenv("SHELLQUEST_SOCKET"), *runtime = getenv("XDG_RUNTIME_DIR");
+    if (env && *env) snprintf(out, len, "%s", env);
+    else if (geteuid() == 0) snprintf(out, len, "%s", SERVE_SOCKET);
+    else if (runtime && *runtime) snprintf(out, len, "%s/shellquest.sock", runtime);
+    else snprintf(out, len, "/tmp/shellquest-%d.sock", (int)getuid());
+}
+
+static int serve_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) return fd;
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+static int serve_write_all(int fd, const void *buf, size_t len) {
+    for (size_t off = 0; off < len;) {
+        ssize_t n = write(fd, (const char *)buf + off, len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        off += n;
+    }
+    return 0;
+}
+
+static int serve_send(int fd, int type, const void *data, size_t len) {
+    char frame[sizeof(struct ServeFrame) + SERVE_FRAME_MAX];
+    struct ServeFrame f = { type, 0, len };
+    memcpy(frame, &f, sizeof(f));
+    memcpy(frame + sizeof(f), data, len);
+    return serve_write_all(fd, frame, sizeof(f) + len);
+}
+
+static void serve_watch(struct ServeEnd *e, uint32_t events) {
+    if (events == e->events) return;
+    struct epoll_event ev = { events, { .ptr = e } };
+    epoll_ctl(e->s->epoll, EPOLL_CTL_MOD, e->fd, &ev);
+    e->events = events;
+}
+
+// Write out what is queued for fd. Returns -1 once the other side is gone.
+static int serve_flush(int fd, char *buf, size_t *off, size_t *len) {
+    while (*off < *len) {
+        ssize_t n = write(fd, buf + *off, *len - *off);
+        if (n < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        *off += n;
+    }
+    *off = *len = 0;
+    return 0;
+}
+
+// Move whatever can move between a session's client and its PTY without
+// blocking; each side is only read while the other has room for it.
+// Returns -1 when the session is over.
+static int serve_pump(struct ServeSession *s) {
+    if (serve_flush(s->client.fd, s->out, &s->out_off, &s->out_len) != 0) return -1;
+    if (s->out_len == 0) {
+        ssize_t n = read(s->pty.fd, s->out, sizeof(s->out));
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) return -1; // EIO once the shell is gone
+        if (n > 0) {
+            s->out_len = n;
+            if (serve_flush(s->client.fd, s->out, &s->out_off, &s->out_len) != 0) return -1;
+        }
+    }
+    if (s->in_len < sizeof(s->in)) {
+        ssize_t n = read(s->client.fd, s->in + s->in_len, sizeof(s->in) - s->in_len);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) return -1;
+        if (n > 0) s->in_len += n;
+    }
+    size_t used = 0;
+    while (s->in_len - used >= sizeof(struct ServeFrame)) {
+        struct ServeFrame f;
+        memcpy(&f, s->in + used, sizeof(f));
+        if (f.len > SERVE_FRAME_MAX) return -1;
+        if (s->in_len - used < sizeof(f) + f.len) break;
+        const char *data = s->in + used + sizeof(f);
+        if (f.type == SERVE_DATA) {
+            if (s->to_pty_len + f.len > sizeof(s->to_pty)) break;
+            memcpy(s->to_pty + s->to_pty_len, data, f.len);
+            s->to_pty_len += f.len;
+        } else if (f.type == SERVE_WINSIZE && f.len == sizeof(struct winsize)) {
+            struct winsize ws;
+            memcpy(&ws, data, sizeof(ws));
+            ioctl(s->pty.fd, TIOCSWINSZ, &ws);
+        }
+        used += sizeof(f) + f.len;
+    }
+    memmove(s->in, s->in + used, s->in_len - used);
+    s->in_len -= used;
+    if (serve_flush(s->pty.fd, s->to_pty, &s->to_pty_off, &s->to_pty_len) != 0) return -1;
+    serve_watch(&s->pty, (s->out_len ? 0 : EPOLLIN) | (s->to_pty_len ? EPOLLOUT : 0));
+    serve_watch(&s->client, (s->in_len < sizeof(s->in) ? EPOLLIN : 0) | (s->out_len ? EPOLLOUT : 0));
+    return 0;
+}
+
+// Take new sessions from the accept loop; only this worker touches them after
+static void serve_adopt(int worker) {
+    struct ServeSession *s;
+    while (read(serve_handoff[worker][0], &s, sizeof(s)) == sizeof(s)) {
+        s->epoll = serve_epoll[worker];
+        struct epoll_event ev = { EPOLLIN, { .ptr = &s->pty } };
+        epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->pty.fd, &ev);
+        ev.data.ptr = &s->client;
+        epoll_ctl(s->epoll, EPOLL_CTL_ADD, s->client.fd, &ev);
+    }
+}
+
+static void *serve_worker(void *arg) {
+    int worker = (int)(intptr_t)arg;
+    struct epoll_event ev[64];
+    for (;;) {
+        int n = epoll_wait(serve_epoll[worker], ev, 64, -1);
+        struct ServeSession *dead[64];
+        int ndead = 0;
+        for (int i = 0; i < n; i++) {
+            if (!ev[i].data.ptr) {
+                serve_adopt(worker);
+                continue;
+            }
+            struct ServeSession *s = ((struct ServeEnd *)ev[i].data.ptr)->s;
+            if (s->closed || serve_pump(s) == 0) continue;
+            // A session child forked meanwhile may still share these open
+            // files, and closing the fds alone would leave them registered
+            epoll_ctl(s->epoll, EPOLL_CTL_DEL, s->client.fd, NULL);
+            epoll_ctl(s->epoll, EPOLL_CTL_DEL, s->pty.fd, NULL);
+            // Closing the PTY hangs up the session's terminal, and the shell ends
+            close(s->client.fd);
+            close(s->pty.fd);
+            s->closed = 1;
+            dead[ndead++] = s;
+            atomic_fetch_sub(&serve_sessions, 1);
+        }
+        // Both ends of a session can be in one batch: free only after it
+        for (int i = 0; i < ndead; i++) free(dead[i]);
+    }
+    return NULL;
+}
+
+// Bind dir over itself, writable, inside the read-only root
+static int serve_keep_writable(const char *dir) {
+    struct mount_attr rw = { .attr_clr = MOUNT_ATTR_RDONLY };
+    if (mount(dir, dir, NULL, MS_BIND, NULL) != 0) return -1;
+    return mount_setattr(AT_FDCWD, dir, 0, &rw, sizeof(rw));
+}
+
+// The forked child: a shell for the peer on the PTY's slave side, in a
+// mount namespace of its own (and its own user's, when the daemon is root
+// and the peer is not) over the daemon's fixture tree.
+// Swap the fixture tree for a clone in which root's files are the
+// learner's, so the overlay can copy them up for the learner to change.
+// The mapping needs a user namespace to name it: a child's, kept just
+// long enough to open.
+static int serve_idmap_lower(uid_t uid, gid_t gid) {
+    int sync[2];
+    if (pipe2(sync, O_CLOEXEC) != 0) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        char ok = unshare(CLONE_NEWUSER) == 0;
+        write(sync[1], &ok, 1);
+        pause();
+        _exit(0);
+    }
+    close(sync[1]);
+    char ok = 0, path[64], map[64];
+    int ns = -1;
+    if (pid > 0 && read(sync[0], &ok, 1) == 1 && ok) {
+        snprintf(path, sizeof(path), "/proc/%d/uid_map", (int)pid);
+        snprintf(map, sizeof(map), "0 %d 1", (int)uid);
+        sandbox_write(path, map);
+        snprintf(path, sizeof(path), "/proc/%d/gid_map", (int)pid);
+        snprintf(map, sizeof(map), "0 %d 1", (int)gid);
+        sandbox_write(path, map);
+        snprintf(path, sizeof(path), "/proc/%d/ns/user", (int)pid);
+        ns = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    close(sync[0]);
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    if (ns < 0) return -1;
+    struct mount_attr idmap = { .attr_set = MOUNT_ATTR_IDMAP, .userns_fd = ns };
+    int tree = open_tree(AT_FDCWD, SANDBOX_STAGE "/lower", OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+    int err = tree < 0 || mount_setattr(tree, "", AT_EMPTY_PATH, &idmap, sizeof(idmap)) != 0 ||
+              umount2(SANDBOX_STAGE "/lower", MNT_DETACH) != 0 ||
+              move_mount(tree, "", AT_FDCWD, SANDBOX_STAGE "/lower", MOVE_MOUNT_F_EMPTY_PATH) != 0;
+    if (tree >= 0) close(tree);
+    close(ns);
+    return err ? -1 : 0;
+}
+
+static void serve_session_fail(const char *what) {
+    printf("Error: %s: %s\n", what, strerror(errno));
+    fflush(stdout);
+    _exit(1);
+}
+
+static void serve_session(int slave, struct ucred *peer) {
+    setsid();
+    ioctl(slave, TIOCSCTTY, 0);
+    for (int fd = 0; fd < 3; fd++) dup2(slave, fd);
+    close_range(3, ~0U, 0); // the other sessions' descriptors above all
+    setvbuf(stdout, NULL, _IOLBF, BUFSIZ); // a terminal now, where the daemon's was not
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    signal(SIGHUP, SIG_IGN); // a hung-up terminal reads as EOF, and the shell ends as usual
+    struct passwd *pw = NULL;
+    if (geteuid() == 0 && peer->uid != 0 && !(pw = getpwuid(peer->uid))) {
+        errno = ENOENT;
+        serve_session_fail("no account for the learner");
+    }
+    sandbox_cgroup_session(peer->uid, pw ? pw->pw_gid : peer->gid);
+    if (unshare(CLONE_NEWNS) != 0) serve_session_fail("cannot start a session");
+    char path[PATH_MAX], logs[PATH_MAX];
+    if (pw) {
+        // The daemon's own progress and logs leave the learner's view
+        log_default_dir(logs, sizeof(logs));
+        umount2(logs, MNT_DETACH);
+        snprintf(path, sizeof(path), "%s", progress_path);
+        if (strrchr(path, '/')) *strrchr(path, '/') = '\0';
+        umount2(path, MNT_DETACH);
+        setenv("HOME", pw->pw_dir, 1);
+        setenv("USER", pw->pw_name, 1);
+        setenv("LOGNAME", pw->pw_name, 1);
+        // Where the daemon's own user keeps things is not for the learner
+        unsetenv("SHELLQUEST_PROGRESS");
+        unsetenv("SHELLQUEST_LOG_DIR");
+        unsetenv("XDG_STATE_HOME");
+        // The learner's progress and logs, made as the learner in a
+        // briefly writable home and kept writable before root is given up
+        int home = serve_keep_writable(pw->pw_dir) == 0;
+        setfsuid(peer->uid);
+        setfsgid(pw->pw_gid);
+        progress_default_path(path, sizeof(path));
+        progress_mkdirs(path);
+        log_default_dir(logs, sizeof(logs));
+        mkdir(logs, 0700);
+        setfsuid(0);
+        setfsgid(0);
+        *strrchr(path, '/') = '\0';
+        serve_keep_writable(path);
+        serve_keep_writable(logs);
+        if (home) {
+            struct mount_attr ro = { .attr_set = MOUNT_ATTR_RDONLY };
+            mount_setattr(AT_FDCWD, pw->pw_dir, 0, &ro, sizeof(ro));
+        }
+        fchown(0, peer->uid, -1);
+        // ID maps are written through /proc, read-only like the rest
+        struct mount_attr rw = { .attr_clr = MOUNT_ATTR_RDONLY };
+        mount_setattr(AT_FDCWD, "/proc", 0, &rw, sizeof(rw));
+        // Mounts made here would be locked in the learner's namespace, and
+        // could never be reset: the session mounts its own sandbox instead
+        umount2(SANDBOX_DIR, MNT_DETACH);
+        umount2(SANDBOX_STAGE "/layer", MNT_DETACH);
+        if (serve_idmap_lower(peer->uid, pw->pw_gid) != 0) serve_session_fail("cannot lend the quests to the learner");
+        if (initgroups(pw->pw_name, pw->pw_gid) != 0 || setgid(pw->pw_gid) != 0 || setuid(peer->uid) != 0)
+            serve_session_fail("cannot become the learner");
+        prctl(PR_SET_DUMPABLE, 1); // setuid cleared it, and our uid_map with it
+        if (unshare(CLONE_NEWUSER | CLONE_NEWNS) != 0) serve_session_fail("cannot start a session");
+        sandbox_map_ids(peer->uid, pw->pw_gid);
+        sandbox_mode = SANDBOX_USERNS;
+    }
+    progress_default_path(path, sizeof(path));
+    char *slash = strrchr(path, '/');
+    snprintf(vfs_image_path, sizeof(vfs_image_path), "%.*s/%s", slash ? (int)(slash - path) : 1, slash ? path : ".",
+             VFS_SERVE_IMAGE);
+    reaper_running = 0; // the daemon's reaper did not come along
+    perf_open();
+    if (sandbox_mount(-1) != 0) serve_session_fail("cannot mount the sandbox");
+    jobs_init();
+    load_progress();
+    vfs_init();
+    fixture_start_reaper();
+    exit(shell_run());
+}
+
+// Start a session for a connection whose hello has arrived
+static void serve_accept(int fd, struct ServeHello *hello, int worker) {
+    struct ucred peer;
+    socklen_t len = sizeof(peer);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &len) != 0 || hello->magic != SERVE_MAGIC) {
+        close(fd);
+        return;
+    }
+    if (geteuid() != 0 && peer.uid != geteuid()) {
+        dprintf(fd, "Error: this server only takes sessions for UID %d\r\n", (int)geteuid());
+        close(fd);
+        return;
+    }
+    char name[64];
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC), slave = -1;
+    if (master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0 && ptsname_r(master, name, sizeof(name)) == 0)
+        slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (slave < 0) {
+        dprintf(fd, "Error: no terminal for the session: %s\r\n", strerror(errno));
+        if (master >= 0) close(master);
+        close(fd);
+        return;
+    }
+    struct winsize ws = { hello->rows, hello->cols, 0, 0 };
+    if (ws.ws_row && ws.ws_col) ioctl(master, TIOCSWINSZ, &ws);
+    pid_t pid = fork();
+    if (pid == 0) serve_session(slave, &peer);
+    close(slave);
+    if (pid < 0) {
+        close(master);
+        close(fd);
+        return;
+    }
+    fcntl(master, F_SETFL, O_NONBLOCK);
+    struct ServeSession *s = calloc(1, sizeof(*s));
+    s->client = (struct ServeEnd){ s, fd, EPOLLIN };
+    s->pty = (struct ServeEnd){ s, master, EPOLLIN };
+    s->pid = pid;
+    atomic_fetch_add(&serve_sessions, 1);
+    write(serve_handoff[worker][1], &s, sizeof(s));
+}
+
+// shellquest --serve [-s socket] [-w workers]
+int serve_main(int argc, char **argv) {
+    char path[PATH_MAX];
+    int workers = 0;
+    serve_socket_path(path, sizeof(path));
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            snprintf(path, sizeof(path), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else {
+            printf("Usage: shellquest --serve [-s socket] [-w workers]\n");
+            return 2;
+        }
+    }
+    if (workers <= 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1) workers = 1;
+    if (workers > SERVE_WORKERS_MAX) workers = SERVE_WORKERS_MAX;
+
+    // The socket lives on the real filesystem, so it is made before the
+    // sandbox hides that
+    int fd = serve_connect(path);
+    if (fd >= 0) {
+        printf("Error: a server is already listening on %s\n", path);
+        close(fd);
+        return 1;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path) >= (int)sizeof(addr.sun_path)) {
+        printf("Error: socket path too long: %s\n", path);
+        return 1;
+    }
+    unlink(path);
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 128) != 0) {
+        printf("Error: cannot listen on %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (geteuid() == 0) chmod(path, 0666); // anyone may connect; the server checks who it is
+
+    quests_load();
+    progress_locate();
+    sandbox_cgroup_init();
+    sandbox_enter(); // before the workers start
+    if (sandbox_mode == SANDBOX_PLAIN) {
+        printf("Error: sessions need the namespace sandbox, which is unavailable\n");
+        unlink(path);
+        return 1;
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    for (int w = 0; w < workers; w++) {
+        pthread_t thread;
+        serve_epoll[w] = epoll_create1(EPOLL_CLOEXEC);
+        pipe2(serve_handoff[w], O_CLOEXEC | O_NONBLOCK);
+        struct epoll_event ev = { EPOLLIN, { .ptr = NULL } };
+        epoll_ctl(serve_epoll[w], EPOLL_CTL_ADD, serve_handoff[w][0], &ev);
+        pthread_create(&thread, NULL, serve_worker, (void *)(intptr_t)w);
+        pthread_detach(thread);
+    }
+    printf("Serving sessions on %s with %d worker%s\n", path, workers, workers == 1 ? "" : "s");
+    fflush(stdout);
+
+    int next = 0;
+    struct ServePending pending[SERVE_PENDING_MAX]; // in arrival order
+    int npending = 0;
+    for (;;) {
+        struct pollfd fds[2 + SERVE_PENDING_MAX] = { { lfd, POLLIN, 0 }, { sfd, POLLIN, 0 } };
+        for (int i = 0; i < npending; i++) fds[2 + i] = (struct pollfd){ pending[i].fd, POLLIN, 0 };
+        int timeout = -1;
+        if (npending) {
+            int64_t wait = (pending[0].deadline - perf_now()) / 1000000 + 1;
+            timeout = wait < 0 ? 0 : wait;
+        }
+        if (poll(fds, 2 + npending, timeout) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) {
+            struct signalfd_siginfo si;
+            if (read(sfd, &si, sizeof(si)) != sizeof(si)) continue;
+            if (si.ssi_signo != SIGCHLD) break;
+            pid_t pid;
+            char cgroup[sizeof(sandbox_cgroup) + 32];
+            while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+                if (!sandbox_cgroup[0]) continue;
+                snprintf(cgroup, sizeof(cgroup), "%s/session.%d", sandbox_cgroup, (int)pid);
+                sandbox_cgroup_remove(cgroup, 100);
+            }
+        }
+        // Collect hellos; a session starts once its hello is whole
+        int64_t now = perf_now();
+        int kept = 0;
+        for (int i = 0; i < npending; i++) {
+            struct ServePending *p = &pending[i];
+            int done = 0;
+            if (fds[2 + i].revents) {
+                ssize_t n = read(p->fd, (char *)&p->hello + p->len, sizeof(p->hello) - p->len);
+                if (n > 0) p->len += n;
+                else if (n == 0 || (errno != EAGAIN && errno != EINTR)) done = -1;
+                if (p->len == sizeof(p->hello)) done = 1;
+            }
+            if (!done && now >= p->deadline) done = -1;
+            if (done > 0) serve_accept(p->fd, &p->hello, next++ % workers);
+            else if (done < 0) close(p->fd);
+            else pending[kept++] = *p;
+        }
+        npending = kept;
+        if (fds[0].revents) {
+            int cfd;
+            while ((cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+                if (npending == SERVE_PENDING_MAX) {
+                    close(pending[0].fd);
+                    memmove(pending, pending + 1, --npending * sizeof(pending[0]));
+                }
+                pending[npending++] = (struct ServePending){ cfd, 0, {0}, perf_now() + SERVE_HELLO_MS * 1000000LL };
+            }
+        }
+    }
+    unlink(path);
+    sandbox_cgroup_release();
+    printf("Server stopped with %d session%s open\n", atomic_load(&serve_sessions),
+           atomic_load(&serve_sessions) == 1 ? "" : "s");
+    return 0;
+}
+
+// shellquest --attach: this terminal becomes a daemon session. Returns -1,
+// having done nothing, when no daemon is listening.
+int serve_attach() {
+    char path[PATH_MAX];
+    serve_socket_path(path, sizeof(path));
+    int fd = serve_connect(path);
+    if (fd < 0 && strcmp(path, SERVE_SOCKET) != 0) fd = serve_connect(SERVE_SOCKET);
+    if (fd < 0) return -1;
+    struct winsize ws = {0};
+    ioctl(STDIN_FILENO, TIOCGWINSZ, &ws);
+    struct ServeHello hello = { SERVE_MAGIC, ws.ws_row, ws.ws_col };
+    serve_write_all(fd, &hello, sizeof(hello));
+    struct termios saved, raw;
+    int tty = tcgetattr(STDIN_FILENO, &saved) == 0;
+    if (tty) {
+        raw = saved;
+        cfmakeraw(&raw);
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    struct pollfd fds[3] = { { fd, POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 }, { sfd, POLLIN, 0 } };
+    char buf[SERVE_FRAME_MAX];
+    for (;;) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[0].revents) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0 || serve_write_all(STDOUT_FILENO, buf, n) != 0) break;
+        }
+        if (fds[1].revents) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n <= 0) {
+                // Input ran out: ^D ends the session once it has read the rest
+                serve_send(fd, SERVE_DATA, "\004", 1);
+                fds[1].fd = -1;
+            } else if (serve_send(fd, SERVE_DATA, buf, n) != 0) {
+                break;
+            }
+        }
+        if (fds[2].revents) {
+            struct signalfd_siginfo si;
+            read(sfd, &si, sizeof(si));
+            if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == 0) serve_send(fd, SERVE_WINSIZE, &ws, sizeof(ws));
+        }
+    }
+    if (tty) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    close(fd);
+    return 0;
+}
+
+// Load test
+#define BENCH_COMMAND "ls\n"
+
+struct BenchClient {
+    int fd, matched, rounds;
+    int64_t sent; // ns, when the last command went out
+};
+
+static int64_t bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bench_by_value(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Proportional set size of a process in KiB: its private pages plus its
+// share of those it has in common with others
+static long bench_pss(pid_t pid) {
+    char path[64], line[256];
+    long kb = 0;
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "Pss: %ld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+// The daemon's sessions: how many, and their PSS in KiB
+static int bench_sessions(pid_t daemon, long *pss) {
+    DIR *dir = opendir("/proc");
+    if (!dir) return 0;
+    struct dirent *de;
+    int n = 0;
+    *pss = 0;
+    while ((de = readdir(dir)) != NULL) {
+        char path[300], stat[512];
+        pid_t pid = atoi(de->d_name);
+        if (pid <= 0) continue;
+        snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        ssize_t len = read(fd, stat, sizeof(stat) - 1);
+        close(fd);
+        if (len <= 0) continue;
+        stat[len] = '\0';
+        char *end = strrchr(stat, ')');
+        int ppid;
+        if (!end || sscanf(end + 2, "%*c %d", &ppid) != 1 || ppid != daemon) continue;
+        *pss += bench_pss(pid);
+        n++;
+    }
+    closedir(dir);
+    return n;
+}
+
+// Read what the clients got until every one has seen as many prompts as
+// it is owed, sending the next command as each one comes, and timing each
+// command to the prompt after it. Returns -1 on a timeout.
+static int bench_drive(int ep, struct BenchClient *c, int n, int64_t *lat, int *nlat) {
+    int pending = 0;
+    for (int i = 0; i < n; i++) pending += c[i].rounds > 0;
+    int64_t deadline = bench_now() + 120 * 1000000000LL;
+    struct epoll_event ev[64];
+    char buf[4096];
+    while (pending > 0) {
+        int got = epoll_wait(ep, ev, 64, 1000);
+        if (bench_now() > deadline) return -1;
+        for (int e = 0; e < got; e++) {
+            struct BenchClient *b = ev[e].data.ptr;
+            ssize_t len = read(b->fd, buf, sizeof(buf));
+            if (len <= 0) return -1;
+            for (ssize_t i = 0; i < len; i++) {
+                b->matched = buf[i] == SERVE_PROMPT[b->matched] ? b->matched + 1 : buf[i] == SERVE_PROMPT[0];
+                if (SERVE_PROMPT[b->matched] || b->rounds <= 0) continue;
+                b->matched = 0;
+                int64_t now = bench_now();
+                if (b->sent) lat[(*nlat)++] = now - b->sent;
+                if (--b->rounds == 0) {
+                    pending--;
+                    b->sent = 0;
+                    continue;
+                }
+                b->sent = now;
+                serve_send(b->fd, SERVE_DATA, BENCH_COMMAND, sizeof(BENCH_COMMAND) - 1);
+            }
+        }
+    }
+    return 0;
+}
+
+// shellquest --serve-bench [-r rounds] [sessions...]: start a daemon,
+// open that many sessions at once, and report memory per session and how
+// long a command takes to come back to the prompt while all of them type.
+int serve_bench(int argc, char **argv) {
+    int counts[16], ncounts = 0, rounds = 20;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) rounds = atoi(argv[++i]);
+        else if (atoi(argv[i]) > 0 && ncounts < 16) counts[ncounts++] = atoi(argv[i]);
+        else {
+            printf("Usage: shellquest --serve-bench [-r rounds] [sessions...]\n");
+            return 2;
+        }
+    }
+    if (ncounts == 0) {
+        counts[0] = 10, counts[1] = 100, counts[2] = 500;
+        ncounts = 3;
+    }
+    if (rounds < 1) rounds = 1;
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    // A throwaway home for the sessions' progress, logs and socket
+    char dir[] = "/tmp/sqbench.XXXXXX", sock[64], path[64];
+    if (!mkdtemp(dir)) {
+        printf("Error: mkdtemp: %s\n", strerror(errno));
+        return 1;
+    }
+    snprintf(sock, sizeof(sock), "%s/serve.sock", dir);
+    snprintf(path, sizeof(path), "%s/progress", dir);
+    setenv("SHELLQUEST_PROGRESS", path, 1);
+    snprintf(path, sizeof(path), "%s/sessions", dir);
+    setenv("SHELLQUEST_LOG_DIR", path, 1);
+    pid_t daemon = fork();
+    if (daemon == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execl("/proc/self/exe", "shellquest", "--serve", "-s", sock, NULL);
+        _exit(127);
+    }
+    int up = 0;
+    for (int tries = 0; tries < 500 && !up; tries++) {
+        int fd = serve_connect(sock);
+        if (fd >= 0) {
+            close(fd);
+            up = 1;
+        } else {
+            usleep(10000);
+        }
+    }
+    int failed = !up;
+    if (!up) printf("Error: the server did not start\n");
+    else printf("%8s %14s %12s %10s %10s %10s %10s\n", "sessions", "PSS/session", "daemon PSS", "start s", "p50 ms",
+                "p99 ms", "max ms");
+    for (int k = 0; k < ncounts && !failed; k++) {
+        int n = counts[k];
+        struct BenchClient *c = calloc(n, sizeof(*c));
+        int64_t *lat = malloc((size_t)n * rounds * sizeof(int64_t));
+        int nlat = 0, ep = epoll_create1(EPOLL_CLOEXEC);
+        int64_t t0 = bench_now();
+        for (int i = 0; i < n && !failed; i++) {
+            struct ServeHello hello = { SERVE_MAGIC, 24, 80 };
+            c[i].fd = serve_connect(sock);
+            c[i].rounds = 1; // the first prompt
+            struct epoll_event ev = { EPOLLIN, { .ptr = &c[i] } };
+            failed = c[i].fd < 0 || serve_write_all(c[i].fd, &hello, sizeof(hello)) != 0 ||
+                     epoll_ctl(ep, EPOLL_CTL_ADD, c[i].fd, &ev) != 0;
+        }
+        if (!failed) failed = bench_drive(ep, c, n, lat, &nlat) != 0;
+        double start = (bench_now() - t0) / 1e9;
+        long pss = 0, daemon_pss = bench_pss(daemon);
+        int found = failed ? 0 : bench_sessions(daemon, &pss);
+        if (!failed) {
+            // Every client types at once, each sending its next command as
+            // soon as its prompt is back
+            nlat = 0;
+            for (int i = 0; i < n; i++) {
+                c[i].rounds = rounds;
+                c[i].sent = bench_now();
+                serve_send(c[i].fd, SERVE_DATA, BENCH_COMMAND, sizeof(BENCH_COMMAND) - 1);
+            }
+            failed = bench_drive(ep, c, n, lat, &nlat) != 0;
+        }
+        if (failed) {
+            printf("Error: %d sessions: %s\n", n, errno ? strerror(errno) : "timed out");
+        } else {
+            qsort(lat, nlat, sizeof(int64_t), bench_by_value);
+            printf("%8d %11ld KiB %8ld KiB %10.2f %10.2f %10.2f %10.2f\n", n, found ? pss / found : 0, daemon_pss,
+                   start, lat[nlat / 2] / 1e6, lat[nlat * 99 / 100] / 1e6, lat[nlat - 1] / 1e6);
+        }
+        fflush(stdout);
+        for (int i = 0; i < n; i++) {
+            if (c[i].fd >= 0) close(c[i].fd);
+        }
+        close(ep);
+        free(c);
+        free(lat);
+        // Let every session wind down before the next size
+        long ignored;
+        for (int tries = 0; tries < 3000 && bench_sessions(daemon, &ignored) > 0; tries++) usleep(10000);
+    }
+    kill(daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+    nftw(dir, fixture_unlink, 16, FTW_DEPTH | FTW_PHYS);
+    return failed;
+}
+
+// Script
+// Take what the shell and its children wrote since the last input, and
+// start over for the next
+static void script_collect() {
+    fflush(stdout);
+    fflush(stderr);
+    off_t end = lseek(script_capture, 0, SEEK_CUR);
+    ssize_t n = pread(script_capture, script_output, end < SCRIPT_OUTPUT_MAX ? end : SCRIPT_OUTPUT_MAX, 0);
+    script_output_len = n > 0 ? n : 0;
+    script_output[script_output_len] = '\0';
+    if (script_verbose && script_output_len) write(script_out, script_output, script_output_len);
+    ftruncate(script_capture, 0);
+    lseek(script_capture, 0, SEEK_SET);
+}
+
+static void script_fail(const char *fmt, ...) {
+    if (script_reason[0]) return; // the first failure is the one reported
+    int len = snprintf(script_reason, sizeof(script_reason), "line %d: ", script_line);
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(script_reason + len, sizeof(script_reason) - len, fmt, ap);
+    va_end(ap);
+}
+
+static void script_case_end() {
+    if (!script_case_open) return;
+    int64_t ns = perf_now() - script_case_start;
+    int failed = script_reason[0] != '\0';
+    script_cases++;
+    script_failed += failed;
+    if (script_terse) dprintf(script_out, "%s\t%d\t%lld\n", script_case, !failed, (long long)ns);
+    else dprintf(script_out, "%-4s %-12s %9.2f ms%s%s\n", failed ? "FAIL" : "ok", script_case, ns / 1e6,
+                 failed ? "  " : "", script_reason);
+    script_case_open = 0;
+    script_reason[0] = '\0';
+}
+
+// Run the script's checks up to its next input, and return that
+char *script_next() {
+    char *line = NULL;
+    size_t cap = 0;
+    script_collect();
+    while (getline(&line, &cap, script_in) > 0) {
+        script_line++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *key = line + strspn(line, " \t");
+        if (*key == '\0' || *key == '#') continue;
+        char *value = key + strcspn(key, " \t");
+        if (*value) *value++ = '\0';
+        value += strspn(value, " \t");
+        if (strcmp(key, "case") == 0) {
+            script_case_end();
+            snprintf(script_case, sizeof(script_case), "%s", value);
+            script_case_start = perf_now();
+            script_case_open = 1;
+            continue;
+        }
+        if (!script_case_open) {
+            // Lines before the first case make one of their own
+            snprintf(script_case, sizeof(script_case), "-");
+            script_case_start = perf_now();
+            script_case_open = 1;
+        }
+        if (strcmp(key, "input") == 0) {
+            char *input = strdup(value);
+            free(line);
+            if (script_verbose) dprintf(script_out, "%s\n", input);
+            return input;
+        }
+        if (strcmp(key, "expect") == 0) {
+            if (!strstr(script_output, value)) script_fail("no '%s' in the output", value);
+        } else if (strcmp(key, "reject") == 0) {
+            if (strstr(script_output, value)) script_fail("'%s' in the output", value);
+        } else if (strcmp(key, "done") == 0) {
+            int q = quest_lookup(quest_by_name, value, offsetof(struct Quest, name));
+            if (q < 0) script_fail("no quest '%s'", value);
+            else if (quest_progress[q].state != QUEST_DONE) script_fail("quest '%s' is not done", value);
+        } else if (strcmp(key, "xp") == 0) {
+            if (xp != atoi(value)) script_fail("XP is %d, not %s", xp, value);
+        } else {
+            script_fail("unknown line '%s'", key);
+        }
+    }
+    free(line);
+    script_case_end();
+    return NULL;
+}
+
+// shellquest --script [-v] [-t] [file]. The shell runs in a child, so the
+// scratch directory for its progress, logs and VFS image can be removed
+// from outside the sandbox.
+int script_main(int argc, char **argv) {
+    const char *path = "-";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) script_verbose = 1;
+        else if (strcmp(argv[i], "-t") == 0) script_terse = 1;
+        else if (argv[i][0] != '-' || strcmp(argv[i], "-") == 0) path = argv[i];
+        else {
+            printf("Usage: shellquest --script [-v] [-t] [file]\n");
+            return 2;
+        }
+    }
+    script_in = strcmp(path, "-") == 0 ? fdopen(dup(STDIN_FILENO), "r") : fopen(path, "re");
+    if (!script_in) {
+        printf("Error: cannot read %s: %s\n", path, strerror(errno));
+        return 2;
+    }
+    char dir[] = "/tmp/sqscript.XXXXXX", buf[PATH_MAX];
+    if (!mkdtemp(dir)) {
+        printf("Error: mkdtemp: %s\n", strerror(errno));
+        return 2;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        snprintf(buf, sizeof(buf), "%s/progress", dir);
+        setenv("SHELLQUEST_PROGRESS", buf, 1);
+        snprintf(buf, sizeof(buf), "%s/sessions", dir);
+        setenv("SHELLQUEST_LOG_DIR", buf, 1);
+        snprintf(vfs_image_path, sizeof(vfs_image_path), "%s/%s", dir, VFS_SERVE_IMAGE);
+        // No terminal: commands read /dev/null, and everything written
+        // lands in the memfd
+        script_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+        script_capture = memfd_create("shellquest-script", MFD_CLOEXEC);
+        int null = open("/dev/null", O_RDONLY);
+        if (script_out < 0 || script_capture < 0 || null < 0) {
+            printf("Error: cannot set up the script's output: %s\n", strerror(errno));
+            _exit(2);
+        }
+        dup2(null, STDIN_FILENO);
+        close(null);
+        dup2(script_capture, STDOUT_FILENO);
+        dup2(script_capture, STDERR_FILENO);
+        setvbuf(stdout, NULL, _IOLBF, BUFSIZ); // in order with the children's output
+        jobs_init();
+        quests_load();
+        load_progress();
+        vfs_init();
+        perf_open();
+        setup_sandbox();
+        shell_run();
+        script_collect();
+        if (!script_terse) dprintf(script_out, "%d case%s, %d failed\n", script_cases, script_cases == 1 ? "" : "s",
+                                   script_failed);
+        exit(script_failed ? 1 : 0);
+    }
+    int status = 2;
+    if (pid > 0) {
+        waitpid(pid, &status, 0);
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : 2;
+    }
+    nftw(dir, fixture_unlink, 16, FTW_DEPTH | FTW_PHYS);
+    return status;
+}
+
+// A script that plays every quest in catalogue order from a fresh start,
+// typing each step as written and declining the explanations
+static void script_write_quests(FILE *f) {
+    fprintf(f, "# Every quest in %s, in order, as a new learner would play them\n", quest_file_path());
+    for (int q = 0; q < quest_count; q++) {
+        struct Quest *quest = &quests[q];
+        if (quest->host) {
+            fprintf(f, "\n# %s: skipped, it needs the real system\n", QS(quest->name));
+            continue;
+        }
+        fprintf(f, "\ncase %s\ninput teach %s\n", QS(quest->name), QS(quest->name));
+        for (int i = 0; i < quest->nsteps; i++) {
+            struct QuestStep *st = &quest_steps[quest->first_step + i];
+            // An action quest's implicit step is done by starting it; a
+            // step that only waits says what to type instead
+            if (st->bench >= 0) fprintf(f, "input %s\n", QS(st->bench));
+            else if (st->text >= 0) fprintf(f, "input %s\n", QS(st->text));
+            if (st->brief >= 0) fprintf(f, "input n\n");
+        }
+        fprintf(f, "done %s\n", QS(quest->name));
+    }
+}
+
+int script_quests() {
+    quests_load();
+    script_write_quests(stdout);
+    return quest_count ? 0 : 1;
+}
+
+struct BenchCase {
+    char name[64];
+    int64_t *ns;
+    int runs, cap, failed;
+};
+
+static void bench_result(struct BenchCase **cases, int *ncases, char *line) {
+    char *pass = strchr(line, '\t'), *ns = pass ? strchr(pass + 1, '\t') : NULL;
+    if (!ns) return;
+    *pass++ = '\0';
+    *ns++ = '\0';
+    int c;
+    for (c = 0; c < *ncases && strcmp((*cases)[c].name, line) != 0; c++);
+    if (c == *ncases) {
+        *cases = realloc(*cases, (*ncases + 1) * sizeof(struct BenchCase));
+        (*cases)[c] = (struct BenchCase){0};
+        snprintf((*cases)[c].name, sizeof((*cases)[c].name), "%s", line);
+        (*ncases)++;
+    }
+    struct BenchCase *bc = &(*cases)[c];
+    if (atoi(pass) == 0) {
+        bc->failed++;
+        return;
+    }
+    if (bc->runs == bc->cap) {
+        bc->cap = bc->cap ? bc->cap * 2 : 16;
+        bc->ns = realloc(bc->ns, bc->cap * sizeof(int64_t));
+    }
+    bc->ns[bc->runs++] = atoll(ns);
+}
+
+// Take the whole lines in buf, keeping a partial one for later
+static void bench_results(char *buf, size_t *len, struct BenchCase **cases, int *ncases) {
+    char *line = buf, *nl;
+    while ((nl = memchr(line, '\n', buf + *len - line)) != NULL) {
+        *nl = '\0';
+        bench_result(cases, ncases, line);
+        line = nl + 1;
+    }
+    *len -= line - buf;
+    memmove(buf, line, *len);
+}
+
+// shellquest --bench [-n runs] [-j procs] [script]: the script (by default
+// the whole catalogue) run that many times, procs at a time, each run a
+// --script process of its own
+int script_bench(int argc, char **argv) {
+    int runs = 10, procs = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    const char *script = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) runs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) procs = atoi(argv[++i]);
+        else if (argv[i][0] != '-') script = argv[i];
+        else {
+            printf("Usage: shellquest --bench [-n runs] [-j procs] [script]\n");
+            return 2;
+        }
+    }
+    if (runs < 1) runs = 1;
+    if (procs < 1) procs = 1;
+    char generated[] = "/tmp/sqbench-quests.XXXXXX";
+    if (!script) {
+        int fd = mkstemp(generated);
+        FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (!f) {
+            printf("Error: mkstemp: %s\n", strerror(errno));
+            return 2;
+        }
+        quests_load();
+        script_write_quests(f);
+        fclose(f);
+        script = generated;
+    }
+    // Every run reports on one pipe; its lines are short enough to arrive whole
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        printf("Error: pipe2: %s\n", strerror(errno));
+        return 2;
+    }
+    struct BenchCase *cases = NULL;
+    int ncases = 0, started = 0, running = 0, crashed = 0;
+    char buf[8192];
+    size_t len = 0;
+    int64_t t0 = perf_now();
+    while (started < runs || running > 0) {
+        while (started < runs && running < procs) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                dup2(fds[1], STDOUT_FILENO);
+                execl("/proc/self/exe", "shellquest", "--script", "-t", script, NULL);
+                _exit(127);
+            }
+            if (pid < 0) break;
+            started++;
+            running++;
+        }
+        struct pollfd pfd = { fds[0], POLLIN, 0 };
+        if (poll(&pfd, 1, 10) > 0) {
+            ssize_t n = read(fds[0], buf + len, sizeof(buf) - 1 - len);
+            if (n > 0) len += n;
+            bench_results(buf, &len, &cases, &ncases);
+        }
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            running--;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) > 1) crashed++;
+        }
+    }
+    // What the last runs wrote before they exited
+    close(fds[1]);
+    ssize_t n;
+    while ((n = read(fds[0], buf + len, sizeof(buf) - 1 - len)) > 0) {
+        len += n;
+        bench_results(buf, &len, &cases, &ncases);
+    }
+    close(fds[0]);
+    double wall = (perf_now() - t0) / 1e9;
+    int passed = 0, failed = 0;
+    for (int c = 0; c < ncases; c++) {
+        passed += cases[c].runs;
+        failed += cases[c].failed;
+    }
+    printf("%d run%s of %s, %d at a time: %.2f s, %.1f quests/s, %d passed, %d failed%s\n", runs,
+           runs == 1 ? "" : "s", script == generated ? "every quest" : script, procs, wall, passed / wall, passed,
+           failed, crashed ? ", some runs crashed" : "");
+    printf("%-12s %6s %7s %10s %10s %10s\n", "case", "runs", "failed", "p50 ms", "p99 ms", "max ms");
+    for (int c = 0; c < ncases; c++) {
+        struct BenchCase *bc = &cases[c];
+        qsort(bc->ns, bc->runs, sizeof(int64_t), bench_by_value);
+        if (bc->runs) {
+            printf("%-12s %6d %7d %10.2f %10.2f %10.2f\n", bc->name, bc->runs, bc->failed,
+                   bc->ns[bc->runs / 2] / 1e6, bc->ns[bc->runs * 99 / 100] / 1e6, bc->ns[bc->runs - 1] / 1e6);
+        } else {
+            printf("%-12s %6d %7d %10s %10s %10s\n", bc->name, 0, bc->failed, "-", "-", "-");
+        }
+        free(bc->ns);
+    }
+    free(cases);
+    if (script == generated) unlink(generated);
+    return failed || crashed ? 1 : 0;
 }
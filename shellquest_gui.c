@@ -1,24 +1,151 @@
 #include <gtk/gtk.h>
+#include <glib-unix.h>
 #include <vte/vte.h>
+#include <sys/inotify.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "progress.h"
+#include "shellquest-module/shellquest_stats.h"
+
+// Progress widgets. shellquest replaces its progress store by renaming a
+// new file into place; an inotify watch on the directory refreshes these
+// as soon as that happens, and nothing is read while the learner is idle.
+struct ProgressView {
+    char path[PATH_MAX];
+    const char *file; // basename of path, as inotify names it
+    GtkWidget *label, *xp_bar;
+    GtkListStore *quests;
+};
+
+enum { COL_NAME, COL_STATE, COL_FINISHED, N_COLS };
+
+// The learner's place among everyone on this machine, from the kernel
+// module's binary records (best XP first), or 0 if it is not loaded.
+static int leaderboard_rank(int *learners) {
+    struct sq_record rec[64];
+    ssize_t n;
+    int rank = 0, seen = 0;
+    int fd = open("/proc/shellquest/records", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    while ((n = read(fd, rec, sizeof(rec))) > 0) {
+        for (size_t i = 0; i < n / sizeof(rec[0]); i++) {
+            seen++;
+            if (!rank && rec[i].uid == getuid()) rank = seen;
+        }
+    }
+    close(fd);
+    *learners = seen;
+    return rank;
+}
 
 static void on_exit_button_clicked(GtkWidget *widget, gpointer data) {
     system("konsole -e zsh"); // Use KDE's konsole
     gtk_main_quit();
 }
 
-static void update_progress_label(GtkWidget *label) {
-    FILE *fp = fopen("/tmp/shellquest/.quest_progress", "r");
-    if (fp) {
-        int xp, level, quests, ls_stage;
-        fscanf(fp, "%d %d %d %d", &xp, &level, &quests, &ls_stage);
-        fclose(fp);
-        char text[128];
-        snprintf(text, sizeof(text), "Progress: XP=%d, Level=%d, Quests=%d/8", xp, level, quests);
-        gtk_label_set_text(GTK_LABEL(label), text);
+// Load the store into the widgets. A missing, torn or foreign file leaves
+// them as they were.
+static void update_progress(struct ProgressView *view) {
+    gchar *buf;
+    gsize len;
+    struct ProgressHeader hdr;
+    if (!g_file_get_contents(view->path, &buf, &len, NULL)) return;
+    if (len < sizeof(hdr)) {
+        g_free(buf);
+        return;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.magic != PROGRESS_MAGIC || hdr.version != PROGRESS_VERSION ||
+        len != sizeof(hdr) + hdr.nquests * sizeof(struct ProgressRecord) ||
+        hdr.checksum != progress_checksum(buf + sizeof(hdr), len - sizeof(hdr))) {
+        g_free(buf);
+        return;
     }
+
+    char text[128];
+    int used = snprintf(text, sizeof(text), "Progress: XP=%d, Level=%d, Quests=%d/%u", hdr.xp, hdr.level, hdr.completed, hdr.nquests);
+    int learners, rank = leaderboard_rank(&learners);
+    if (rank) snprintf(text + used, sizeof(text) - used, ", Rank %d of %d", rank, learners);
+    gtk_label_set_text(GTK_LABEL(view->label), text);
+
+    // Level n+1 takes n * 50 XP
+    int from = (hdr.level - 1) * 50, to = hdr.level * 50;
+    double fraction = (double)(hdr.xp - from) / (to - from);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(view->xp_bar), fraction < 0 ? 0 : fraction > 1 ? 1 : fraction);
+    snprintf(text, sizeof(text), "XP %d / %d to level %d", hdr.xp, to, hdr.level + 1);
+    gtk_progress_bar_set_text(GTK_PROGRESS_BAR(view->xp_bar), text);
+
+    gtk_list_store_clear(view->quests);
+    struct ProgressRecord *rec = (struct ProgressRecord *)(buf + sizeof(hdr));
+    for (uint32_t i = 0; i < hdr.nquests; i++) {
+        char name[PROGRESS_NAME_MAX], finished[32] = "";
+        snprintf(name, sizeof(name), "%.*s", PROGRESS_NAME_MAX - 1, rec[i].name);
+        if (rec[i].state == QUEST_DONE && rec[i].finished_at) {
+            time_t t = rec[i].finished_at;
+            strftime(finished, sizeof(finished), "%H:%M", localtime(&t));
+        }
+        GtkTreeIter it;
+        gtk_list_store_append(view->quests, &it);
+        gtk_list_store_set(view->quests, &it, COL_NAME, name,
+                           COL_STATE, rec[i].state == QUEST_DONE ? "✓" : rec[i].state == QUEST_STARTED ? "…" : "",
+                           COL_FINISHED, finished, -1);
+    }
+    g_free(buf);
+}
+
+static gboolean on_progress_event(gint fd, GIOCondition condition, gpointer data) {
+    struct ProgressView *view = data;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    int changed = 0;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len && strcmp(ev->name, view->file) == 0) changed = 1;
+        }
+    }
+    if (changed) update_progress(view);
+    return G_SOURCE_CONTINUE;
+}
+
+static void watch_progress(struct ProgressView *view) {
+    progress_default_path(view->path, sizeof(view->path));
+    char *slash = strrchr(view->path, '/');
+    view->file = slash ? slash + 1 : view->path;
+    // The shell may not have run yet: make the directory so it can be watched
+    gchar *dir = g_path_get_dirname(view->path);
+    g_mkdir_with_parents(dir, 0700);
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd >= 0 && inotify_add_watch(fd, dir, IN_MOVED_TO | IN_CLOSE_WRITE) >= 0) {
+        g_unix_fd_add(fd, G_IO_IN, on_progress_event, view);
+    } else {
+        g_warning("cannot watch %s for progress updates", dir);
+    }
+    g_free(dir);
+    update_progress(view);
+}
+
+static GtkWidget *quest_list_new(struct ProgressView *view) {
+    view->quests = gtk_list_store_new(N_COLS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+    GtkWidget *tree = gtk_tree_view_new_with_model(GTK_TREE_MODEL(view->quests));
+    const char *titles[N_COLS] = {"Quest", "", "Done at"};
+    for (int col = 0; col < N_COLS; col++) {
+        GtkCellRenderer *cell = gtk_cell_renderer_text_new();
+        gtk_tree_view_append_column(GTK_TREE_VIEW(tree),
+                                    gtk_tree_view_column_new_with_attributes(titles[col], cell, "text", col, NULL));
+    }
+    GtkWidget *scroll = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll), GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_widget_set_size_request(scroll, 200, -1);
+    gtk_container_add(GTK_CONTAINER(scroll), tree);
+    return scroll;
 }
 
 int main(int argc, char *argv[]) {
+    struct ProgressView view;
     gtk_init(&argc, &argv);
 
     GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
@@ -32,20 +159,29 @@ int main(int argc, char *argv[]) {
     GtkWidget *help_label = gtk_label_new("Welcome to ShellQuest! Type 'teach ls' below. Use buttons for help.");
     gtk_box_pack_start(GTK_BOX(vbox), help_label, FALSE, FALSE, 0);
 
-    GtkWidget *progress_label = gtk_label_new("Progress: XP=0, Level=1, Quests=0/8");
-    gtk_box_pack_start(GTK_BOX(vbox), progress_label, FALSE, FALSE, 0);
+    view.label = gtk_label_new("Progress: XP=0, Level=1");
+    gtk_box_pack_start(GTK_BOX(vbox), view.label, FALSE, FALSE, 0);
+
+    view.xp_bar = gtk_progress_bar_new();
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(view.xp_bar), TRUE);
+    gtk_box_pack_start(GTK_BOX(vbox), view.xp_bar, FALSE, FALSE, 0);
+
+    GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(vbox), hbox, TRUE, TRUE, 0);
 
     GtkWidget *terminal = vte_terminal_new();
-    char *shell_args[] = {"/usr/local/bin/shellquest", NULL};
+    // A session of the running daemon if there is one, else a shell of its own
+    char *shell_args[] = {"/usr/local/bin/shellquest", "--attach", NULL};
     vte_terminal_spawn_async(VTE_TERMINAL(terminal), VTE_PTY_DEFAULT, NULL, shell_args, NULL,
                             G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, -1, NULL, NULL, NULL);
-    gtk_box_pack_start(GTK_BOX(vbox), terminal, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), terminal, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), quest_list_new(&view), FALSE, FALSE, 0);
 
     GtkWidget *exit_button = gtk_button_new_with_label("Exit to Standard Terminal");
     g_signal_connect(exit_button, "clicked", G_CALLBACK(on_exit_button_clicked), NULL);
     gtk_box_pack_start(GTK_BOX(vbox), exit_button, FALSE, FALSE, 0);
 
-    g_timeout_add_seconds(1, (GSourceFunc)update_progress_label, progress_label);
+    watch_progress(&view);
 
     gtk_widget_show_all(window);
     gtk_main();